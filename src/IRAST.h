@@ -18,31 +18,43 @@ static string *curWhileEntry = nullptr;
 static string *curWhileEnd = nullptr;
 static vector<int> arrayDimensions;
 static vector<int>::iterator alignEnd; // 用于递归时的对齐，遍历[vec.rend(), alignEnd)来获得可对齐的最大边界
+static string hoistedGlobals; // 函数内定义、提升为全局的数据，输出在所有函数之前
 class BaseAST;
 
+// 数组初始化列表的稀疏表示，只记录显式给出初始值的元素，其余元素为 0
+struct InitList {
+    int size; // 展平后的元素个数
+    map<int, BaseAST*> elems; // 展平后的下标 -> 初始值
+
+    InitList() { size = 0; }
+    BaseAST* find(int index) {
+        auto it = elems.find(index);
+        return (it == elems.end()) ? nullptr : it->second;
+    }
+    int value(int index);
+};
+
 struct CalcResult {
     bool err;
     bool array;
     int result;
-    vector<BaseAST*> *ptr;
+    shared_ptr<InitList> init;
 
     CalcResult(bool _err) { 
         err = _err;
         array = 0;
         result = 0;
-        ptr = nullptr;
     }
     CalcResult(bool _err, int _result) {
         err = _err;
         array = 0;
         result = _result;
-        ptr = nullptr;
     }
     CalcResult(bool _err, bool _array, int _result) {
         err = _err;
         array = _array;
         result = _result;
-        ptr = new vector<BaseAST*>;
+        init = make_shared<InitList>();
     }
 };
 
@@ -55,6 +67,7 @@ struct Symbol {
         int func_has_ret; // 1 if func has ret
         vector<int>* array_dim_ptr; // ptr to vector of dimension, available if tag=3/4
     } data;
+    shared_ptr<InitList> const_init; // initializer of a const array, tag=3
 
     Symbol(int _tag, int val) {
         if (_tag==0) {
@@ -137,6 +150,55 @@ struct SymbolTableNode {
 static SymbolTableNode *current_node = nullptr;
 //static SymbolTable symbol_table;
 
+// 局部数组中零元素较多时，用循环清零代替逐个 store
+static const int zeroLoopThreshold = 16;
+
+// base 为指向首元素的 *i32，将 total 个元素置零
+static void GenZeroLoop(string &str, const string &base, int total) {
+    string counter = "%" + to_string(id++);
+    string flagEntry = "\%entry_" + to_string(blockId++);
+    string flagBody = "%body_" + to_string(blockId++);
+    string flagEnd = "\%end_" + to_string(blockId++);
+    str += counter + " = alloc i32\n";
+    str += "store 0, " + counter + "\n";
+    str += "jump " + flagEntry + "\n";
+    str += flagEntry + ":\n";
+    str += "%" + to_string(id) + " = load " + counter + "\n";
+    str += "%" + to_string(id + 1) + " = lt %" + to_string(id) + ", " + to_string(total) + "\n";
+    str += "br %" + to_string(id + 1) + ", " + flagBody + ", " + flagEnd + "\n";
+    id += 2;
+    str += flagBody + ":\n";
+    str += "%" + to_string(id) + " = load " + counter + "\n";
+    str += "%" + to_string(id + 1) + " = getptr " + base + ", %" + to_string(id) + "\n";
+    str += "store 0, %" + to_string(id + 1) + "\n";
+    str += "%" + to_string(id + 2) + " = add %" + to_string(id) + ", 1\n";
+    str += "store %" + to_string(id + 2) + ", " + counter + "\n";
+    str += "jump " + flagEntry + "\n";
+    id += 3;
+    str += flagEnd + ":\n";
+}
+
+// 全局数组的初始值，展平下标 [offset, offset + total) 的部分
+// nonZero 中只有非零元素，全为零的子数组用 zeroinit 表示
+static void GenGlobalInit(string &str, map<int, int> &nonZero, const vector<int> &dims, int level, int offset, int total) {
+    auto it = nonZero.lower_bound(offset);
+    if (it == nonZero.end() || it->first >= offset + total) {
+        str += (level == (int)dims.size()) ? "0" : "zeroinit";
+        return;
+    }
+    if (level == (int)dims.size()) {
+        str += to_string(it->second);
+        return;
+    }
+    int sub = total / dims[level];
+    str += "{";
+    for (int i = 0; i < dims[level]; i++) {
+        if (i > 0)
+            str += ", ";
+        GenGlobalInit(str, nonZero, dims, level + 1, offset + i * sub, sub);
+    }
+    str += "}";
+}
 
 // 所有 AST 的基类
 class BaseAST {
@@ -150,8 +212,27 @@ public:
     virtual CalcResult Calc() {
         return CalcResult(true);
     }
+
+    // 带缓存的常量求值，每个结点只调用一次 Calc
+    // 数组的初始值由 init 共享，不会被重复展开
+    CalcResult Eval() {
+        if (!evaluated) {
+            evalResult = Calc();
+            evaluated = true;
+        }
+        return evalResult;
+    }
+
+private:
+    bool evaluated = false;
+    CalcResult evalResult = CalcResult(true);
 };
 
+inline int InitList::value(int index) {
+    BaseAST *elem = find(index);
+    return (elem == nullptr) ? 0 : elem->Eval().result;
+}
+
 class TemplateAST : public BaseAST {
 public:
 
@@ -208,9 +289,11 @@ public:
         node->table.id = tableId++;
         current_node = node;
         GenLibFuncKoopa(str);
+        string body;
         for (auto it = comp_units->begin(); it != comp_units->end();it++) {
-            (*it)->GenKoopa(str);
+            (*it)->GenKoopa(body);
         }
+        str += hoistedGlobals + body;
         current_node = node->parent;
         delete node;
     }
@@ -391,7 +474,7 @@ public:
             int size = data2.const_exps->size();
             data2.dimensions.resize(size);
             for (int i = 0; i < size;i++) {
-                data2.dimensions[i] = (*data2.const_exps)[i]->Calc().result;
+                data2.dimensions[i] = (*data2.const_exps)[i]->Eval().result;
             }
             Symbol sym(4, &data2.dimensions);
             current_node->table.insert(data2.ident, sym);
@@ -481,7 +564,7 @@ public:
     void GenKoopa(string &str) override {
         bool global = (current_node->parent == nullptr);
         if (tag == 0) {
-            CalcResult result = data0.const_init_val->Calc();
+            CalcResult result = data0.const_init_val->Eval();
             assert(!result.err && !result.array);
             cout << data0.ident << " " << result.err << " " << result.result << endl;
             Symbol sym(0, result.result);
@@ -490,85 +573,37 @@ public:
         else if (tag == 1) {
             arrayDimensions.clear();
             int size = data1.const_exps->size();
-            int totalDimension = 1;
             data1.dimensions.resize(size);
             for (int i = 0; i < size;i++) {
-                data1.dimensions[i] = (*data1.const_exps)[i]->Calc().result;
+                data1.dimensions[i] = (*data1.const_exps)[i]->Eval().result;
                 arrayDimensions.push_back(data1.dimensions[i]);
-                totalDimension *= data1.dimensions[i];
             }
             alignEnd = arrayDimensions.begin();
+            shared_ptr<InitList> list = data1.const_init_val->Eval().init;
             Symbol sym(3, &data1.dimensions);
+            sym.const_init = list;
             current_node->table.insert(data1.ident, sym);
-            if (!global) {
-                string variable = "@" + data1.ident + "_" + to_string(current_node->table.id);
-                str += variable + " = alloc " + string(size, '[') + "i32";
-                for (int i = size - 1; i >= 0;i--)
-                    str += ", " + to_string(data1.dimensions[i]) + "]";
-                str += "\n";
-                vector<BaseAST*> *ptr = data1.const_init_val->Calc().ptr;
-                int index = 1, init = 0;
-                auto it = ptr->begin();
-                init = 0;
-                if ((*it) != nullptr)
-                    init = (*it)->Calc().result;
-                str += "%" + to_string(id++) + " = getelemptr " + variable + ", 0\n";
-                for (int i = 1; i < size;i++) {
-                    str += "%" + to_string(id) + " = getelemptr %" + to_string(id - 1) + ", 0\n";
-                    id++;
-                }
-                str += "store " + to_string(init) + ", %" + to_string(id - 1) + "\n";
-                string base = (size == 1) ? variable : ("%" + to_string(id - 2));
-                for (it++; it != ptr->end(); it++, index++) {
-                    init = 0;
-                    if ((*it) != nullptr)
-                        init = (*it)->Calc().result;
-                    str += "%" + to_string(id) + " = getelemptr " + base + ", " + to_string(index) + "\n";
-                    str += "store " + to_string(init) + ", %" + to_string(id++) + "\n";
-                }
-                str += "\n";
-                delete ptr;
-            }
-            else {
-                str += "global @" + data1.ident + "_" + to_string(current_node->table.id) + " = alloc " + string(size, '[') + "i32";
-                vector<int> curlyBraceNums(totalDimension + 1, 0);
-                int mul = 1;
-                for (int i = size - 1; i >= 0;i--) {
-                    str += ", " + to_string(data1.dimensions[i]) + "]";
-                    mul *= data1.dimensions[i];
-                    for (int j = mul; j <= totalDimension;j+=mul) 
-                        curlyBraceNums[j]++;
-                }
-                str += ", " + string(size, '{');
-                vector<BaseAST *> *ptr = data1.const_init_val->Calc().ptr;
-                int init = 0, index = 0;
-                if ((*ptr)[index] != nullptr)
-                    init = (*ptr)[index]->Calc().result;
-                str += to_string(init);
-                for (index++; index != ptr->size();index++) {
-                    init = 0;
-                    if ((*ptr)[index] != nullptr)
-                        init = (*ptr)[index]->Calc().result;
-                    if (curlyBraceNums[index] > 0) {
-                        str += ", " + string(curlyBraceNums[index], '{') + to_string(init);
-                    }
-                    else if (curlyBraceNums[index+1] > 0){
-                        str += ", " + to_string(init) + string(curlyBraceNums[index + 1], '}');
-                    }
-                    else {
-                        str += ", " + to_string(init);
-                    }
-                }
-                str += "\n\n";
-                delete ptr;
+            // const 数组不会被修改，局部的也作为全局数据只初始化一次
+            string &dest = global ? str : hoistedGlobals;
+            dest += "global @" + data1.ident + "_" + to_string(current_node->table.id) + " = alloc " + string(size, '[') + "i32";
+            for (int i = size - 1; i >= 0;i--)
+                dest += ", " + to_string(data1.dimensions[i]) + "]";
+            map<int, int> nonZero;
+            for (auto it = list->elems.begin(); it != list->elems.end(); it++) {
+                int init = list->value(it->first);
+                if (init != 0)
+                    nonZero[it->first] = init;
             }
+            dest += ", ";
+            GenGlobalInit(dest, nonZero, data1.dimensions, 0, 0, list->size);
+            dest += "\n\n";
         }
     }
 
     CalcResult Calc() override {
         switch (tag) {
         case 0:
-            return data0.const_init_val->Calc();
+            return data0.const_init_val->Eval();
         }
         return CalcResult(true);
     }
@@ -599,22 +634,22 @@ public:
         }
         cout << "new arr, num " << num << endl;
         if (tag == 0) {
-            return data0.const_exp->Calc();
+            return data0.const_exp->Eval();
         }
         else if (tag == 1) {
             CalcResult result(false, true, 0);
-            result.ptr->resize(num, nullptr);
+            result.init->size = num;
             return result;
         }
         else if (tag == 2) {
             CalcResult result(false, true, 0);
-            result.ptr->resize(num, nullptr);
+            result.init->size = num;
             int index = 0;
             auto save = alignEnd;
             for (auto it = data2.const_init_vals->begin(); it != data2.const_init_vals->end(); it++) {
                 ConstInitValAST *tmp = dynamic_cast<ConstInitValAST*>((*it).get());
                 if (tmp->tag==0) {
-                    (*result.ptr)[index] = (*it).get();
+                    result.init->elems[index] = (*it).get();
                     index++;
                 }
                 else {
@@ -626,11 +661,10 @@ public:
                     }
                     alignEnd++;
                     assert(alignEnd != arrayDimensions.end());
-                    CalcResult init_val = (*it)->Calc();
-                    for (int i = 0; i < init_val.ptr->size(); i++, index++) {
-                        (*result.ptr)[index] = (*init_val.ptr)[i];
-                    }
-                    delete init_val.ptr;
+                    CalcResult init_val = (*it)->Eval();
+                    for (auto elem = init_val.init->elems.begin(); elem != init_val.init->elems.end(); elem++)
+                        result.init->elems[index + elem->first] = elem->second;
+                    index += init_val.init->size;
                     cout << "const index " << index << " array\n";
                 }
             }
@@ -675,22 +709,22 @@ public:
         }
         cout << "new arr, num " << num << endl;
         if (tag == 0) {
-            return data0.exp->Calc();
+            return data0.exp->Eval();
         }
         else if (tag == 1) {
             CalcResult result(false, true, 0);
-            result.ptr->resize(num, nullptr);
+            result.init->size = num;
             return result;
         }
         else if (tag == 2) {
             CalcResult result(false, true, 0);
-            result.ptr->resize(num, nullptr);
+            result.init->size = num;
             int index = 0;
             auto save = alignEnd;
             for (auto it = data2.init_vals->begin(); it != data2.init_vals->end(); it++) {
                 InitValAST *tmp = dynamic_cast<InitValAST*>((*it).get());
                 if (tmp->tag==0) {
-                    (*result.ptr)[index] = (*it).get();
+                    result.init->elems[index] = (*it).get();
                     index++;
                 }
                 else {
@@ -702,11 +736,10 @@ public:
                     }
                     alignEnd++;
                     assert(alignEnd != arrayDimensions.end());
-                    CalcResult init_val = (*it)->Calc();
-                    for (int i = 0; i < init_val.ptr->size(); i++, index++) {
-                        (*result.ptr)[index] = (*init_val.ptr)[i];
-                    }
-                    delete init_val.ptr;
+                    CalcResult init_val = (*it)->Eval();
+                    for (auto elem = init_val.init->elems.begin(); elem != init_val.init->elems.end(); elem++)
+                        result.init->elems[index + elem->first] = elem->second;
+                    index += init_val.init->size;
                     cout << "var index " << index << " array\n";
                 }
             }
@@ -715,9 +748,9 @@ public:
         }
         else if (tag == 2) {
             CalcResult result(false, true, 0);
-            result.ptr->resize(num, nullptr);
+            result.init->size = num;
             for (int i = 0; i < data2.init_vals->size();i++) {
-                (*result.ptr)[i] = (*data2.init_vals)[i].get();
+                result.init->elems[i] = (*data2.init_vals)[i].get();
             }
             return result;
         }
@@ -787,7 +820,7 @@ public:
             }
             else {
                 str += "global @" + data1.ident + "_" + to_string(current_node->table.id) + " = alloc i32, ";
-                CalcResult result = data1.init_val->Calc();
+                CalcResult result = data1.init_val->Eval();
                 assert(!result.err && !result.array);
                 cout << "global " << data1.ident << " " << result.err << " " << result.result << endl;
                 str += to_string(result.result) + "\n\n";
@@ -798,7 +831,7 @@ public:
             int size = data2.const_exps->size();
             data2.dimensions.resize(size);
             for (int i = 0; i < size;i++) {
-                data2.dimensions[i] = (*data2.const_exps)[i]->Calc().result;
+                data2.dimensions[i] = (*data2.const_exps)[i]->Eval().result;
                 arrayDimensions.push_back(data2.dimensions[i]);
             }
             alignEnd = arrayDimensions.begin();
@@ -821,12 +854,10 @@ public:
         else if (tag == 3) {
             arrayDimensions.clear();
             int size = data3.const_exps->size();
-            int totalDimension = 1;
             data3.dimensions.resize(size);
             for (int i = 0; i < size;i++) {
-                data3.dimensions[i] = (*data3.const_exps)[i]->Calc().result;
+                data3.dimensions[i] = (*data3.const_exps)[i]->Eval().result;
                 arrayDimensions.push_back(data3.dimensions[i]);
-                totalDimension *= data3.dimensions[i];
             }
             alignEnd = arrayDimensions.begin();
             Symbol arrSym(3, &data3.dimensions);
@@ -839,28 +870,37 @@ public:
                 for (int i = size - 1; i >= 0;i--)
                     str += ", " + to_string(data3.dimensions[i]) + "]";
                 str += "\n";
-                vector<BaseAST*> *ptr = data3.init_val->Calc().ptr;
-                int index = 1, destId;
-                auto it = ptr->begin();
+                shared_ptr<InitList> list = data3.init_val->Eval().init;
+                int destId;
                 str += "%" + to_string(id++) + " = getelemptr " + variable + ", 0\n";
                 for (int i = 1; i < size;i++) {
                     str += "%" + to_string(id) + " = getelemptr %" + to_string(id - 1) + ", 0\n";
                     id++;
                 }
-                destId = id - 1;
+                int firstId = id - 1;
                 string base = (size == 1) ? variable : ("%" + to_string(id - 2));
-                if ((*it) != nullptr) {
-                    (*it)->GenKoopa(str);
-                    str += "store %" + to_string(id - 1) + ", %" + to_string(destId) + "\n";
+                // 显式给出的初始值仍逐个计算并 store
+                vector<int> indices;
+                bool zeroLoop = (list->size - (int)list->elems.size() > zeroLoopThreshold);
+                if (zeroLoop) {
+                    GenZeroLoop(str, "%" + to_string(firstId), list->size);
+                    for (auto it = list->elems.begin(); it != list->elems.end(); it++)
+                        indices.push_back(it->first);
                 }
                 else {
-                    str += "store 0, %" + to_string(destId) + "\n";
+                    indices.resize(list->size);
+                    for (int i = 0; i < list->size; i++)
+                        indices[i] = i;
                 }
-                for (it++; it != ptr->end();it++, index++) {
-                    str += "%" + to_string(id) + " = getelemptr " + base + ", " + to_string(index) + "\n";
-                    destId = id++;
-                    if ((*it) != nullptr) {
-                        (*it)->GenKoopa(str);
+                for (int index : indices) {
+                    BaseAST *elem = list->find(index);
+                    destId = firstId;
+                    if (index > 0) {
+                        str += "%" + to_string(id) + " = getelemptr " + base + ", " + to_string(index) + "\n";
+                        destId = id++;
+                    }
+                    if (elem != nullptr) {
+                        elem->GenKoopa(str);
                         str += "store %" + to_string(id - 1) + ", %" + to_string(destId) + "\n";
                     }
                     else {
@@ -868,40 +908,21 @@ public:
                     }
                 }
                 str += "\n";
-                delete ptr;
             }
             else {
                 str += "global " + variable + " = alloc " + string(size, '[') + "i32";
-                vector<int> curlyBraceNums(totalDimension + 1, 0);
-                int mul = 1;
-                for (int i = size - 1; i >= 0;i--) {
+                for (int i = size - 1; i >= 0;i--)
                     str += ", " + to_string(data3.dimensions[i]) + "]";
-                    mul *= data3.dimensions[i];
-                    for (int j = mul; j <= totalDimension;j+=mul) 
-                        curlyBraceNums[j]++;
-                }
-                str += ", " + string(size, '{');
-                vector<BaseAST*> *ptr = data3.init_val->Calc().ptr;
-                int init = 0, index = 0;
-                if ((*ptr)[index] != nullptr)
-                    init = (*ptr)[index]->Calc().result;
-                str += to_string(init);
-                for (index++; index != ptr->size();index++) {
-                    init = 0;
-                    if ((*ptr)[index] != nullptr)
-                        init = (*ptr)[index]->Calc().result;
-                    if (curlyBraceNums[index] > 0) {
-                        str += ", " + string(curlyBraceNums[index], '{') + to_string(init);
-                    }
-                    else if (curlyBraceNums[index+1] > 0){
-                        str += ", " + to_string(init) + string(curlyBraceNums[index + 1], '}');
-                    }
-                    else {
-                        str += ", " + to_string(init);
-                    }
+                shared_ptr<InitList> list = data3.init_val->Eval().init;
+                map<int, int> nonZero;
+                for (auto it = list->elems.begin(); it != list->elems.end(); it++) {
+                    int init = list->value(it->first);
+                    if (init != 0)
+                        nonZero[it->first] = init;
                 }
+                str += ", ";
+                GenGlobalInit(str, nonZero, data3.dimensions, 0, 0, list->size);
                 str += "\n\n";
-                delete ptr;
             }
         }
     }
@@ -942,6 +963,11 @@ public:
             }
         }
         else if (tag == 1) {
+            CalcResult folded = Eval();
+            if (!folded.err) {
+                str += "%" + to_string(id++) + " = add 0, " + to_string(folded.result) + "\n";
+                return;
+            }
             SymbolTable *table = current_node->findTable(data1.ident);
             Symbol sym = table->find(data1.ident);
             assert(sym.tag == 3 || sym.tag == 4);
@@ -978,17 +1004,36 @@ public:
     }
 
     CalcResult Calc() override {
+        if (current_node == nullptr)
+            return CalcResult(true);
         if (tag == 0) {
-            if (current_node == nullptr)
-                return CalcResult(true);
             SymbolTable *table = current_node->findTable(data0.ident);
             if (!table || !table->check(data0.ident))
                 return CalcResult(true);
-            else {
-                Symbol sym = table->find(data0.ident);
-                assert(sym.tag == 0);
-                return CalcResult(false, sym.data.const_val);
+            Symbol sym = table->find(data0.ident);
+            if (sym.tag != 0)
+                return CalcResult(true);
+            return CalcResult(false, sym.data.const_val);
+        }
+        else if (tag == 1) {
+            // const 数组的元素，下标均为常量时直接取初始值
+            SymbolTable *table = current_node->findTable(data1.ident);
+            if (!table || !table->check(data1.ident))
+                return CalcResult(true);
+            Symbol sym = table->find(data1.ident);
+            if (sym.tag != 3 || sym.const_init == nullptr)
+                return CalcResult(true);
+            vector<int> &dims = *sym.data.array_dim_ptr;
+            if (data1.exps->size() != dims.size())
+                return CalcResult(true);
+            int index = 0;
+            for (int i = 0; i < (int)dims.size(); i++) {
+                CalcResult t = (*data1.exps)[i]->Eval();
+                if (t.err || t.array || t.result < 0 || t.result >= dims[i])
+                    return CalcResult(true);
+                index = index * dims[i] + t.result;
             }
+            return CalcResult(false, sym.const_init->value(index));
         }
         return CalcResult(true);
     }
@@ -1382,7 +1427,7 @@ public:
 
     CalcResult Calc() override
     {
-        return l_or_exp->Calc();
+        return l_or_exp->Eval();
     }
 };
 
@@ -1430,11 +1475,11 @@ public:
     CalcResult Calc() override {
         switch (tag) {
         case 0:
-            return data0.exp->Calc();
+            return data0.exp->Eval();
         case 1:
             return CalcResult(false, data1.number);
         case 2:
-            return data2.l_val->Calc();
+            return data2.l_val->Eval();
         default:
             return CalcResult(true);
         }
@@ -1530,11 +1575,12 @@ public:
     CalcResult Calc() override {
         switch(tag) {
         case 0:
-            return data0.primary_exp->Calc();
+            return data0.primary_exp->Eval();
         case 1:
-            CalcResult t = data1.unary_exp->Calc();
-            assert(!t.err && !t.array);
-            int op = data1.unary_op->Calc().result;
+            CalcResult t = data1.unary_exp->Eval();
+            if (t.err || t.array)
+                return CalcResult(true);
+            int op = data1.unary_op->Eval().result;
             int result = 0;
             if (op==0)
                 result = t.result;
@@ -1645,11 +1691,13 @@ public:
     CalcResult Calc() override {
         switch(tag) {
         case 0:
-            return data0.unary_exp->Calc();
+            return data0.unary_exp->Eval();
         case 1:
-            CalcResult t1 = data1.mul_exp->Calc(), t2 = data1.unary_exp->Calc();
-            assert(!t1.err && !t1.array);
-            assert(!t2.err && !t2.array);
+            CalcResult t1 = data1.mul_exp->Eval(), t2 = data1.unary_exp->Eval();
+            if (t1.err || t1.array || t2.err || t2.array)
+                return CalcResult(true);
+            if (data1.op != DATA1::OP_MUL && t2.result == 0)
+                return CalcResult(true);
             int result = 0;
             if (data1.op==DATA1::OP_MUL)
                 result = t1.result * t2.result;
@@ -1710,11 +1758,11 @@ public:
     CalcResult Calc() override {
         switch(tag) {
         case 0:
-            return data0.mul_exp->Calc();
+            return data0.mul_exp->Eval();
         case 1:
-            CalcResult t1 = data1.add_exp->Calc(), t2 = data1.mul_exp->Calc();
-            assert(!t1.err && !t1.array);
-            assert(!t2.err && !t2.array);
+            CalcResult t1 = data1.add_exp->Eval(), t2 = data1.mul_exp->Eval();
+            if (t1.err || t1.array || t2.err || t2.array)
+                return CalcResult(true);
             int result = -1;
             if (data1.op==DATA1::OP_ADD)
                 result = t1.result + t2.result;
@@ -1781,11 +1829,11 @@ public:
     CalcResult Calc() override {
         switch(tag) {
         case 0:
-            return data0.add_exp->Calc();
+            return data0.add_exp->Eval();
         case 1:
-            CalcResult t1 = data1.rel_exp->Calc(), t2 = data1.add_exp->Calc();
-            assert(!t1.err && !t1.array);
-            assert(!t2.err && !t2.array);
+            CalcResult t1 = data1.rel_exp->Eval(), t2 = data1.add_exp->Eval();
+            if (t1.err || t1.array || t2.err || t2.array)
+                return CalcResult(true);
             int result = 0;
             if (data1.comp==DATA1::COMP_LT)
                 result = (t1.result < t2.result);
@@ -1848,11 +1896,11 @@ public:
     CalcResult Calc() override {
         switch(tag) {
         case 0:
-            return data0.rel_exp->Calc();
+            return data0.rel_exp->Eval();
         case 1:
-            CalcResult t1 = data1.eq_exp->Calc(), t2 = data1.rel_exp->Calc();
-            assert(!t1.err && !t1.array);
-            assert(!t2.err && !t2.array);
+            CalcResult t1 = data1.eq_exp->Eval(), t2 = data1.rel_exp->Eval();
+            if (t1.err || t1.array || t2.err || t2.array)
+                return CalcResult(true);
             int result = 0;
             if (data1.comp==DATA1::COMP_EQ)
                 result = (t1.result == t2.result);
@@ -1910,11 +1958,11 @@ public:
     CalcResult Calc() override {
         switch(tag) {
         case 0:
-            return data0.eq_exp->Calc();
+            return data0.eq_exp->Eval();
         case 1:
-            CalcResult t1 = data1.l_and_exp->Calc(), t2 = data1.eq_exp->Calc();
-            assert(!t1.err && !t1.array);
-            assert(!t2.err && !t2.array);
+            CalcResult t1 = data1.l_and_exp->Eval(), t2 = data1.eq_exp->Eval();
+            if (t1.err || t1.array || t2.err || t2.array)
+                return CalcResult(true);
             return CalcResult(t1.err || t2.err, t1.result && t2.result);
         }
         return CalcResult(true);
@@ -1967,11 +2015,11 @@ public:
     CalcResult Calc() override {
         switch(tag) {
         case 0:
-            return data0.l_and_exp->Calc();
+            return data0.l_and_exp->Eval();
         case 1:
-            CalcResult t1 = data1.l_or_exp->Calc(), t2 = data1.l_and_exp->Calc();
-            assert(!t1.err && !t1.array);
-            assert(!t2.err && !t2.array);
+            CalcResult t1 = data1.l_or_exp->Eval(), t2 = data1.l_and_exp->Eval();
+            if (t1.err || t1.array || t2.err || t2.array)
+                return CalcResult(true);
             return CalcResult(t1.err || t2.err, t1.result || t2.result);
         }
         return CalcResult(true);
@@ -1991,6 +2039,6 @@ public:
     }
 
     CalcResult Calc() override {
-        return exp->Calc();
+        return exp->Eval();
     }
-};
\ No newline at end of file
+};
@@ -4,6 +4,8 @@
 #include <memory>
 #include <string>
 #include "IRAST.h"
+#include "options.h"
+#include "optimize.h"
 #include "toRISCV.h"
 
 using namespace std;
@@ -18,11 +20,15 @@ extern int yyparse(unique_ptr<BaseAST> &ast);
 
 int main(int argc, const char *argv[]) {
   // 解析命令行参数. 测试脚本/评测平台要求你的编译器能接收如下参数:
-  // compiler 模式 输入文件 -o 输出文件
-  assert(argc == 5);
+  // compiler 模式 输入文件 -o 输出文件 [选项]
+  assert(argc >= 5);
   string mode = argv[1];
   auto input = argv[2];
   auto output = argv[4];
+  ParseOptions(argc, argv, 5);
+  // -obj 直接输出目标文件, 只编码 RV32IM 和 Zicond, 不用向量扩展
+  if (mode == "-obj")
+    options.rvv = false;
 
   // 打开输入文件, 并且指定 lexer 在解析的时候读取这个文件
   yyin = fopen(input, "r");
@@ -39,6 +45,8 @@ int main(int argc, const char *argv[]) {
   string koopa = "";
   string *riscv = new string;
   ast->GenKoopa(koopa);
+  if (options.optimize)
+    optimize(koopa);
   //cout << koopa << endl;
 
   FILE *yyout;
@@ -50,6 +58,10 @@ int main(int argc, const char *argv[]) {
     toRISCV(koopa, riscv);
     fprintf(yyout, "%s", riscv->c_str());
   }
+  else if (mode == "-obj") {
+    toObject(koopa, riscv);
+    fwrite(riscv->data(), 1, riscv->size(), yyout);
+  }
   delete riscv;
   return 0;
 }
@@ -0,0 +1,155 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+
+using namespace std;
+
+// Alias analysis for the addresses used by load and store.
+// An address is split into the object it points into and the chain of
+// getptr/getelemptr indices applied to it. Objects are locals (allocs),
+// globals, array parameters (the pointer stored into the parameter's alloc
+// at the entry) and unknown pointers (anything else, like a pointer loaded
+// from a variable). Scalars never have their address taken, so they only
+// alias themselves.
+
+enum MemKind {
+    MEM_LOCAL,
+    MEM_GLOBAL,
+    MEM_PARAM,
+    MEM_UNKNOWN
+};
+
+struct MemLoc {
+    MemKind kind;
+    IRValue *base;         // alloc, global, func arg ref or the unknown pointer
+    vector<IRValue*> path; // indices from the base, outermost first
+    bool isConst;          // all indices are constants
+    int offset;            // in bytes, when isConst
+};
+
+class AliasAnalysis {
+public:
+    AliasAnalysis(IRFunction *func) {
+        // the alloc of an array parameter is only written by the store of the argument
+        map<IRValue*, int> storeCount;
+        map<IRValue*, IRValue*> argOf;
+        for (auto bb : func->bbs) {
+            for (auto inst : bb->insts) {
+                if (inst->tag != KOOPA_RVT_STORE)
+                    continue;
+                IRValue *dest = inst->ops[1];
+                storeCount[dest]++;
+                if (inst->ops[0]->tag == KOOPA_RVT_FUNC_ARG_REF && inst->ops[0]->ty->tag == KOOPA_RTT_POINTER)
+                    argOf[dest] = inst->ops[0];
+            }
+        }
+        for (auto &kv : argOf) {
+            if (kv.first->tag == KOOPA_RVT_ALLOC && storeCount[kv.first] == 1)
+                paramArg[kv.first] = kv.second;
+        }
+        // locals whose address is passed to a call or stored somewhere
+        for (auto bb : func->bbs) {
+            for (auto inst : bb->insts) {
+                vector<IRValue*> ptrs;
+                if (inst->tag == KOOPA_RVT_CALL)
+                    ptrs = inst->ops;
+                else if (inst->tag == KOOPA_RVT_STORE)
+                    ptrs.push_back(inst->ops[0]);
+                for (auto ptr : ptrs) {
+                    if (ptr->ty->tag != KOOPA_RTT_POINTER)
+                        continue;
+                    MemLoc loc = Decompose(ptr);
+                    if (loc.kind == MEM_LOCAL)
+                        escaped.insert(loc.base);
+                }
+            }
+        }
+    }
+
+    MemLoc Decompose(IRValue *ptr) {
+        MemLoc loc;
+        loc.isConst = true;
+        loc.offset = 0;
+        while (ptr->tag == KOOPA_RVT_GET_ELEM_PTR || ptr->tag == KOOPA_RVT_GET_PTR) {
+            IRValue *index = ptr->ops[1];
+            loc.path.push_back(index);
+            if (index->IsConst())
+                loc.offset += index->imm * ptr->ty->base->Size();
+            else
+                loc.isConst = false;
+            ptr = ptr->ops[0];
+        }
+        reverse(loc.path.begin(), loc.path.end());
+        loc.base = ptr;
+        if (ptr->tag == KOOPA_RVT_ALLOC) {
+            loc.kind = MEM_LOCAL;
+        }
+        else if (ptr->tag == KOOPA_RVT_GLOBAL_ALLOC) {
+            loc.kind = MEM_GLOBAL;
+        }
+        else if (ptr->tag == KOOPA_RVT_FUNC_ARG_REF) {
+            loc.kind = MEM_PARAM;
+        }
+        else if (ptr->tag == KOOPA_RVT_LOAD && paramArg.find(ptr->ops[0]) != paramArg.end()) {
+            loc.kind = MEM_PARAM;
+            loc.base = paramArg[ptr->ops[0]];
+        }
+        else {
+            loc.kind = MEM_UNKNOWN;
+        }
+        return loc;
+    }
+
+    // the base is a scalar variable, accessed only by load/store on its alloc
+    static bool IsScalar(const MemLoc &loc) {
+        if (loc.kind != MEM_LOCAL && loc.kind != MEM_GLOBAL)
+            return false;
+        return loc.base->ty->base->tag != KOOPA_RTT_ARRAY;
+    }
+
+    bool MayAlias(const MemLoc &a, const MemLoc &b) {
+        if (a.base == b.base && a.kind == b.kind)
+            return !Disjoint(a.path, b.path);
+        if (IsScalar(a) || IsScalar(b))
+            return false;
+        if (a.kind == MEM_UNKNOWN || b.kind == MEM_UNKNOWN) {
+            const MemLoc &other = (a.kind == MEM_UNKNOWN) ? b : a;
+            return other.kind != MEM_LOCAL || escaped.count(other.base);
+        }
+        // distinct locals and globals never overlap, and an array parameter
+        // cannot point into the locals of the function it belongs to
+        if (a.kind == MEM_LOCAL || b.kind == MEM_LOCAL)
+            return false;
+        if (a.kind == MEM_GLOBAL && b.kind == MEM_GLOBAL)
+            return false;
+        return true;
+    }
+
+    // a call may write globals, anything reachable from pointers and escaped locals
+    bool ClobberedByCall(const MemLoc &loc) {
+        if (loc.kind == MEM_LOCAL)
+            return escaped.count(loc.base) > 0;
+        return true;
+    }
+
+private:
+    map<IRValue*, IRValue*> paramArg; // alloc of an array parameter -> the argument
+    set<IRValue*> escaped;
+
+    // indices into the same object that differ in a constant at some level
+    // select disjoint subobjects, as long as the accesses stay in bounds
+    static bool Disjoint(const vector<IRValue*> &a, const vector<IRValue*> &b) {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i]->IsConst() && b[i]->IsConst() && a[i] != b[i])
+                return true;
+        }
+        return false;
+    }
+};
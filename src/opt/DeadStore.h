@@ -0,0 +1,207 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+#include "opt/Alias.h"
+
+using namespace std;
+
+// Dead store elimination.
+// A backward liveness analysis over memory: a load makes its address live,
+// a store to an exactly known address (a scalar, or constant indices) ends
+// it, calls read whatever they can reach and returning exposes everything
+// but the locals. A store is dead if nothing live may alias its address,
+// which covers both overwritten stores and stores to locals never read.
+
+class DeadStoreElim {
+public:
+    DeadStoreElim(IRFunction *_func) : func(_func), aa(_func) {
+    }
+
+    // returns true if some stores were removed
+    bool Run() {
+        DomTree dom(func);
+        vector<IRBasicBlock*> order(dom.rpo.rbegin(), dom.rpo.rend());
+        map<IRBasicBlock*, LiveState> liveIn;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto bb : order) {
+                LiveState state = LiveOut(bb, liveIn);
+                Transfer(bb, state, nullptr);
+                if (!(state == liveIn[bb])) {
+                    liveIn[bb] = state;
+                    changed = true;
+                }
+            }
+        }
+
+        set<IRValue*> dead;
+        for (auto bb : order) {
+            LiveState state = LiveOut(bb, liveIn);
+            Transfer(bb, state, &dead);
+        }
+        for (auto bb : func->bbs) {
+            bb->insts.erase(remove_if(bb->insts.begin(), bb->insts.end(), [&](IRValue *inst) {
+                return dead.find(inst) != dead.end();
+            }), bb->insts.end());
+        }
+        return !dead.empty();
+    }
+
+private:
+    struct ObjLive {
+        MemLoc obj;                // the object itself, without indices
+        map<int, MemLoc> consts;   // reads by offset
+        vector<MemLoc> dyns;
+
+        bool operator==(const ObjLive &other) const {
+            if (consts.size() != other.consts.size() || dyns.size() != other.dyns.size())
+                return false;
+            for (auto a = consts.begin(), b = other.consts.begin(); a != consts.end(); a++, b++) {
+                if (a->first != b->first)
+                    return false;
+            }
+            for (size_t i = 0; i < dyns.size(); i++) {
+                if (dyns[i].path != other.dyns[i].path)
+                    return false;
+            }
+            return true;
+        }
+    };
+    struct LiveState {
+        map<IRValue*, ObjLive> objs; // by base
+        bool callRead = false;       // a later call may read what it can reach
+        bool exitRead = false;       // the caller may read everything but the locals
+
+        bool operator==(const LiveState &other) const {
+            return callRead == other.callRead && exitRead == other.exitRead && objs == other.objs;
+        }
+    };
+
+    IRFunction *func;
+    AliasAnalysis aa;
+
+    LiveState LiveOut(IRBasicBlock *bb, map<IRBasicBlock*, LiveState> &liveIn) {
+        LiveState state;
+        for (auto succ : bb->Succs()) {
+            LiveState &other = liveIn[succ];
+            state.callRead |= other.callRead;
+            state.exitRead |= other.exitRead;
+            for (auto &kv : other.objs) {
+                for (auto &c : kv.second.consts)
+                    AddRead(state, c.second);
+                for (auto &loc : kv.second.dyns)
+                    AddRead(state, Widen(loc));
+            }
+        }
+        return state;
+    }
+
+    // A variable index may take another value in the successor, as in the
+    // next iteration of a loop, so reads coming from there only keep their
+    // constant indices and are never ended by a store.
+    static MemLoc Widen(const MemLoc &loc) {
+        static IRValue anyIndex(KOOPA_RVT_UNDEF, IRType::Int32());
+        MemLoc res = loc;
+        for (auto &index : res.path) {
+            if (!index->IsConst())
+                index = &anyIndex;
+        }
+        return res;
+    }
+
+    void AddRead(LiveState &state, const MemLoc &loc) {
+        auto it = state.objs.find(loc.base);
+        if (it == state.objs.end()) {
+            it = state.objs.insert(make_pair(loc.base, ObjLive())).first;
+            it->second.obj = loc;
+            it->second.obj.path.clear();
+        }
+        ObjLive &obj = it->second;
+        if (loc.isConst) {
+            obj.consts.insert(make_pair(loc.offset, loc));
+            return;
+        }
+        // kept sorted, so equal states compare equal
+        auto pos = lower_bound(obj.dyns.begin(), obj.dyns.end(), loc, [](const MemLoc &a, const MemLoc &b) {
+            return a.path < b.path;
+        });
+        if (pos == obj.dyns.end() || pos->path != loc.path)
+            obj.dyns.insert(pos, loc);
+    }
+
+    bool IsLive(LiveState &state, const MemLoc &loc) {
+        if (state.callRead && aa.ClobberedByCall(loc))
+            return true;
+        if (state.exitRead && loc.kind != MEM_LOCAL)
+            return true;
+        for (auto &kv : state.objs) {
+            ObjLive &obj = kv.second;
+            if (kv.first != loc.base) {
+                if (aa.MayAlias(obj.obj, loc))
+                    return true;
+                continue;
+            }
+            if (loc.isConst && obj.consts.count(loc.offset))
+                return true;
+            if (!loc.isConst) {
+                for (auto &c : obj.consts) {
+                    if (aa.MayAlias(c.second, loc))
+                        return true;
+                }
+            }
+            for (auto &d : obj.dyns) {
+                if (aa.MayAlias(d, loc))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // the store overwrites loc, earlier stores are not seen by reads of exactly loc
+    void Kill(LiveState &state, const MemLoc &loc) {
+        auto it = state.objs.find(loc.base);
+        if (it == state.objs.end())
+            return;
+        ObjLive &obj = it->second;
+        if (loc.isConst) {
+            obj.consts.erase(loc.offset);
+        }
+        else {
+            obj.dyns.erase(remove_if(obj.dyns.begin(), obj.dyns.end(), [&](const MemLoc &d) {
+                return d.path == loc.path;
+            }), obj.dyns.end());
+        }
+        if (obj.consts.empty() && obj.dyns.empty())
+            state.objs.erase(it);
+    }
+
+    // walk the block backwards; dead stores are collected when dead is given
+    void Transfer(IRBasicBlock *bb, LiveState &state, set<IRValue*> *dead) {
+        for (auto it = bb->insts.rbegin(); it != bb->insts.rend(); it++) {
+            IRValue *inst = *it;
+            if (inst->tag == KOOPA_RVT_RETURN) {
+                state.exitRead = true;
+            }
+            else if (inst->tag == KOOPA_RVT_CALL) {
+                state.callRead = true;
+            }
+            else if (inst->tag == KOOPA_RVT_LOAD) {
+                MemLoc loc = aa.Decompose(inst->ops[0]);
+                AddRead(state, loc);
+            }
+            else if (inst->tag == KOOPA_RVT_STORE) {
+                MemLoc loc = aa.Decompose(inst->ops[1]);
+                if (dead != nullptr && !IsLive(state, loc))
+                    dead->insert(inst);
+                Kill(state, loc);
+            }
+        }
+    }
+};
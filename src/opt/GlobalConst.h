@@ -0,0 +1,115 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+
+using namespace std;
+
+// Constant propagation of read-only globals.
+// A global that is never stored to, and whose address is never stored or
+// passed to a call, holds its initializer for the whole run. Loads from it
+// at constant indices are replaced by the initial value; the remaining
+// loads stay, and the backend places such globals in .rodata.
+
+class GlobalConstProp {
+public:
+    GlobalConstProp(IRProgram *prog) {
+        for (auto func : prog->funcs) {
+            for (auto bb : func->bbs) {
+                for (auto inst : bb->insts) {
+                    if (inst->tag == KOOPA_RVT_STORE) {
+                        MarkWritten(inst->ops[0]);
+                        MarkWritten(inst->ops[1]);
+                    }
+                    else if (inst->tag == KOOPA_RVT_CALL) {
+                        for (auto arg : inst->ops)
+                            MarkWritten(arg);
+                    }
+                }
+            }
+        }
+    }
+
+    // returns true if some loads were replaced; the passes only add stores
+    // to locals, so what is found written up front stays valid
+    bool Run(IRFunction *func) {
+        map<IRValue*, IRValue*> replaced;
+        for (auto bb : func->bbs) {
+            for (auto inst : bb->insts) {
+                int val;
+                if (inst->tag == KOOPA_RVT_LOAD && InitialValue(inst->ops[0], val))
+                    replaced[inst] = IRConst(val);
+            }
+        }
+        if (replaced.empty())
+            return false;
+        for (auto bb : func->bbs) {
+            bb->insts.erase(remove_if(bb->insts.begin(), bb->insts.end(), [&](IRValue *inst) {
+                return replaced.find(inst) != replaced.end();
+            }), bb->insts.end());
+            for (auto inst : bb->insts) {
+                for (auto &op : inst->ops) {
+                    auto it = replaced.find(op);
+                    if (it != replaced.end())
+                        op = it->second;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    set<IRValue*> written;
+
+    static IRValue *Root(IRValue *ptr) {
+        while (ptr->tag == KOOPA_RVT_GET_ELEM_PTR || ptr->tag == KOOPA_RVT_GET_PTR)
+            ptr = ptr->ops[0];
+        return ptr;
+    }
+
+    void MarkWritten(IRValue *ptr) {
+        if (ptr->ty->tag != KOOPA_RTT_POINTER)
+            return;
+        ptr = Root(ptr);
+        if (ptr->tag == KOOPA_RVT_GLOBAL_ALLOC)
+            written.insert(ptr);
+    }
+
+    // the value loaded from ptr, if it is a constant offset into a read-only global
+    bool InitialValue(IRValue *ptr, int &val) {
+        int offset = 0;
+        while (ptr->tag == KOOPA_RVT_GET_ELEM_PTR || ptr->tag == KOOPA_RVT_GET_PTR) {
+            if (!ptr->ops[1]->IsConst())
+                return false;
+            offset += ptr->ops[1]->imm * ptr->ty->base->Size();
+            ptr = ptr->ops[0];
+        }
+        if (ptr->tag != KOOPA_RVT_GLOBAL_ALLOC || written.count(ptr))
+            return false;
+        if (offset < 0 || offset % 4 != 0 || offset >= ptr->ty->base->Size())
+            return false;
+        return ValueAt(ptr->ops[0], offset, val);
+    }
+
+    static bool ValueAt(IRValue *init, int offset, int &val) {
+        if (init->tag == KOOPA_RVT_INTEGER) {
+            val = init->imm;
+            return true;
+        }
+        if (init->tag == KOOPA_RVT_ZERO_INIT) {
+            val = 0;
+            return true;
+        }
+        if (init->tag != KOOPA_RVT_AGGREGATE)
+            return false;
+        int elemSize = init->ty->base->Size();
+        size_t index = offset / elemSize;
+        if (index >= init->ops.size())
+            return false;
+        return ValueAt(init->ops[index], offset % elemSize, val);
+    }
+};
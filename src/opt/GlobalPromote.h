@@ -0,0 +1,182 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+
+using namespace std;
+
+// Scalar promotion of globals in loops.
+// A global i32 used in a loop, and not touched by the functions the loop
+// calls, is copied into a local variable in the preheader; the loop works
+// on the local, which needs no address materialization, and the value is
+// written back at the loop exits. The usual local optimizations then apply
+// to it, like forwarding and induction variable recognition.
+
+// the global variables each function may access, directly or through calls
+class GlobalRefs {
+public:
+    GlobalRefs(IRProgram *prog) {
+        map<IRFunction*, set<IRFunction*>> callees;
+        for (auto func : prog->funcs) {
+            set<IRValue*> &used = refs[func];
+            for (auto bb : func->bbs) {
+                for (auto inst : bb->insts) {
+                    if (inst->tag == KOOPA_RVT_CALL)
+                        callees[func].insert(inst->callee);
+                    for (auto op : inst->ops) {
+                        if (op->tag == KOOPA_RVT_GLOBAL_ALLOC)
+                            used.insert(op);
+                    }
+                }
+            }
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto func : prog->funcs) {
+                set<IRValue*> &used = refs[func];
+                size_t size = used.size();
+                for (auto callee : callees[func])
+                    used.insert(refs[callee].begin(), refs[callee].end());
+                if (used.size() != size)
+                    changed = true;
+            }
+        }
+    }
+
+    const set<IRValue*> &Of(IRFunction *func) {
+        return refs[func];
+    }
+
+private:
+    map<IRFunction*, set<IRValue*>> refs;
+};
+
+class GlobalPromote {
+public:
+    GlobalPromote(IRFunction *_func, GlobalRefs &_refs) : func(_func), refs(_refs) {
+    }
+
+    // returns true if some globals were promoted
+    bool Run() {
+        bool changed = false, promoted = true;
+        // splitting exit edges changes the loops, so start over after each one
+        while (promoted) {
+            promoted = false;
+            LoopInfo li(func);
+            vector<Loop*> order = li.InnerToOuter();
+            // in the outermost loop possible; inner loops then find nothing left
+            reverse(order.begin(), order.end());
+            for (auto loop : order) {
+                if (RunOnLoop(loop, li.dom)) {
+                    promoted = changed = true;
+                    break;
+                }
+            }
+        }
+        return changed;
+    }
+
+private:
+    IRFunction *func;
+    GlobalRefs &refs;
+
+    static bool IsScalarGlobal(IRValue *ptr) {
+        return ptr->tag == KOOPA_RVT_GLOBAL_ALLOC && ptr->ty->base->tag == KOOPA_RTT_INT32;
+    }
+
+    bool RunOnLoop(Loop *loop, DomTree &dom) {
+        IRBasicBlock *preheader = loop->Preheader(dom);
+        if (preheader == nullptr)
+            return false;
+
+        set<IRValue*> called;
+        map<IRValue*, vector<IRValue*>> accesses;
+        set<IRValue*> stored;
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_RETURN)
+                    return false;
+                if (inst->tag == KOOPA_RVT_CALL) {
+                    const set<IRValue*> &used = refs.Of(inst->callee);
+                    called.insert(used.begin(), used.end());
+                }
+                else if (inst->tag == KOOPA_RVT_LOAD && IsScalarGlobal(inst->ops[0])) {
+                    accesses[inst->ops[0]].push_back(inst);
+                }
+                else if (inst->tag == KOOPA_RVT_STORE && IsScalarGlobal(inst->ops[1])) {
+                    accesses[inst->ops[1]].push_back(inst);
+                    stored.insert(inst->ops[1]);
+                }
+            }
+        }
+
+        for (auto it = accesses.begin(); it != accesses.end();) {
+            if (called.count(it->first))
+                it = accesses.erase(it);
+            else
+                it++;
+        }
+        if (accesses.empty())
+            return false;
+
+        vector<IRBasicBlock*> exits = SplitExits(loop, dom);
+        for (auto &kv : accesses) {
+            IRValue *global = kv.first;
+            IRValue *var = func->NewAlloc(IRType::Int32());
+            IRBasicBlock *entry = func->bbs[0];
+            var->bb = entry;
+            entry->insts.insert(entry->insts.begin(), var);
+            IRValue *init = func->NewLoad(global);
+            preheader->Append(init);
+            preheader->Append(func->NewStore(init, var));
+            for (auto inst : kv.second) {
+                if (inst->tag == KOOPA_RVT_LOAD)
+                    inst->ops[0] = var;
+                else
+                    inst->ops[1] = var;
+            }
+            if (stored.count(global)) {
+                for (auto exit : exits) {
+                    IRValue *pos = exit->insts[0];
+                    IRValue *val = func->NewLoad(var);
+                    exit->InsertBefore(pos, val);
+                    exit->InsertBefore(pos, func->NewStore(val, global));
+                }
+            }
+        }
+        return true;
+    }
+
+    // blocks to write the globals back in: the exits only reached from the
+    // loop, and new blocks on the exit edges into the other exits
+    vector<IRBasicBlock*> SplitExits(Loop *loop, DomTree &dom) {
+        vector<IRBasicBlock*> res;
+        for (auto exit : loop->ExitBlocks()) {
+            bool dedicated = true;
+            for (auto pred : dom.preds[exit]) {
+                if (dom.Reachable(pred) && !loop->Contains(pred))
+                    dedicated = false;
+            }
+            if (dedicated) {
+                res.push_back(exit);
+                continue;
+            }
+            for (auto pred : dom.preds[exit]) {
+                if (!loop->Contains(pred))
+                    continue;
+                IRBasicBlock *bb = func->NewBlock("exit");
+                bb->Append(func->NewJump(exit));
+                pred->RedirectSucc(exit, bb);
+                func->InsertBlockBefore(exit, bb);
+                res.push_back(bb);
+            }
+        }
+        return res;
+    }
+};
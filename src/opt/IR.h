@@ -0,0 +1,676 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "koopa.h"
+
+using namespace std;
+
+// Mutable in-memory Koopa IR for the optimizer.
+// It is lifted from the raw program built by libkoopa, rewritten by the passes,
+// and printed back to Koopa text, so the backend keeps consuming plain Koopa.
+
+class IRBasicBlock;
+class IRFunction;
+
+static int optBlockId = 0; // keeps labels of new blocks unique in the whole program
+
+class IRType {
+public:
+    koopa_raw_type_tag_t tag;
+    IRType *base; // element of array, pointee of pointer, return type of function
+    int len;      // length of array
+    vector<IRType*> params;
+
+    // types are interned, so they can be compared by pointer
+    static IRType *Int32() {
+        static IRType t(KOOPA_RTT_INT32, nullptr, 0);
+        return &t;
+    }
+    static IRType *Unit() {
+        static IRType t(KOOPA_RTT_UNIT, nullptr, 0);
+        return &t;
+    }
+    static IRType *Pointer(IRType *base) {
+        static map<IRType*, unique_ptr<IRType>> pool;
+        auto &ty = pool[base];
+        if (!ty)
+            ty.reset(new IRType(KOOPA_RTT_POINTER, base, 0));
+        return ty.get();
+    }
+    static IRType *Array(IRType *base, int len) {
+        static map<pair<IRType*, int>, unique_ptr<IRType>> pool;
+        auto &ty = pool[make_pair(base, len)];
+        if (!ty)
+            ty.reset(new IRType(KOOPA_RTT_ARRAY, base, len));
+        return ty.get();
+    }
+    static IRType *Function(const vector<IRType*> &params, IRType *ret) {
+        static map<pair<vector<IRType*>, IRType*>, unique_ptr<IRType>> pool;
+        auto &ty = pool[make_pair(params, ret)];
+        if (!ty) {
+            ty.reset(new IRType(KOOPA_RTT_FUNCTION, ret, 0));
+            ty->params = params;
+        }
+        return ty.get();
+    }
+
+    // size in bytes
+    int Size() const {
+        if (tag == KOOPA_RTT_ARRAY)
+            return len * base->Size();
+        if (tag == KOOPA_RTT_UNIT)
+            return 0;
+        return 4;
+    }
+
+    string ToString() const {
+        switch (tag) {
+        case KOOPA_RTT_INT32:
+            return "i32";
+        case KOOPA_RTT_UNIT:
+            return "unit";
+        case KOOPA_RTT_ARRAY:
+            return "[" + base->ToString() + ", " + to_string(len) + "]";
+        case KOOPA_RTT_POINTER:
+            return "*" + base->ToString();
+        default:
+            assert(false);
+        }
+        return "";
+    }
+
+private:
+    IRType(koopa_raw_type_tag_t _tag, IRType *_base, int _len) {
+        tag = _tag;
+        base = _base;
+        len = _len;
+    }
+};
+
+class IRValue {
+public:
+    koopa_raw_value_tag_t tag;
+    IRType *ty;
+    string name;   // "@x_1" for allocs, globals and params, empty for temporaries
+    int imm;       // value of integer, op of binary, index of func arg
+    // load {src}, store {value, dest}, getptr/getelemptr {src, index},
+    // binary {lhs, rhs}, branch {cond}, return {value} or {},
+    // call {args...}, global alloc {init}, aggregate {elems...}
+    vector<IRValue*> ops;
+    vector<IRBasicBlock*> targets; // branch {true, false}, jump {target}
+    IRFunction *callee;
+    IRBasicBlock *bb; // parent block, nullptr if not an instruction
+
+    IRValue(koopa_raw_value_tag_t _tag, IRType *_ty) {
+        tag = _tag;
+        ty = _ty;
+        imm = 0;
+        callee = nullptr;
+        bb = nullptr;
+    }
+
+    bool IsConst() const {
+        return tag == KOOPA_RVT_INTEGER;
+    }
+    bool IsTerminator() const {
+        return tag == KOOPA_RVT_BRANCH || tag == KOOPA_RVT_JUMP || tag == KOOPA_RVT_RETURN;
+    }
+    bool HasSideEffect() const {
+        return tag == KOOPA_RVT_STORE || tag == KOOPA_RVT_CALL || IsTerminator();
+    }
+};
+
+// integers are interned as well
+static IRValue *IRConst(int val) {
+    static map<int, unique_ptr<IRValue>> pool;
+    auto &v = pool[val];
+    if (!v) {
+        v.reset(new IRValue(KOOPA_RVT_INTEGER, IRType::Int32()));
+        v->imm = val;
+    }
+    return v.get();
+}
+
+class IRBasicBlock {
+public:
+    string name; // "%entry_3"
+    vector<IRValue*> insts;
+    IRFunction *func;
+
+    IRValue *Terminator() const {
+        if (insts.empty() || !insts.back()->IsTerminator())
+            return nullptr;
+        return insts.back();
+    }
+
+    vector<IRBasicBlock*> Succs() const {
+        IRValue *term = Terminator();
+        if (term == nullptr)
+            return vector<IRBasicBlock*>();
+        return term->targets;
+    }
+
+    // insert before the terminator
+    void Append(IRValue *inst) {
+        inst->bb = this;
+        if (Terminator() != nullptr)
+            insts.insert(insts.end() - 1, inst);
+        else
+            insts.push_back(inst);
+    }
+
+    void InsertBefore(IRValue *pos, IRValue *inst) {
+        auto it = find(insts.begin(), insts.end(), pos);
+        assert(it != insts.end());
+        inst->bb = this;
+        insts.insert(it, inst);
+    }
+
+    void Remove(IRValue *inst) {
+        auto it = find(insts.begin(), insts.end(), inst);
+        assert(it != insts.end());
+        insts.erase(it);
+        inst->bb = nullptr;
+    }
+
+    // replace the jump/branch target old by new
+    void RedirectSucc(IRBasicBlock *oldBB, IRBasicBlock *newBB) {
+        IRValue *term = Terminator();
+        assert(term != nullptr);
+        for (auto &t : term->targets) {
+            if (t == oldBB)
+                t = newBB;
+        }
+    }
+};
+
+class IRFunction {
+public:
+    string name; // "@main"
+    IRType *ty;
+    vector<IRValue*> params;
+    vector<IRBasicBlock*> bbs; // bbs[0] is the entry block
+
+    bool IsDecl() const {
+        return bbs.empty();
+    }
+
+    IRValue *NewValue(koopa_raw_value_tag_t tag, IRType *ty) {
+        valuePool.emplace_back(new IRValue(tag, ty));
+        return valuePool.back().get();
+    }
+
+    // new blocks are not placed in bbs, the caller decides where they go
+    IRBasicBlock *NewBlock(const string &prefix) {
+        blockPool.emplace_back(new IRBasicBlock);
+        IRBasicBlock *bb = blockPool.back().get();
+        bb->name = "%" + prefix + "_" + to_string(optBlockId++);
+        bb->func = this;
+        return bb;
+    }
+
+    void InsertBlockBefore(IRBasicBlock *pos, IRBasicBlock *bb) {
+        auto it = find(bbs.begin(), bbs.end(), pos);
+        assert(it != bbs.end());
+        bbs.insert(it, bb);
+    }
+
+    IRValue *NewAlloc(IRType *allocTy) {
+        return NewValue(KOOPA_RVT_ALLOC, IRType::Pointer(allocTy));
+    }
+    IRValue *NewLoad(IRValue *src) {
+        IRValue *v = NewValue(KOOPA_RVT_LOAD, src->ty->base);
+        v->ops = {src};
+        return v;
+    }
+    IRValue *NewStore(IRValue *val, IRValue *dest) {
+        IRValue *v = NewValue(KOOPA_RVT_STORE, IRType::Unit());
+        v->ops = {val, dest};
+        return v;
+    }
+    IRValue *NewBinary(int op, IRValue *lhs, IRValue *rhs) {
+        IRValue *v = NewValue(KOOPA_RVT_BINARY, IRType::Int32());
+        v->imm = op;
+        v->ops = {lhs, rhs};
+        return v;
+    }
+    IRValue *NewGetElemPtr(IRValue *src, IRValue *index) {
+        IRValue *v = NewValue(KOOPA_RVT_GET_ELEM_PTR, IRType::Pointer(src->ty->base->base));
+        v->ops = {src, index};
+        return v;
+    }
+    IRValue *NewGetPtr(IRValue *src, IRValue *index) {
+        IRValue *v = NewValue(KOOPA_RVT_GET_PTR, src->ty);
+        v->ops = {src, index};
+        return v;
+    }
+    IRValue *NewBranch(IRValue *cond, IRBasicBlock *trueBB, IRBasicBlock *falseBB) {
+        IRValue *v = NewValue(KOOPA_RVT_BRANCH, IRType::Unit());
+        v->ops = {cond};
+        v->targets = {trueBB, falseBB};
+        return v;
+    }
+    IRValue *NewJump(IRBasicBlock *target) {
+        IRValue *v = NewValue(KOOPA_RVT_JUMP, IRType::Unit());
+        v->targets = {target};
+        return v;
+    }
+    IRValue *NewCall(IRFunction *callee, const vector<IRValue*> &args) {
+        IRValue *v = NewValue(KOOPA_RVT_CALL, callee->ty->base);
+        v->callee = callee;
+        v->ops = args;
+        return v;
+    }
+
+    // copy an instruction, operands and targets are translated through the maps if present
+    IRValue *Clone(IRValue *inst, map<IRValue*, IRValue*> &vmap, map<IRBasicBlock*, IRBasicBlock*> &bmap) {
+        IRValue *v = NewValue(inst->tag, inst->ty);
+        v->imm = inst->imm;
+        v->callee = inst->callee;
+        for (auto op : inst->ops) {
+            auto it = vmap.find(op);
+            v->ops.push_back(it == vmap.end() ? op : it->second);
+        }
+        for (auto t : inst->targets) {
+            auto it = bmap.find(t);
+            v->targets.push_back(it == bmap.end() ? t : it->second);
+        }
+        vmap[inst] = v;
+        return v;
+    }
+
+    map<IRValue*, vector<IRValue*>> ComputeUsers() const {
+        map<IRValue*, vector<IRValue*>> users;
+        for (auto bb : bbs) {
+            for (auto inst : bb->insts) {
+                for (auto op : inst->ops)
+                    users[op].push_back(inst);
+            }
+        }
+        return users;
+    }
+
+    void ReplaceAllUses(IRValue *from, IRValue *to) {
+        for (auto bb : bbs) {
+            for (auto inst : bb->insts) {
+                for (auto &op : inst->ops) {
+                    if (op == from)
+                        op = to;
+                }
+            }
+        }
+    }
+
+    map<IRBasicBlock*, vector<IRBasicBlock*>> ComputePreds() const {
+        map<IRBasicBlock*, vector<IRBasicBlock*>> preds;
+        for (auto bb : bbs) {
+            preds[bb];
+            for (auto succ : bb->Succs())
+                preds[succ].push_back(bb);
+        }
+        return preds;
+    }
+
+    // returns true if some blocks were removed
+    bool RemoveUnreachable() {
+        if (bbs.empty())
+            return false;
+        set<IRBasicBlock*> reached;
+        vector<IRBasicBlock*> stack = {bbs[0]};
+        reached.insert(bbs[0]);
+        while (!stack.empty()) {
+            IRBasicBlock *bb = stack.back();
+            stack.pop_back();
+            for (auto succ : bb->Succs()) {
+                if (reached.insert(succ).second)
+                    stack.push_back(succ);
+            }
+        }
+        size_t oldSize = bbs.size();
+        bbs.erase(remove_if(bbs.begin(), bbs.end(), [&](IRBasicBlock *bb) {
+            return reached.find(bb) == reached.end();
+        }), bbs.end());
+        return bbs.size() != oldSize;
+    }
+
+    // a local i32 variable whose address is only used directly by load/store
+    bool IsPromotable(IRValue *alloc, map<IRValue*, vector<IRValue*>> &users) const {
+        if (alloc->tag != KOOPA_RVT_ALLOC || alloc->ty->base != IRType::Int32())
+            return false;
+        for (auto user : users[alloc]) {
+            if (user->tag == KOOPA_RVT_LOAD)
+                continue;
+            if (user->tag == KOOPA_RVT_STORE && user->ops[1] == alloc && user->ops[0] != alloc)
+                continue;
+            return false;
+        }
+        return true;
+    }
+
+    void GenKoopa(string &str) {
+        if (IsDecl()) {
+            str += "decl " + name + "(";
+            for (size_t i = 0; i < ty->params.size(); i++) {
+                if (i > 0)
+                    str += ", ";
+                str += ty->params[i]->ToString();
+            }
+            str += ")";
+            if (ty->base->tag != KOOPA_RTT_UNIT)
+                str += ": " + ty->base->ToString();
+            str += "\n";
+            return;
+        }
+        // number the temporaries in the order they are printed
+        tmpNames.clear();
+        int tmpId = 0;
+        for (auto bb : bbs) {
+            for (auto inst : bb->insts) {
+                if (inst->name.empty() && inst->ty->tag != KOOPA_RTT_UNIT)
+                    tmpNames[inst] = "%" + to_string(tmpId++);
+            }
+        }
+        str += "fun " + name + "(";
+        for (size_t i = 0; i < params.size(); i++) {
+            if (i > 0)
+                str += ", ";
+            str += params[i]->name + ": " + params[i]->ty->ToString();
+        }
+        str += ")";
+        if (ty->base->tag != KOOPA_RTT_UNIT)
+            str += ": " + ty->base->ToString();
+        str += " {\n";
+        for (auto bb : bbs) {
+            str += bb->name + ":\n";
+            for (auto inst : bb->insts)
+                GenInstKoopa(inst, str);
+        }
+        str += "}\n\n";
+    }
+
+private:
+    vector<unique_ptr<IRValue>> valuePool;
+    vector<unique_ptr<IRBasicBlock>> blockPool;
+    map<IRValue*, string> tmpNames;
+
+    string Operand(IRValue *v) {
+        if (v->IsConst())
+            return to_string(v->imm);
+        if (!v->name.empty())
+            return v->name;
+        assert(tmpNames.find(v) != tmpNames.end());
+        return tmpNames[v];
+    }
+
+    void GenInstKoopa(IRValue *inst, string &str) {
+        static const char *binaryOps[] = {
+            "ne", "eq", "gt", "lt", "ge", "le", "add", "sub", "mul",
+            "div", "mod", "and", "or", "xor", "shl", "shr", "sar"
+        };
+        if (inst->ty->tag != KOOPA_RTT_UNIT)
+            str += Operand(inst) + " = ";
+        switch (inst->tag) {
+        case KOOPA_RVT_ALLOC:
+            str += "alloc " + inst->ty->base->ToString() + "\n";
+            break;
+        case KOOPA_RVT_LOAD:
+            str += "load " + Operand(inst->ops[0]) + "\n";
+            break;
+        case KOOPA_RVT_STORE:
+            str += "store " + Operand(inst->ops[0]) + ", " + Operand(inst->ops[1]) + "\n";
+            break;
+        case KOOPA_RVT_GET_PTR:
+            str += "getptr " + Operand(inst->ops[0]) + ", " + Operand(inst->ops[1]) + "\n";
+            break;
+        case KOOPA_RVT_GET_ELEM_PTR:
+            str += "getelemptr " + Operand(inst->ops[0]) + ", " + Operand(inst->ops[1]) + "\n";
+            break;
+        case KOOPA_RVT_BINARY:
+            str += string(binaryOps[inst->imm]) + " " + Operand(inst->ops[0]) + ", " + Operand(inst->ops[1]) + "\n";
+            break;
+        case KOOPA_RVT_BRANCH:
+            str += "br " + Operand(inst->ops[0]) + ", " + inst->targets[0]->name + ", " + inst->targets[1]->name + "\n";
+            break;
+        case KOOPA_RVT_JUMP:
+            str += "jump " + inst->targets[0]->name + "\n";
+            break;
+        case KOOPA_RVT_CALL:
+            str += "call " + inst->callee->name + "(";
+            for (size_t i = 0; i < inst->ops.size(); i++) {
+                if (i > 0)
+                    str += ", ";
+                str += Operand(inst->ops[i]);
+            }
+            str += ")\n";
+            break;
+        case KOOPA_RVT_RETURN:
+            str += "ret";
+            if (!inst->ops.empty())
+                str += " " + Operand(inst->ops[0]);
+            str += "\n";
+            break;
+        default:
+            assert(false);
+        }
+    }
+};
+
+class IRProgram {
+public:
+    vector<IRValue*> globals;
+    vector<IRFunction*> funcs;
+
+    // lift the raw program built by libkoopa
+    IRProgram(const koopa_raw_program_t &raw) {
+        for (size_t i = 0; i < raw.funcs.len; i++) {
+            auto func = reinterpret_cast<koopa_raw_function_t>(raw.funcs.buffer[i]);
+            funcPool.emplace_back(new IRFunction);
+            IRFunction *f = funcPool.back().get();
+            f->name = func->name;
+            f->ty = LiftType(func->ty);
+            funcMap[func] = f;
+            funcs.push_back(f);
+        }
+        for (size_t i = 0; i < raw.values.len; i++) {
+            auto value = reinterpret_cast<koopa_raw_value_t>(raw.values.buffer[i]);
+            IRValue *g = NewGlobalValue(KOOPA_RVT_GLOBAL_ALLOC, LiftType(value->ty));
+            g->name = value->name;
+            g->ops = {LiftInit(value->kind.data.global_alloc.init)};
+            valueMap[value] = g;
+            globals.push_back(g);
+        }
+        for (size_t i = 0; i < raw.funcs.len; i++) {
+            auto func = reinterpret_cast<koopa_raw_function_t>(raw.funcs.buffer[i]);
+            LiftFunction(func, funcMap[func]);
+        }
+    }
+
+    IRValue *NewGlobalValue(koopa_raw_value_tag_t tag, IRType *ty) {
+        globalPool.emplace_back(new IRValue(tag, ty));
+        return globalPool.back().get();
+    }
+
+    // the function of that name, declared if it is not there yet
+    IRFunction *Declare(const string &name, const vector<IRType*> &params, IRType *ret) {
+        for (auto f : funcs) {
+            if (f->name == name)
+                return f;
+        }
+        funcPool.emplace_back(new IRFunction);
+        IRFunction *f = funcPool.back().get();
+        f->name = name;
+        f->ty = IRType::Function(params, ret);
+        funcs.push_back(f);
+        return f;
+    }
+
+    void GenKoopa(string &str) {
+        for (auto f : funcs) {
+            if (f->IsDecl())
+                f->GenKoopa(str);
+        }
+        str += "\n";
+        for (auto g : globals) {
+            str += "global " + g->name + " = alloc " + g->ty->base->ToString() + ", ";
+            GenInitKoopa(g->ops[0], str);
+            str += "\n\n";
+        }
+        for (auto f : funcs) {
+            if (!f->IsDecl())
+                f->GenKoopa(str);
+        }
+    }
+
+private:
+    vector<unique_ptr<IRFunction>> funcPool;
+    vector<unique_ptr<IRValue>> globalPool;
+    map<koopa_raw_function_t, IRFunction*> funcMap;
+    map<koopa_raw_value_t, IRValue*> valueMap;
+    map<koopa_raw_basic_block_t, IRBasicBlock*> blockMap;
+
+    IRType *LiftType(koopa_raw_type_t ty) {
+        switch (ty->tag) {
+        case KOOPA_RTT_INT32:
+            return IRType::Int32();
+        case KOOPA_RTT_UNIT:
+            return IRType::Unit();
+        case KOOPA_RTT_ARRAY:
+            return IRType::Array(LiftType(ty->data.array.base), ty->data.array.len);
+        case KOOPA_RTT_POINTER:
+            return IRType::Pointer(LiftType(ty->data.pointer.base));
+        case KOOPA_RTT_FUNCTION: {
+            vector<IRType*> params;
+            auto slice = ty->data.function.params;
+            for (size_t i = 0; i < slice.len; i++)
+                params.push_back(LiftType(reinterpret_cast<koopa_raw_type_t>(slice.buffer[i])));
+            return IRType::Function(params, LiftType(ty->data.function.ret));
+        }
+        }
+        assert(false);
+        return nullptr;
+    }
+
+    IRValue *LiftInit(koopa_raw_value_t init) {
+        if (init->kind.tag == KOOPA_RVT_INTEGER)
+            return IRConst(init->kind.data.integer.value);
+        IRValue *v = NewGlobalValue(init->kind.tag, LiftType(init->ty));
+        if (init->kind.tag == KOOPA_RVT_AGGREGATE) {
+            auto elems = init->kind.data.aggregate.elems;
+            for (size_t i = 0; i < elems.len; i++)
+                v->ops.push_back(LiftInit(reinterpret_cast<koopa_raw_value_t>(elems.buffer[i])));
+        }
+        else {
+            // undef is treated as zeroinit
+            v->tag = KOOPA_RVT_ZERO_INIT;
+        }
+        return v;
+    }
+
+    IRValue *LiftOperand(koopa_raw_value_t value) {
+        if (value->kind.tag == KOOPA_RVT_INTEGER)
+            return IRConst(value->kind.data.integer.value);
+        assert(valueMap.find(value) != valueMap.end());
+        return valueMap[value];
+    }
+
+    void LiftFunction(koopa_raw_function_t func, IRFunction *f) {
+        for (size_t i = 0; i < func->params.len; i++) {
+            auto param = reinterpret_cast<koopa_raw_value_t>(func->params.buffer[i]);
+            IRValue *p = f->NewValue(KOOPA_RVT_FUNC_ARG_REF, LiftType(param->ty));
+            p->name = param->name;
+            p->imm = i;
+            valueMap[param] = p;
+            f->params.push_back(p);
+        }
+        // create all blocks and instructions first, operands may refer to later ones
+        for (size_t i = 0; i < func->bbs.len; i++) {
+            auto bb = reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[i]);
+            IRBasicBlock *b = f->NewBlock("bb");
+            b->name = bb->name;
+            blockMap[bb] = b;
+            f->bbs.push_back(b);
+            for (size_t j = 0; j < bb->insts.len; j++) {
+                auto inst = reinterpret_cast<koopa_raw_value_t>(bb->insts.buffer[j]);
+                IRValue *v = f->NewValue(inst->kind.tag, LiftType(inst->ty));
+                // temporaries are renumbered when printed
+                if (inst->name != nullptr && inst->name[0] == '@')
+                    v->name = inst->name;
+                v->bb = b;
+                valueMap[inst] = v;
+                b->insts.push_back(v);
+            }
+        }
+        for (size_t i = 0; i < func->bbs.len; i++) {
+            auto bb = reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[i]);
+            for (size_t j = 0; j < bb->insts.len; j++) {
+                auto inst = reinterpret_cast<koopa_raw_value_t>(bb->insts.buffer[j]);
+                LiftInst(inst, valueMap[inst]);
+            }
+        }
+    }
+
+    void LiftInst(koopa_raw_value_t inst, IRValue *v) {
+        const auto &kind = inst->kind;
+        switch (kind.tag) {
+        case KOOPA_RVT_ALLOC:
+            break;
+        case KOOPA_RVT_LOAD:
+            v->ops = {LiftOperand(kind.data.load.src)};
+            break;
+        case KOOPA_RVT_STORE:
+            v->ops = {LiftOperand(kind.data.store.value), LiftOperand(kind.data.store.dest)};
+            break;
+        case KOOPA_RVT_GET_PTR:
+            v->ops = {LiftOperand(kind.data.get_ptr.src), LiftOperand(kind.data.get_ptr.index)};
+            break;
+        case KOOPA_RVT_GET_ELEM_PTR:
+            v->ops = {LiftOperand(kind.data.get_elem_ptr.src), LiftOperand(kind.data.get_elem_ptr.index)};
+            break;
+        case KOOPA_RVT_BINARY:
+            v->imm = kind.data.binary.op;
+            v->ops = {LiftOperand(kind.data.binary.lhs), LiftOperand(kind.data.binary.rhs)};
+            break;
+        case KOOPA_RVT_BRANCH:
+            v->ops = {LiftOperand(kind.data.branch.cond)};
+            v->targets = {blockMap[kind.data.branch.true_bb], blockMap[kind.data.branch.false_bb]};
+            break;
+        case KOOPA_RVT_JUMP:
+            v->targets = {blockMap[kind.data.jump.target]};
+            break;
+        case KOOPA_RVT_CALL:
+            v->callee = funcMap[kind.data.call.callee];
+            for (size_t i = 0; i < kind.data.call.args.len; i++)
+                v->ops.push_back(LiftOperand(reinterpret_cast<koopa_raw_value_t>(kind.data.call.args.buffer[i])));
+            break;
+        case KOOPA_RVT_RETURN:
+            if (kind.data.ret.value != nullptr)
+                v->ops = {LiftOperand(kind.data.ret.value)};
+            break;
+        default:
+            assert(false);
+        }
+    }
+
+    void GenInitKoopa(IRValue *init, string &str) {
+        if (init->tag == KOOPA_RVT_INTEGER) {
+            str += to_string(init->imm);
+        }
+        else if (init->tag == KOOPA_RVT_ZERO_INIT) {
+            str += "zeroinit";
+        }
+        else {
+            str += "{";
+            for (size_t i = 0; i < init->ops.size(); i++) {
+                if (i > 0)
+                    str += ", ";
+                GenInitKoopa(init->ops[i], str);
+            }
+            str += "}";
+        }
+    }
+};
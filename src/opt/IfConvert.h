@@ -0,0 +1,189 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "options.h"
+#include "opt/IR.h"
+#include "opt/Simplify.h"
+
+using namespace std;
+
+// If-conversion.
+// A branch on data, like `if (a < b) x = a; else x = b;`, is hard to
+// predict. When both sides of a diamond, or the one side of a triangle, only
+// compute a few values and store them to scalar variables, the computations
+// are moved above the branch and each variable is stored once with
+//   select(c, t, f) = f ^ ((t ^ f) & -c)
+// so the branch disappears. With Zicond the mask is a multiplication by c,
+// which the backend turns into czero.eqz.
+
+class IfConvert {
+public:
+    IfConvert(IRFunction *_func) : func(_func) {
+    }
+
+    // returns true if some branches were removed
+    bool Run() {
+        bool changed = false, converted = true;
+        // inner diamonds are converted first, the outer ones become small enough after merging
+        while (converted) {
+            converted = false;
+            auto preds = func->ComputePreds();
+            for (auto bb : func->bbs) {
+                if (RunOnBlock(bb, preds)) {
+                    converted = changed = true;
+                    break;
+                }
+            }
+            if (converted)
+                SimplifyFunction(func);
+        }
+        return changed;
+    }
+
+private:
+    IRFunction *func;
+
+    static const int armBudget = 4;   // values computed in each side
+    static const int storeBudget = 2; // variables stored in each side
+
+    // a side of the branch that can run unconditionally: loads of scalars,
+    // arithmetic that cannot trap, then stores to scalars
+    struct Arm {
+        IRBasicBlock *bb = nullptr; // nullptr for the empty side of a triangle
+        vector<IRValue*> values;
+        map<IRValue*, IRValue*> stores; // variable -> value stored last
+        vector<IRValue*> order;         // variables in the order of their first store
+    };
+
+    static bool IsScalar(IRValue *ptr) {
+        if (ptr->tag != KOOPA_RVT_ALLOC && ptr->tag != KOOPA_RVT_GLOBAL_ALLOC)
+            return false;
+        return ptr->ty->base == IRType::Int32();
+    }
+
+    static bool IsBool(IRValue *v) {
+        if (v->tag != KOOPA_RVT_BINARY)
+            return false;
+        int op = v->imm;
+        return op == KOOPA_RBO_EQ || op == KOOPA_RBO_NOT_EQ || op == KOOPA_RBO_LT ||
+               op == KOOPA_RBO_GT || op == KOOPA_RBO_LE || op == KOOPA_RBO_GE;
+    }
+
+    bool AnalyzeArm(IRBasicBlock *bb, IRBasicBlock *from, IRBasicBlock *&join,
+                    map<IRBasicBlock*, vector<IRBasicBlock*>> &preds, Arm &arm) {
+        if (preds[bb].size() != 1 || preds[bb][0] != from)
+            return false;
+        IRValue *term = bb->Terminator();
+        if (term == nullptr || term->tag != KOOPA_RVT_JUMP)
+            return false;
+        arm.bb = bb;
+        join = term->targets[0];
+        for (auto inst : bb->insts) {
+            if (inst == term)
+                break;
+            if (inst->tag == KOOPA_RVT_STORE) {
+                if (!IsScalar(inst->ops[1]) || inst->ops[0]->tag == KOOPA_RVT_FUNC_ARG_REF)
+                    return false;
+                if (!arm.stores.count(inst->ops[1]))
+                    arm.order.push_back(inst->ops[1]);
+                arm.stores[inst->ops[1]] = inst->ops[0];
+                continue;
+            }
+            // the values are computed before all the stores once moved
+            if (!arm.stores.empty())
+                return false;
+            if (inst->tag == KOOPA_RVT_LOAD && IsScalar(inst->ops[0]))
+                arm.values.push_back(inst);
+            else if (inst->tag == KOOPA_RVT_BINARY && inst->imm != KOOPA_RBO_DIV && inst->imm != KOOPA_RBO_MOD)
+                arm.values.push_back(inst);
+            else
+                return false;
+        }
+        return (int)arm.values.size() <= armBudget && (int)arm.order.size() <= storeBudget;
+    }
+
+    bool RunOnBlock(IRBasicBlock *bb, map<IRBasicBlock*, vector<IRBasicBlock*>> &preds) {
+        IRValue *br = bb->Terminator();
+        if (br == nullptr || br->tag != KOOPA_RVT_BRANCH || br->ops[0]->IsConst())
+            return false;
+        IRBasicBlock *trueBB = br->targets[0], *falseBB = br->targets[1];
+        if (trueBB == falseBB || trueBB == bb || falseBB == bb)
+            return false;
+        Arm arms[2];
+        IRBasicBlock *join = nullptr, *otherJoin = nullptr;
+        if (AnalyzeArm(trueBB, bb, join, preds, arms[0])) {
+            // diamond, or a triangle with the false side empty
+            if (falseBB != join && (!AnalyzeArm(falseBB, bb, otherJoin, preds, arms[1]) || otherJoin != join))
+                return false;
+        }
+        else {
+            arms[0] = Arm();
+            // triangle with the true side empty
+            if (!AnalyzeArm(falseBB, bb, join, preds, arms[1]) || trueBB != join)
+                return false;
+        }
+        if (join == bb || (arms[0].order.empty() && arms[1].order.empty()))
+            return false;
+
+        IRValue *cond = br->ops[0];
+        bb->Remove(br);
+        for (auto &arm : arms) {
+            for (auto inst : arm.values) {
+                arm.bb->Remove(inst);
+                bb->Append(inst);
+            }
+        }
+        if (!IsBool(cond)) {
+            cond = func->NewBinary(KOOPA_RBO_NOT_EQ, cond, IRConst(0));
+            bb->Append(cond);
+        }
+        vector<IRValue*> vars = arms[0].order;
+        for (auto var : arms[1].order) {
+            if (!arms[0].stores.count(var))
+                vars.push_back(var);
+        }
+        // the old values are loaded before any of the variables is stored
+        map<IRValue*, IRValue*> values[2];
+        for (auto var : vars) {
+            IRValue *old = nullptr;
+            for (int i = 0; i < 2; i++) {
+                auto it = arms[i].stores.find(var);
+                if (it != arms[i].stores.end()) {
+                    values[i][var] = it->second;
+                    continue;
+                }
+                if (old == nullptr) {
+                    old = func->NewLoad(var);
+                    bb->Append(old);
+                }
+                values[i][var] = old;
+            }
+        }
+        IRValue *mask = nullptr;
+        for (auto var : vars) {
+            IRValue *t = values[0][var], *f = values[1][var];
+            IRValue *diff = func->NewBinary(KOOPA_RBO_XOR, t, f);
+            bb->Append(diff);
+            IRValue *masked;
+            if (options.zicond) {
+                masked = func->NewBinary(KOOPA_RBO_MUL, diff, cond);
+            }
+            else {
+                if (mask == nullptr) {
+                    mask = func->NewBinary(KOOPA_RBO_SUB, IRConst(0), cond);
+                    bb->Append(mask);
+                }
+                masked = func->NewBinary(KOOPA_RBO_AND, diff, mask);
+            }
+            bb->Append(masked);
+            IRValue *sel = func->NewBinary(KOOPA_RBO_XOR, f, masked);
+            bb->Append(sel);
+            bb->Append(func->NewStore(sel, var));
+        }
+        bb->Append(func->NewJump(join));
+        return true;
+    }
+};
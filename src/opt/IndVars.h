@@ -0,0 +1,356 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+#include "opt/Simplify.h"
+
+using namespace std;
+
+// Induction variable strength reduction.
+// A value computed in a loop is described as a recurrence {init, +, step}:
+// init is its value on entry to the loop and step is added on every iteration
+// (in elements of the pointee for pointers). Addresses and products that vary
+// with the induction variables get a variable of their own, initialized in
+// the preheader and advanced at the end of the latch, so a[i][j] in a loop
+// costs one getptr per iteration instead of a multiply and add per getelemptr.
+
+struct Recurrence {
+    IRValue *init; // defined in the preheader
+    IRValue *step; // defined in the preheader
+    bool hasMul;   // computing the value in the loop takes a multiplication
+};
+
+class IndVarReduce {
+public:
+    IndVarReduce(IRFunction *_func) {
+        func = _func;
+    }
+
+    void Run() {
+        LoopInfo li(func);
+        for (auto loop : li.InnerToOuter())
+            RunOnLoop(loop, li.dom);
+        SimplifyFunction(func);
+    }
+
+private:
+    IRFunction *func;
+    Loop *loop;
+    IRBasicBlock *preheader;
+    IRBasicBlock *latch;
+    map<IRValue*, IRValue*> ivStep;   // basic induction variable -> its step
+    map<IRValue*, IRValue*> ivUpdate; // basic induction variable -> `store i + c, i` in the latch
+    set<IRValue*> stored;
+    bool hasCall;
+    map<IRValue*, IRValue*> hoisted;
+    map<IRValue*, Recurrence> recs;
+    set<IRValue*> failed;
+
+    static const int minReplaceTrip = 17; // smaller constant loops are left to full unrolling
+    static const int maxReplaceTrip = 1 << 16;
+
+    void RunOnLoop(Loop *_loop, DomTree &dom) {
+        loop = _loop;
+        if (loop->latches.size() != 1)
+            return;
+        latch = loop->latches[0];
+        preheader = loop->Preheader(dom);
+        if (preheader == nullptr || latch->Terminator()->tag != KOOPA_RVT_JUMP)
+            return;
+        ivStep.clear();
+        ivUpdate.clear();
+        stored.clear();
+        hoisted.clear();
+        recs.clear();
+        failed.clear();
+        auto users = func->ComputeUsers();
+        FindBasicIVs(users);
+        if (ivStep.empty())
+            return;
+
+        // candidates are varying addresses and products
+        vector<IRValue*> insts;
+        set<IRValue*> candidates;
+        for (auto bb : loop->OrderedBlocks(func)) {
+            for (auto inst : bb->insts) {
+                if (inst->tag != KOOPA_RVT_BINARY && inst->tag != KOOPA_RVT_GET_PTR && inst->tag != KOOPA_RVT_GET_ELEM_PTR)
+                    continue;
+                insts.push_back(inst);
+                if (!GetRecurrence(inst))
+                    continue;
+                Recurrence &rec = recs[inst];
+                if (rec.step == IRConst(0))
+                    continue;
+                if (inst->ty->tag == KOOPA_RTT_POINTER || rec.hasMul)
+                    candidates.insert(inst);
+            }
+        }
+        // values only used by other candidates disappear with them
+        map<IRValue*, IRValue*> reduced; // variable -> its step
+        for (auto inst : insts) {
+            if (candidates.find(inst) == candidates.end())
+                continue;
+            bool needed = false;
+            for (auto user : users[inst]) {
+                if (candidates.find(user) == candidates.end())
+                    needed = true;
+            }
+            if (needed)
+                reduced[Reduce(inst)] = recs[inst].step;
+        }
+        if (!reduced.empty())
+            ReplaceExitTest(reduced);
+    }
+
+    // variables whose only store in the loop is `i = i + c` in the latch, c invariant
+    void FindBasicIVs(map<IRValue*, vector<IRValue*>> &users) {
+        map<IRValue*, int> storeCount;
+        hasCall = false;
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_CALL)
+                    hasCall = true;
+                if (inst->tag == KOOPA_RVT_STORE) {
+                    stored.insert(inst->ops[1]);
+                    storeCount[inst->ops[1]]++;
+                }
+            }
+        }
+        for (auto inst : latch->insts) {
+            if (inst->tag != KOOPA_RVT_STORE)
+                continue;
+            IRValue *var = inst->ops[1];
+            if (storeCount[var] != 1 || !func->IsPromotable(var, users))
+                continue;
+            IRValue *next = inst->ops[0];
+            if (next->tag != KOOPA_RVT_BINARY || next->bb != latch)
+                continue;
+            auto isVarLoad = [&](IRValue *v) {
+                return v->tag == KOOPA_RVT_LOAD && v->ops[0] == var && v->bb == latch;
+            };
+            IRValue *lhs = next->ops[0], *rhs = next->ops[1];
+            if (next->imm == KOOPA_RBO_ADD && isVarLoad(lhs) && IsInvariant(rhs)) {
+                ivStep[var] = Hoist(rhs);
+            }
+            else if (next->imm == KOOPA_RBO_ADD && isVarLoad(rhs) && IsInvariant(lhs)) {
+                ivStep[var] = Hoist(lhs);
+            }
+            else if (next->imm == KOOPA_RBO_SUB && isVarLoad(lhs) && IsInvariant(rhs)) {
+                ivStep[var] = Emit(KOOPA_RBO_SUB, IRConst(0), Hoist(rhs));
+            }
+            else {
+                continue;
+            }
+            ivUpdate[var] = inst;
+        }
+    }
+
+    bool IsInvariant(IRValue *v) {
+        return loop->IsInvariant(v, stored, hasCall);
+    }
+
+    IRValue *Hoist(IRValue *v) {
+        return HoistInvariant(func, loop, preheader, v, hoisted);
+    }
+
+    // binary in the preheader, folded where possible
+    IRValue *Emit(int op, IRValue *lhs, IRValue *rhs) {
+        return EmitBinary(func, preheader, op, lhs, rhs);
+    }
+
+    // a load of an induction variable sees the value of the current iteration
+    // unless it comes after the update in the latch
+    bool IsCurrentIV(IRValue *load) {
+        if (load->tag != KOOPA_RVT_LOAD || ivStep.find(load->ops[0]) == ivStep.end())
+            return false;
+        if (load->bb != latch)
+            return true;
+        auto &insts = latch->insts;
+        return find(insts.begin(), insts.end(), load) < find(insts.begin(), insts.end(), ivUpdate[load->ops[0]]);
+    }
+
+    bool GetRecurrence(IRValue *v) {
+        if (recs.find(v) != recs.end())
+            return true;
+        if (failed.find(v) != failed.end())
+            return false;
+        Recurrence rec;
+        rec.hasMul = false;
+        if (IsInvariant(v)) {
+            rec.init = Hoist(v);
+            rec.step = IRConst(0);
+        }
+        else if (IsCurrentIV(v)) {
+            IRValue *var = v->ops[0];
+            auto it = hoisted.find(var);
+            if (it == hoisted.end()) {
+                rec.init = func->NewLoad(var);
+                preheader->Append(rec.init);
+                hoisted[var] = rec.init;
+            }
+            else {
+                rec.init = it->second;
+            }
+            rec.step = ivStep[var];
+        }
+        else if (v->tag == KOOPA_RVT_BINARY || v->tag == KOOPA_RVT_GET_PTR || v->tag == KOOPA_RVT_GET_ELEM_PTR) {
+            if (!GetRecurrence(v->ops[0]) || !GetRecurrence(v->ops[1])) {
+                failed.insert(v);
+                return false;
+            }
+            Recurrence &a = recs[v->ops[0]], &b = recs[v->ops[1]];
+            rec.hasMul = a.hasMul || b.hasMul;
+            if (v->tag == KOOPA_RVT_GET_PTR) {
+                rec.init = func->NewGetPtr(a.init, b.init);
+                preheader->Append(rec.init);
+                rec.step = Emit(KOOPA_RBO_ADD, a.step, b.step);
+            }
+            else if (v->tag == KOOPA_RVT_GET_ELEM_PTR) {
+                rec.init = func->NewGetElemPtr(a.init, b.init);
+                preheader->Append(rec.init);
+                IRValue *rowStep = Emit(KOOPA_RBO_MUL, a.step, IRConst(v->ops[0]->ty->base->len));
+                rec.step = Emit(KOOPA_RBO_ADD, rowStep, b.step);
+            }
+            else if (v->imm == KOOPA_RBO_ADD || v->imm == KOOPA_RBO_SUB) {
+                rec.init = Emit(v->imm, a.init, b.init);
+                rec.step = Emit(v->imm, a.step, b.step);
+            }
+            else if (v->imm == KOOPA_RBO_MUL && (a.step == IRConst(0) || b.step == IRConst(0))) {
+                rec.init = Emit(KOOPA_RBO_MUL, a.init, b.init);
+                rec.step = (a.step == IRConst(0)) ? Emit(KOOPA_RBO_MUL, a.init, b.step) : Emit(KOOPA_RBO_MUL, a.step, b.init);
+                rec.hasMul = true;
+            }
+            else {
+                failed.insert(v);
+                return false;
+            }
+        }
+        else {
+            failed.insert(v);
+            return false;
+        }
+        recs[v] = rec;
+        return true;
+    }
+
+    // give the value a variable of its own, returns the variable
+    IRValue *Reduce(IRValue *v) {
+        Recurrence &rec = recs[v];
+        IRValue *var = func->NewAlloc(v->ty);
+        IRBasicBlock *entry = func->bbs[0];
+        var->bb = entry;
+        entry->insts.insert(entry->insts.begin(), var);
+        preheader->Append(func->NewStore(rec.init, var));
+
+        IRValue *cur = func->NewLoad(var);
+        v->bb->InsertBefore(v, cur);
+        func->ReplaceAllUses(v, cur);
+
+        IRValue *old = func->NewLoad(var);
+        latch->Append(old);
+        IRValue *next;
+        if (v->ty->tag == KOOPA_RTT_POINTER)
+            next = func->NewGetPtr(old, rec.step);
+        else
+            next = func->NewBinary(KOOPA_RBO_ADD, old, rec.step);
+        latch->Append(next);
+        latch->Append(func->NewStore(next, var));
+        return var;
+    }
+
+    // Linear function test replacement: when the counter is only kept alive by
+    // the exit test, test a reduced integer variable against its final value
+    // instead. Koopa has no pointer compares, so only integer variables qualify.
+    // The test becomes `ne`, which stays exact when the final value wraps around.
+    void ReplaceExitTest(map<IRValue*, IRValue*> &reduced) {
+        RemoveDeadCode(func);
+        IRBasicBlock *header = loop->header;
+        IRValue *br = header->Terminator();
+        if (br->tag != KOOPA_RVT_BRANCH || !loop->Contains(br->targets[0]) || loop->Contains(br->targets[1]))
+            return;
+        IRValue *cond = br->ops[0];
+        if (cond->tag != KOOPA_RVT_BINARY || cond->bb != header)
+            return;
+        int op = cond->imm;
+        if (op != KOOPA_RBO_LT && op != KOOPA_RBO_LE && op != KOOPA_RBO_GT && op != KOOPA_RBO_GE)
+            return;
+        int side = (cond->ops[0]->tag == KOOPA_RVT_LOAD) ? 0 : 1;
+        IRValue *load = cond->ops[side], *bound = cond->ops[1 - side];
+        if (load->tag != KOOPA_RVT_LOAD || load->bb != header || !bound->IsConst())
+            return;
+        IRValue *var = load->ops[0];
+        if (ivStep.find(var) == ivStep.end() || !ivStep[var]->IsConst())
+            return;
+
+        // nothing but the test and the update may read the counter in or after the loop
+        IRValue *update = ivUpdate[var];
+        IRValue *next = update->ops[0];
+        IRValue *nextLoad = (next->ops[0]->tag == KOOPA_RVT_LOAD) ? next->ops[0] : next->ops[1];
+        auto users = func->ComputeUsers();
+        for (auto user : users[var]) {
+            if (user->tag == KOOPA_RVT_STORE || user->bb == preheader)
+                continue;
+            if (user != load && user != nextLoad)
+                return;
+        }
+        if (users[load].size() != 1 || users[cond].size() != 1 || users[nextLoad].size() != 1 || users[next].size() != 1)
+            return;
+
+        // constant trip count from the last store before the loop
+        IRValue *init = nullptr;
+        for (auto it = preheader->insts.rbegin(); it != preheader->insts.rend(); it++) {
+            if ((*it)->tag == KOOPA_RVT_STORE && (*it)->ops[1] == var) {
+                init = (*it)->ops[0];
+                break;
+            }
+        }
+        if (init == nullptr || !init->IsConst())
+            return;
+        long long i = init->imm;
+        int step = ivStep[var]->imm;
+        int trip = 0;
+        while (true) {
+            int taken;
+            FoldBinary(op, side == 0 ? i : bound->imm, side == 0 ? bound->imm : i, taken);
+            if (!taken)
+                break;
+            trip++;
+            i += step;
+            if (trip > maxReplaceTrip || i < INT32_MIN || i > INT32_MAX)
+                return;
+        }
+        if (trip < minReplaceTrip)
+            return;
+
+        // an integer variable with a small constant step, so trip * step cannot wrap to zero
+        IRValue *counter = nullptr;
+        for (auto &kv : reduced) {
+            IRValue *s = kv.second;
+            if (kv.first->ty->base == IRType::Int32() && s->IsConst() && s->imm != 0 && s->imm > -(1 << 15) && s->imm < (1 << 15)) {
+                counter = kv.first;
+                break;
+            }
+        }
+        if (counter == nullptr)
+            return;
+        IRValue *counterInit = nullptr;
+        for (auto inst : preheader->insts) {
+            if (inst->tag == KOOPA_RVT_STORE && inst->ops[1] == counter)
+                counterInit = inst->ops[0];
+        }
+        IRValue *last = Emit(KOOPA_RBO_ADD, counterInit, IRConst((int)((unsigned int)trip * (unsigned int)reduced[counter]->imm)));
+        IRValue *cur = func->NewLoad(counter);
+        header->InsertBefore(cond, cur);
+        IRValue *test = func->NewBinary(KOOPA_RBO_NOT_EQ, cur, last);
+        header->InsertBefore(cond, test);
+        br->ops[0] = test;
+        latch->Remove(update);
+        RemoveDeadCode(func);
+    }
+};
@@ -0,0 +1,519 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+#include "opt/Alias.h"
+#include "opt/Simplify.h"
+
+using namespace std;
+
+// Loop interchange.
+// A perfect nest of two counted loops whose inner loop walks an array
+// along a row, `a[j][i]` with j inner, touches a new row on every
+// iteration. If the subscripts are affine in i and j, the dependence
+// distances between the accesses tell whether the iterations may run in the
+// other order; the loops are then swapped so the inner loop is stride-1.
+// Both loops keep their blocks: the headers trade their tests, the
+// initializations and the increments trade places.
+
+// one level of the nest
+struct NestLevel {
+    Loop *loop;
+    IRValue *var;        // alloc of the induction variable
+    IRValue *initStore;  // `store init, var` before the loop
+    IRValue *update;     // `store var + step, var` at the end of the latch
+    int step;
+    IRValue *cond;       // the test in the header
+    int varSide;         // operand index of the variable in cond
+};
+
+// sum of coefficient * variable plus a constant; the variables are the
+// induction variables and scalars not stored in the nest
+struct Affine {
+    map<IRValue*, int> coefs;
+    int constant = 0;
+
+    int Coef(IRValue *var) const {
+        auto it = coefs.find(var);
+        return (it == coefs.end()) ? 0 : it->second;
+    }
+};
+
+class LoopInterchange {
+public:
+    LoopInterchange(IRFunction *_func) : func(_func), aa(_func) {
+    }
+
+    // returns true if some nests were interchanged
+    bool Run() {
+        bool changed = false;
+        LoopInfo li(func);
+        auto users = func->ComputeUsers();
+        for (auto &loop : li.loops) {
+            if (RunOnNest(loop.get(), li.dom, users)) {
+                changed = true;
+                users = func->ComputeUsers();
+            }
+        }
+        return changed;
+    }
+
+private:
+    IRFunction *func;
+    AliasAnalysis aa;
+    NestLevel outer, inner;
+    set<IRValue*> stored; // scalars stored in the nest
+
+    struct Access {
+        IRValue *inst;
+        MemLoc loc;
+        vector<Affine> subs;
+        bool isStore;
+    };
+
+    // the outer loop contains only the inner loop, the initialization of
+    // the inner variable and the increment of its own
+    bool RunOnNest(Loop *loop, DomTree &dom, map<IRValue*, vector<IRValue*>> &users) {
+        if (loop->children.size() != 1 || !loop->children[0]->children.empty())
+            return false;
+        Loop *in = loop->children[0];
+        IRBasicBlock *preheader = loop->Preheader(dom);
+        IRBasicBlock *innerPre = in->Preheader(dom);
+        if (preheader == nullptr || innerPre == nullptr || loop->latches.size() != 1 || in->latches.size() != 1)
+            return false;
+        if (loop->ExitBlocks().size() != 1 || in->ExitBlocks().size() != 1)
+            return false;
+        IRBasicBlock *exit = loop->ExitBlocks()[0];
+        IRBasicBlock *innerExit = in->ExitBlocks()[0];
+        if (innerExit != loop->latches[0] || loop->blocks.size() != in->blocks.size() + 3)
+            return false;
+        if (!loop->Contains(innerPre) || innerPre == loop->header || innerExit == loop->header)
+            return false;
+        // the body of the outer loop is the inner loop between two straight blocks
+        if (innerPre->insts.size() != 2 || innerExit->insts.size() != 4)
+            return false;
+        if (innerExit->Terminator()->tag != KOOPA_RVT_JUMP || in->latches[0]->Terminator()->tag != KOOPA_RVT_JUMP)
+            return false;
+
+        stored.clear();
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_CALL || inst->tag == KOOPA_RVT_RETURN)
+                    return false;
+                if (inst->tag == KOOPA_RVT_STORE)
+                    stored.insert(inst->ops[1]);
+            }
+        }
+        outer.loop = loop;
+        inner.loop = in;
+        if (!AnalyzeLevel(outer, preheader, loop->latches[0], users))
+            return false;
+        if (!AnalyzeLevel(inner, innerPre, in->latches[0], users) || inner.var == outer.var)
+            return false;
+        // rectangular: the inner loop starts and ends the same way for every i
+        if (!outer.loop->IsDefinedOutside(inner.initStore->ops[0]) || !IsHeaderOf(outer, users) || !IsHeaderOf(inner, users))
+            return false;
+        // the variables end with the same values, unless one of the loops runs zero times
+        if (!(RunsOnce(outer) && RunsOnce(inner)) && (IsLive(outer.var, exit) || IsLive(inner.var, exit)))
+            return false;
+
+        vector<Access> accesses;
+        if (!CollectAccesses(in, users, accesses) || !IsLegal(accesses))
+            return false;
+        if (RowJumps(accesses, inner.var) <= RowJumps(accesses, outer.var))
+            return false;
+        Swap(preheader, innerPre);
+        return true;
+    }
+
+    // the variable is initialized at the end of pre and incremented at the end of the latch
+    bool AnalyzeLevel(NestLevel &level, IRBasicBlock *pre, IRBasicBlock *latch,
+                      map<IRValue*, vector<IRValue*>> &users) {
+        auto &insts = latch->insts;
+        if (insts.size() < 4)
+            return false;
+        IRValue *update = insts[insts.size() - 2];
+        IRValue *next = insts[insts.size() - 3];
+        IRValue *load = insts[insts.size() - 4];
+        if (update->tag != KOOPA_RVT_STORE || update->ops[0] != next || next->tag != KOOPA_RVT_BINARY)
+            return false;
+        level.var = update->ops[1];
+        if (!func->IsPromotable(level.var, users))
+            return false;
+        if (load->tag != KOOPA_RVT_LOAD || load->ops[0] != level.var || users[load].size() != 1 || users[next].size() != 1)
+            return false;
+        if (next->imm == KOOPA_RBO_ADD && next->ops[0] == load && next->ops[1]->IsConst())
+            level.step = next->ops[1]->imm;
+        else if (next->imm == KOOPA_RBO_ADD && next->ops[1] == load && next->ops[0]->IsConst())
+            level.step = next->ops[0]->imm;
+        else if (next->imm == KOOPA_RBO_SUB && next->ops[0] == load && next->ops[1]->IsConst())
+            level.step = -next->ops[1]->imm;
+        else
+            return false;
+        level.update = update;
+
+        // the last store to the variable before the loop, nothing reads it after
+        level.initStore = nullptr;
+        for (auto inst : pre->insts) {
+            if (inst->tag == KOOPA_RVT_STORE && inst->ops[1] == level.var)
+                level.initStore = inst;
+            else if (inst->tag == KOOPA_RVT_LOAD && inst->ops[0] == level.var)
+                level.initStore = nullptr;
+        }
+        if (level.initStore == nullptr)
+            return false;
+        // no other stores to the variable in the nest
+        for (auto bb : outer.loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_STORE && inst->ops[1] == level.var && inst != level.update && inst != level.initStore)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // the header tests `var < bound` or the like, moving towards the bound by
+    // the step, on values that do not change in the nest; it enters the body
+    // on true
+    bool IsHeaderOf(NestLevel &level, map<IRValue*, vector<IRValue*>> &users) {
+        Loop *loop = level.loop;
+        IRValue *var = level.var;
+        IRBasicBlock *header = loop->header;
+        IRValue *br = header->Terminator();
+        if (br->tag != KOOPA_RVT_BRANCH || !loop->Contains(br->targets[0]) || loop->Contains(br->targets[1]))
+            return false;
+        for (auto inst : header->insts) {
+            if (inst == br)
+                continue;
+            for (auto user : users[inst]) {
+                if (user->bb != header)
+                    return false;
+            }
+            if (inst->tag == KOOPA_RVT_LOAD) {
+                IRValue *src = inst->ops[0];
+                if (src != var && (stored.count(src) || !IsScalar(src)))
+                    return false;
+            }
+            else if (inst->tag != KOOPA_RVT_BINARY || inst->imm == KOOPA_RBO_DIV || inst->imm == KOOPA_RBO_MOD) {
+                return false;
+            }
+        }
+        IRValue *cond = br->ops[0];
+        if (cond->tag != KOOPA_RVT_BINARY || cond->bb != header)
+            return false;
+        int side = -1;
+        for (int i = 0; i < 2; i++) {
+            if (cond->ops[i]->tag == KOOPA_RVT_LOAD && cond->ops[i]->ops[0] == var)
+                side = i;
+        }
+        if (side < 0 || UsesVar(cond->ops[1 - side], var))
+            return false;
+        level.cond = cond;
+        level.varSide = side;
+        int op = cond->imm;
+        bool up = (side == 0) ? (op == KOOPA_RBO_LT || op == KOOPA_RBO_LE) : (op == KOOPA_RBO_GT || op == KOOPA_RBO_GE);
+        bool down = (side == 0) ? (op == KOOPA_RBO_GT || op == KOOPA_RBO_GE) : (op == KOOPA_RBO_LT || op == KOOPA_RBO_LE);
+        return (up && level.step > 0) || (down && level.step < 0);
+    }
+
+    // no calls in the nest, so globals do not change behind its back either
+    static bool IsScalar(IRValue *ptr) {
+        if (ptr->tag != KOOPA_RVT_ALLOC && ptr->tag != KOOPA_RVT_GLOBAL_ALLOC)
+            return false;
+        return ptr->ty->base == IRType::Int32();
+    }
+
+    static bool RunsOnce(NestLevel &level) {
+        IRValue *init = level.initStore->ops[0], *bound = level.cond->ops[1 - level.varSide];
+        if (!init->IsConst() || !bound->IsConst())
+            return false;
+        int taken;
+        if (level.varSide == 0)
+            FoldBinary(level.cond->imm, init->imm, bound->imm, taken);
+        else
+            FoldBinary(level.cond->imm, bound->imm, init->imm, taken);
+        return taken != 0;
+    }
+
+    static bool UsesVar(IRValue *v, IRValue *var) {
+        if (v->tag == KOOPA_RVT_LOAD)
+            return v->ops[0] == var;
+        for (auto op : v->ops) {
+            if (UsesVar(op, var))
+                return true;
+        }
+        return false;
+    }
+
+    // whether var may be read after leaving the nest before it is stored again
+    bool IsLive(IRValue *var, IRBasicBlock *from) {
+        set<IRBasicBlock*> visited;
+        vector<IRBasicBlock*> stack = {from};
+        visited.insert(from);
+        while (!stack.empty()) {
+            IRBasicBlock *bb = stack.back();
+            stack.pop_back();
+            bool killed = false;
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_LOAD && inst->ops[0] == var)
+                    return true;
+                if (inst->tag == KOOPA_RVT_STORE && inst->ops[1] == var) {
+                    killed = true;
+                    break;
+                }
+            }
+            if (killed)
+                continue;
+            for (auto succ : bb->Succs()) {
+                if (visited.insert(succ).second)
+                    stack.push_back(succ);
+            }
+        }
+        return false;
+    }
+
+    bool GetAffine(IRValue *v, Affine &res) {
+        if (v->IsConst()) {
+            res.constant = v->imm;
+            return true;
+        }
+        if (v->tag == KOOPA_RVT_LOAD) {
+            IRValue *src = v->ops[0];
+            if (src != outer.var && src != inner.var && stored.count(src))
+                return false;
+            if (!IsScalar(src))
+                return false;
+            res.coefs[src] = 1;
+            return true;
+        }
+        if (v->tag != KOOPA_RVT_BINARY)
+            return false;
+        Affine lhs, rhs;
+        if (!GetAffine(v->ops[0], lhs) || !GetAffine(v->ops[1], rhs))
+            return false;
+        int sign = 1;
+        switch (v->imm) {
+        case KOOPA_RBO_SUB:
+            sign = -1;
+            // fall through
+        case KOOPA_RBO_ADD:
+            res = lhs;
+            res.constant += sign * rhs.constant;
+            for (auto &kv : rhs.coefs)
+                res.coefs[kv.first] += sign * kv.second;
+            return true;
+        case KOOPA_RBO_MUL:
+            if (!lhs.coefs.empty() && !rhs.coefs.empty())
+                return false;
+            if (lhs.coefs.empty())
+                swap(lhs, rhs);
+            res = lhs;
+            res.constant *= rhs.constant;
+            for (auto &kv : res.coefs)
+                kv.second *= rhs.constant;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // array accesses of the inner loop with affine subscripts; the only
+    // scalars stored are sums, `s = s + e`, which may be added in any order
+    bool CollectAccesses(Loop *in, map<IRValue*, vector<IRValue*>> &users, vector<Access> &accesses) {
+        for (auto bb : in->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst == inner.update || (inst->tag != KOOPA_RVT_LOAD && inst->tag != KOOPA_RVT_STORE))
+                    continue;
+                bool isStore = (inst->tag == KOOPA_RVT_STORE);
+                IRValue *ptr = isStore ? inst->ops[1] : inst->ops[0];
+                MemLoc loc = aa.Decompose(ptr);
+                if (AliasAnalysis::IsScalar(loc)) {
+                    if (loc.base == outer.var || loc.base == inner.var || !stored.count(loc.base))
+                        continue;
+                    if (!IsSum(isStore ? inst : nullptr, loc.base, users))
+                        return false;
+                    continue;
+                }
+                Access access;
+                access.inst = inst;
+                access.loc = loc;
+                access.isStore = isStore;
+                for (auto index : loc.path) {
+                    Affine sub;
+                    if (!GetAffine(index, sub))
+                        return false;
+                    access.subs.push_back(sub);
+                }
+                accesses.push_back(access);
+            }
+        }
+        return true;
+    }
+
+    // var is only read by its one store, as in `store (load var) + e, var`
+    bool IsSum(IRValue *store, IRValue *var, map<IRValue*, vector<IRValue*>> &users) {
+        IRValue *storeOf = nullptr;
+        int loads = 0;
+        for (auto user : users[var]) {
+            if (!outer.loop->Contains(user->bb))
+                continue;
+            if (user->tag == KOOPA_RVT_LOAD)
+                loads++;
+            else if (storeOf == nullptr)
+                storeOf = user;
+            else
+                return false;
+        }
+        if (storeOf == nullptr || loads != 1 || (store != nullptr && store != storeOf))
+            return false;
+        IRValue *sum = storeOf->ops[0];
+        if (sum->tag != KOOPA_RVT_BINARY || users[sum].size() != 1)
+            return false;
+        auto isLoad = [&](IRValue *v) {
+            return v->tag == KOOPA_RVT_LOAD && v->ops[0] == var && v->bb == storeOf->bb && users[v].size() == 1;
+        };
+        if (sum->imm == KOOPA_RBO_ADD)
+            return isLoad(sum->ops[0]) || isLoad(sum->ops[1]);
+        return sum->imm == KOOPA_RBO_SUB && isLoad(sum->ops[0]);
+    }
+
+    // Two accesses touch the same element in iterations (i1, j1) and (i2, j2)
+    // when every subscript agrees. With equal coefficients on both sides each
+    // subscript fixes the distance i1 - i2 or j1 - j2, or shows that there is
+    // none. Returns false when the distances cannot be told.
+    bool Distance(const Access &a, const Access &b, bool &dependent, int dist[2], bool fixed[2]) {
+        dependent = true;
+        fixed[0] = fixed[1] = false;
+        if (a.subs.size() != b.subs.size())
+            return false;
+        IRValue *vars[2] = {outer.var, inner.var};
+        for (size_t k = 0; k < a.subs.size(); k++) {
+            const Affine &x = a.subs[k], &y = b.subs[k];
+            set<IRValue*> all;
+            for (auto &kv : x.coefs)
+                all.insert(kv.first);
+            for (auto &kv : y.coefs)
+                all.insert(kv.first);
+            for (auto v : all) {
+                if (x.Coef(v) != y.Coef(v))
+                    return false;
+            }
+            int c = y.constant - x.constant;
+            int coef[2] = {x.Coef(vars[0]), x.Coef(vars[1])};
+            if (coef[0] != 0 && coef[1] != 0)
+                return false;
+            if (coef[0] == 0 && coef[1] == 0) {
+                if (c != 0) {
+                    dependent = false;
+                    return true;
+                }
+                continue;
+            }
+            int v = (coef[0] != 0) ? 0 : 1;
+            if (c % coef[v] != 0 || (fixed[v] && dist[v] != c / coef[v])) {
+                dependent = false;
+                return true;
+            }
+            fixed[v] = true;
+            dist[v] = c / coef[v];
+        }
+        return true;
+    }
+
+    // swapping the loops reverses the order of two iterations exactly when
+    // one of them comes first in i and the other first in j; dist is in
+    // values of the variables, a loop that counts down runs them backwards
+    bool IsLegal(vector<Access> &accesses) {
+        for (size_t x = 0; x < accesses.size(); x++) {
+            for (size_t y = x; y < accesses.size(); y++) {
+                Access &a = accesses[x], &b = accesses[y];
+                if (!a.isStore && !b.isStore)
+                    continue;
+                if (a.loc.base != b.loc.base || a.loc.kind != b.loc.kind) {
+                    MemLoc objA = a.loc, objB = b.loc;
+                    objA.path.clear();
+                    objB.path.clear();
+                    if (aa.MayAlias(objA, objB))
+                        return false;
+                    continue;
+                }
+                bool dependent;
+                int dist[2];
+                bool fixed[2];
+                if (!Distance(a, b, dependent, dist, fixed))
+                    return false;
+                if (!dependent)
+                    continue;
+                int steps[2] = {outer.step, inner.step};
+                bool pos[2], neg[2];
+                for (int v = 0; v < 2; v++) {
+                    int order = (steps[v] < 0) ? -dist[v] : dist[v];
+                    pos[v] = !fixed[v] || order > 0;
+                    neg[v] = !fixed[v] || order < 0;
+                }
+                if ((pos[0] && neg[1]) || (neg[0] && pos[1]))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // accesses that move to another row when var changes
+    int RowJumps(vector<Access> &accesses, IRValue *var) {
+        int count = 0;
+        for (auto &access : accesses) {
+            for (size_t k = 0; k + 1 < access.subs.size(); k++) {
+                if (access.subs[k].Coef(var) != 0) {
+                    count++;
+                    break;
+                }
+            }
+        }
+        return count;
+    }
+
+    void Swap(IRBasicBlock *preheader, IRBasicBlock *innerPre) {
+        // the tests
+        IRBasicBlock *headers[2] = {outer.loop->header, inner.loop->header};
+        vector<IRValue*> tests[2];
+        IRValue *brs[2], *conds[2];
+        for (int k = 0; k < 2; k++) {
+            brs[k] = headers[k]->Terminator();
+            conds[k] = brs[k]->ops[0];
+            tests[k].assign(headers[k]->insts.begin(), headers[k]->insts.end() - 1);
+        }
+        for (int k = 0; k < 2; k++) {
+            headers[k]->insts = tests[1 - k];
+            for (auto inst : headers[k]->insts)
+                inst->bb = headers[k];
+            headers[k]->insts.push_back(brs[k]);
+            brs[k]->ops[0] = conds[1 - k];
+        }
+
+        // the initializations; the inner one is invariant, so it is available in the preheader
+        IRValue *outerInit = outer.initStore->ops[0];
+        preheader->Remove(outer.initStore);
+        innerPre->Remove(inner.initStore);
+        preheader->Append(func->NewStore(inner.initStore->ops[0], inner.var));
+        innerPre->Append(func->NewStore(outerInit, outer.var));
+
+        // the increments
+        NestLevel *levels[2] = {&outer, &inner};
+        int steps[2] = {outer.step, inner.step};
+        for (int k = 0; k < 2; k++) {
+            IRValue *update = levels[k]->update;
+            IRValue *next = update->ops[0];
+            IRValue *load = (next->ops[0]->tag == KOOPA_RVT_LOAD) ? next->ops[0] : next->ops[1];
+            IRValue *var = levels[1 - k]->var;
+            load->ops[0] = var;
+            next->imm = KOOPA_RBO_ADD;
+            next->ops = {load, IRConst(steps[1 - k])};
+            update->ops[1] = var;
+        }
+    }
+};
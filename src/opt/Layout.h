@@ -0,0 +1,72 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+
+using namespace std;
+
+// Basic block placement.
+// Blocks are chained along the likely path: from each block the layout
+// continues with a successor that stays in the innermost loop, so loop
+// bodies are contiguous and loop exits are placed after the whole loop.
+// The backend then drops jumps to the next block and inverts branches
+// whose true target comes next.
+
+static int LoopDepth(LoopInfo &li, IRBasicBlock *bb) {
+    int depth = 0;
+    for (Loop *loop = li.LoopOf(bb); loop != nullptr; loop = loop->parent)
+        depth++;
+    return depth;
+}
+
+static void LayoutBlocks(IRFunction *func) {
+    if (func->IsDecl())
+        return;
+    LoopInfo li(func);
+    map<IRBasicBlock*, int> depth;
+    for (auto bb : func->bbs)
+        depth[bb] = LoopDepth(li, bb);
+
+    set<IRBasicBlock*> placed;
+    vector<IRBasicBlock*> order;
+    // blocks not reached by a chain start new chains in reverse post order
+    vector<IRBasicBlock*> seeds = li.dom.rpo;
+    for (auto bb : func->bbs) {
+        if (!li.dom.Reachable(bb))
+            seeds.push_back(bb);
+    }
+    size_t seed = 0;
+    IRBasicBlock *cur = func->bbs[0];
+    while (cur != nullptr) {
+        placed.insert(cur);
+        order.push_back(cur);
+        // prefer the successor in the deepest loop, then the one first in source order
+        IRBasicBlock *next = nullptr;
+        for (auto succ : cur->Succs()) {
+            if (placed.count(succ) || succ == func->bbs[0])
+                continue;
+            if (next == nullptr || depth[succ] > depth[next])
+                next = succ;
+        }
+        // leaving a loop is taken once, its exit is placed after the loop body
+        if (next != nullptr && depth[next] < depth[cur]) {
+            for (auto bb : li.LoopOf(cur)->blocks) {
+                if (!placed.count(bb)) {
+                    next = nullptr;
+                    break;
+                }
+            }
+        }
+        while (next == nullptr && seed < seeds.size()) {
+            if (!placed.count(seeds[seed]))
+                next = seeds[seed];
+            seed++;
+        }
+        cur = next;
+    }
+    func->bbs = order;
+}
@@ -0,0 +1,271 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+#include "opt/Alias.h"
+
+using namespace std;
+
+// Redundant load elimination and store to load forwarding.
+// Blocks are visited in reverse post order, carrying what is known about
+// memory: the value last loaded from or stored to each address. A block
+// starts from what all of its predecessors agree on; a loop header starts
+// from what enters the loop, minus everything the loop body may write.
+// Loads of a known address are replaced by the known value.
+
+class LoadElim {
+public:
+    LoadElim(IRFunction *_func) : func(_func), aa(_func) {
+    }
+
+    // returns true if some loads were removed
+    bool Run() {
+        LoopInfo li(func);
+        DomTree &dom = li.dom;
+        map<IRBasicBlock*, MemState> out;
+        set<IRBasicBlock*> visited;
+        for (auto bb : dom.rpo) {
+            MemState state;
+            bool first = true, backEdge = false;
+            for (auto pred : dom.preds[bb]) {
+                if (!dom.Reachable(pred))
+                    continue;
+                if (visited.find(pred) == visited.end()) {
+                    backEdge = true;
+                    continue;
+                }
+                if (first)
+                    state = out[pred];
+                else
+                    Meet(state, out[pred]);
+                first = false;
+            }
+            if (backEdge) {
+                Loop *loop = nullptr;
+                for (auto &l : li.loops) {
+                    if (l->header == bb)
+                        loop = l.get();
+                }
+                if (loop == nullptr)
+                    state = MemState();
+                else
+                    KillLoop(state, loop);
+            }
+            Visit(bb, state);
+            out[bb] = state;
+            visited.insert(bb);
+        }
+
+        for (auto bb : func->bbs) {
+            bb->insts.erase(remove_if(bb->insts.begin(), bb->insts.end(), [&](IRValue *inst) {
+                return replaced.find(inst) != replaced.end();
+            }), bb->insts.end());
+            for (auto inst : bb->insts) {
+                for (auto &op : inst->ops)
+                    op = Resolve(op);
+            }
+        }
+        return !replaced.empty();
+    }
+
+private:
+    struct Entry {
+        MemLoc loc;
+        IRValue *val;
+    };
+    struct ObjState {
+        MemLoc obj;             // the object itself, without indices
+        map<int, Entry> consts; // by offset
+        vector<Entry> dyns;
+    };
+    struct MemState {
+        map<IRValue*, ObjState> scalars; // by base
+        map<IRValue*, ObjState> arrays;
+    };
+
+    static const size_t maxEntries = 256; // per object, keeps long initializers cheap
+
+    IRFunction *func;
+    AliasAnalysis aa;
+    map<IRValue*, IRValue*> replaced;
+
+    IRValue *Resolve(IRValue *v) {
+        auto it = replaced.find(v);
+        while (it != replaced.end()) {
+            v = it->second;
+            it = replaced.find(v);
+        }
+        return v;
+    }
+
+    static bool SamePath(const MemLoc &a, const MemLoc &b) {
+        return a.path == b.path;
+    }
+
+    void Visit(IRBasicBlock *bb, MemState &state) {
+        for (auto inst : bb->insts) {
+            for (auto &op : inst->ops)
+                op = Resolve(op);
+            if (inst->tag == KOOPA_RVT_LOAD) {
+                MemLoc loc = aa.Decompose(inst->ops[0]);
+                IRValue *known = Lookup(state, loc);
+                if (known != nullptr)
+                    replaced[inst] = known;
+                else
+                    Set(state, loc, inst);
+            }
+            else if (inst->tag == KOOPA_RVT_STORE) {
+                MemLoc loc = aa.Decompose(inst->ops[1]);
+                Kill(state, loc);
+                // the backend only reads arguments in the stores at the entry
+                if (inst->ops[0]->tag != KOOPA_RVT_FUNC_ARG_REF)
+                    Set(state, loc, inst->ops[0]);
+            }
+            else if (inst->tag == KOOPA_RVT_CALL) {
+                KillCall(state);
+            }
+        }
+    }
+
+    ObjState *Find(MemState &state, const MemLoc &loc) {
+        auto &objs = AliasAnalysis::IsScalar(loc) ? state.scalars : state.arrays;
+        auto it = objs.find(loc.base);
+        return (it == objs.end()) ? nullptr : &it->second;
+    }
+
+    IRValue *Lookup(MemState &state, const MemLoc &loc) {
+        ObjState *obj = Find(state, loc);
+        if (obj == nullptr)
+            return nullptr;
+        if (loc.isConst) {
+            auto it = obj->consts.find(loc.offset);
+            return (it == obj->consts.end()) ? nullptr : it->second.val;
+        }
+        for (auto &e : obj->dyns) {
+            if (SamePath(e.loc, loc))
+                return e.val;
+        }
+        return nullptr;
+    }
+
+    // the caller has killed whatever the address may alias
+    void Set(MemState &state, const MemLoc &loc, IRValue *val) {
+        auto &objs = AliasAnalysis::IsScalar(loc) ? state.scalars : state.arrays;
+        auto it = objs.find(loc.base);
+        if (it == objs.end()) {
+            it = objs.insert(make_pair(loc.base, ObjState())).first;
+            it->second.obj = loc;
+            it->second.obj.path.clear();
+        }
+        ObjState &obj = it->second;
+        if (loc.isConst) {
+            obj.consts[loc.offset] = Entry{loc, val};
+            if (obj.consts.size() > maxEntries)
+                obj.consts.erase(obj.consts.begin());
+        }
+        else {
+            obj.dyns.push_back(Entry{loc, val});
+            if (obj.dyns.size() > maxEntries)
+                obj.dyns.erase(obj.dyns.begin());
+        }
+    }
+
+    // forget everything a store to loc may overwrite
+    void Kill(MemState &state, const MemLoc &loc) {
+        if (AliasAnalysis::IsScalar(loc)) {
+            state.scalars.erase(loc.base);
+            return;
+        }
+        for (auto it = state.arrays.begin(); it != state.arrays.end();) {
+            ObjState &obj = it->second;
+            if (it->first != loc.base) {
+                if (aa.MayAlias(obj.obj, loc))
+                    it = state.arrays.erase(it);
+                else
+                    it++;
+                continue;
+            }
+            if (loc.isConst) {
+                obj.consts.erase(loc.offset);
+            }
+            else {
+                for (auto c = obj.consts.begin(); c != obj.consts.end();) {
+                    if (aa.MayAlias(c->second.loc, loc))
+                        c = obj.consts.erase(c);
+                    else
+                        c++;
+                }
+            }
+            obj.dyns.erase(remove_if(obj.dyns.begin(), obj.dyns.end(), [&](const Entry &e) {
+                return aa.MayAlias(e.loc, loc);
+            }), obj.dyns.end());
+            it++;
+        }
+    }
+
+    void KillCall(MemState &state) {
+        for (auto it = state.scalars.begin(); it != state.scalars.end();) {
+            if (it->first->tag == KOOPA_RVT_GLOBAL_ALLOC)
+                it = state.scalars.erase(it);
+            else
+                it++;
+        }
+        for (auto it = state.arrays.begin(); it != state.arrays.end();) {
+            if (aa.ClobberedByCall(it->second.obj))
+                it = state.arrays.erase(it);
+            else
+                it++;
+        }
+    }
+
+    void KillLoop(MemState &state, Loop *loop) {
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_STORE)
+                    Kill(state, aa.Decompose(inst->ops[1]));
+                else if (inst->tag == KOOPA_RVT_CALL)
+                    KillCall(state);
+            }
+        }
+    }
+
+    // keep what both states agree on
+    static void MeetObjs(map<IRValue*, ObjState> &a, map<IRValue*, ObjState> &b) {
+        for (auto it = a.begin(); it != a.end();) {
+            auto other = b.find(it->first);
+            if (other == b.end()) {
+                it = a.erase(it);
+                continue;
+            }
+            ObjState &x = it->second, &y = other->second;
+            for (auto c = x.consts.begin(); c != x.consts.end();) {
+                auto d = y.consts.find(c->first);
+                if (d == y.consts.end() || d->second.val != c->second.val)
+                    c = x.consts.erase(c);
+                else
+                    c++;
+            }
+            x.dyns.erase(remove_if(x.dyns.begin(), x.dyns.end(), [&](const Entry &e) {
+                for (auto &f : y.dyns) {
+                    if (SamePath(e.loc, f.loc) && e.val == f.val)
+                        return false;
+                }
+                return true;
+            }), x.dyns.end());
+            if (x.consts.empty() && x.dyns.empty())
+                it = a.erase(it);
+            else
+                it++;
+        }
+    }
+
+    static void Meet(MemState &a, MemState &b) {
+        MeetObjs(a.scalars, b.scalars);
+        MeetObjs(a.arrays, b.arrays);
+    }
+};
@@ -0,0 +1,371 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+#include "opt/Simplify.h"
+
+using namespace std;
+
+// dominator tree, computed with the iterative algorithm of Cooper, Harvey and Kennedy
+class DomTree {
+public:
+    map<IRBasicBlock*, vector<IRBasicBlock*>> preds;
+    map<IRBasicBlock*, IRBasicBlock*> idom;
+    vector<IRBasicBlock*> rpo; // reachable blocks in reverse post order
+    map<IRBasicBlock*, int> rpoIndex;
+
+    DomTree(IRFunction *func) {
+        preds = func->ComputePreds();
+        set<IRBasicBlock*> visited;
+        PostOrderDFS(func->bbs[0], visited);
+        reverse(rpo.begin(), rpo.end());
+        for (size_t i = 0; i < rpo.size(); i++)
+            rpoIndex[rpo[i]] = i;
+
+        IRBasicBlock *entry = rpo[0];
+        idom[entry] = entry;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 1; i < rpo.size(); i++) {
+                IRBasicBlock *bb = rpo[i];
+                IRBasicBlock *newIdom = nullptr;
+                for (auto pred : preds[bb]) {
+                    if (idom.find(pred) == idom.end())
+                        continue;
+                    newIdom = (newIdom == nullptr) ? pred : Intersect(pred, newIdom);
+                }
+                if (idom[bb] != newIdom) {
+                    idom[bb] = newIdom;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    bool Reachable(IRBasicBlock *bb) const {
+        return rpoIndex.find(bb) != rpoIndex.end();
+    }
+
+    // a dominates b
+    bool Dominates(IRBasicBlock *a, IRBasicBlock *b) const {
+        if (!Reachable(a) || !Reachable(b))
+            return false;
+        while (true) {
+            if (a == b)
+                return true;
+            IRBasicBlock *up = idom.at(b);
+            if (up == b)
+                return false;
+            b = up;
+        }
+    }
+
+private:
+    void PostOrderDFS(IRBasicBlock *bb, set<IRBasicBlock*> &visited) {
+        // iterative, deep nests of blocks would overflow the stack otherwise
+        vector<pair<IRBasicBlock*, size_t>> stack;
+        visited.insert(bb);
+        stack.push_back(make_pair(bb, 0));
+        while (!stack.empty()) {
+            IRBasicBlock *cur = stack.back().first;
+            vector<IRBasicBlock*> succs = cur->Succs();
+            if (stack.back().second < succs.size()) {
+                IRBasicBlock *succ = succs[stack.back().second++];
+                if (visited.insert(succ).second)
+                    stack.push_back(make_pair(succ, 0));
+            }
+            else {
+                rpo.push_back(cur);
+                stack.pop_back();
+            }
+        }
+    }
+
+    IRBasicBlock *Intersect(IRBasicBlock *a, IRBasicBlock *b) {
+        while (a != b) {
+            while (rpoIndex[a] > rpoIndex[b])
+                a = idom[a];
+            while (rpoIndex[b] > rpoIndex[a])
+                b = idom[b];
+        }
+        return a;
+    }
+};
+
+// natural loop of the back edges into one header
+class Loop {
+public:
+    IRBasicBlock *header;
+    set<IRBasicBlock*> blocks;
+    vector<IRBasicBlock*> latches;
+    Loop *parent;
+    vector<Loop*> children;
+
+    bool Contains(IRBasicBlock *bb) const {
+        return blocks.find(bb) != blocks.end();
+    }
+
+    // the unique block outside the loop that jumps to the header, nullptr if absent
+    IRBasicBlock *Preheader(DomTree &dom) const {
+        IRBasicBlock *pre = nullptr;
+        for (auto pred : dom.preds[header]) {
+            if (Contains(pred))
+                continue;
+            if (pre != nullptr)
+                return nullptr;
+            pre = pred;
+        }
+        if (pre == nullptr || pre->Succs().size() != 1)
+            return nullptr;
+        return pre;
+    }
+
+    // blocks outside the loop reached from inside
+    vector<IRBasicBlock*> ExitBlocks() const {
+        vector<IRBasicBlock*> exits;
+        for (auto bb : blocks) {
+            for (auto succ : bb->Succs()) {
+                if (!Contains(succ) && find(exits.begin(), exits.end(), succ) == exits.end())
+                    exits.push_back(succ);
+            }
+        }
+        return exits;
+    }
+
+    // loop blocks in the order they appear in the function
+    vector<IRBasicBlock*> OrderedBlocks(IRFunction *func) const {
+        vector<IRBasicBlock*> res;
+        for (auto bb : func->bbs) {
+            if (Contains(bb))
+                res.push_back(bb);
+        }
+        return res;
+    }
+
+    bool HasCall() const {
+        for (auto bb : blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_CALL)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // constants, arguments, globals and values of blocks outside the loop
+    bool IsDefinedOutside(IRValue *v) const {
+        if (v->IsConst() || v->tag == KOOPA_RVT_FUNC_ARG_REF)
+            return true;
+        return v->bb == nullptr || !Contains(v->bb);
+    }
+
+    // v has the same value on every iteration, given the addresses stored in
+    // the loop and whether it calls a function, which may change any global
+    bool IsInvariant(IRValue *v, const set<IRValue*> &stored, bool hasCall) const {
+        if (IsDefinedOutside(v))
+            return true;
+        switch (v->tag) {
+        case KOOPA_RVT_LOAD: {
+            // scalars never have their address taken, array elements may be
+            // written through pointers
+            IRValue *src = v->ops[0];
+            if (stored.count(src))
+                return false;
+            if (src->tag == KOOPA_RVT_ALLOC)
+                return src->ty->base->tag != KOOPA_RTT_ARRAY;
+            if (src->tag == KOOPA_RVT_GLOBAL_ALLOC)
+                return src->ty->base == IRType::Int32() && !hasCall;
+            return false;
+        }
+        case KOOPA_RVT_BINARY:
+            // hoisting a division could make a guarded trap unconditional
+            if (v->imm == KOOPA_RBO_DIV || v->imm == KOOPA_RBO_MOD)
+                return false;
+            return IsInvariant(v->ops[0], stored, hasCall) && IsInvariant(v->ops[1], stored, hasCall);
+        case KOOPA_RVT_GET_PTR:
+        case KOOPA_RVT_GET_ELEM_PTR:
+            return IsInvariant(v->ops[0], stored, hasCall) && IsInvariant(v->ops[1], stored, hasCall);
+        default:
+            return false;
+        }
+    }
+
+    int Size() const {
+        int size = 0;
+        for (auto bb : blocks)
+            size += bb->insts.size();
+        return size;
+    }
+
+    // no value defined in the loop is used outside of it
+    bool IsClosed(map<IRValue*, vector<IRValue*>> &users) const {
+        for (auto bb : blocks) {
+            for (auto inst : bb->insts) {
+                for (auto user : users[inst]) {
+                    if (!Contains(user->bb))
+                        return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+class LoopInfo {
+public:
+    DomTree dom;
+    vector<unique_ptr<Loop>> loops;
+
+    LoopInfo(IRFunction *func) : dom(func) {
+        map<IRBasicBlock*, Loop*> headerLoop;
+        for (auto bb : dom.rpo) {
+            for (auto succ : bb->Succs()) {
+                if (!dom.Dominates(succ, bb))
+                    continue;
+                // bb -> succ is a back edge
+                Loop *loop = headerLoop[succ];
+                if (loop == nullptr) {
+                    loops.emplace_back(new Loop);
+                    loop = loops.back().get();
+                    loop->header = succ;
+                    loop->parent = nullptr;
+                    loop->blocks.insert(succ);
+                    headerLoop[succ] = loop;
+                }
+                loop->latches.push_back(bb);
+                vector<IRBasicBlock*> stack;
+                if (loop->blocks.insert(bb).second)
+                    stack.push_back(bb);
+                while (!stack.empty()) {
+                    IRBasicBlock *cur = stack.back();
+                    stack.pop_back();
+                    for (auto pred : dom.preds[cur]) {
+                        if (dom.Reachable(pred) && loop->blocks.insert(pred).second)
+                            stack.push_back(pred);
+                    }
+                }
+            }
+        }
+        // the parent is the smallest other loop containing the header
+        for (auto &loop : loops) {
+            for (auto &other : loops) {
+                if (other.get() == loop.get() || !other->Contains(loop->header))
+                    continue;
+                if (loop->parent == nullptr || other->blocks.size() < loop->parent->blocks.size())
+                    loop->parent = other.get();
+            }
+        }
+        for (auto &loop : loops) {
+            if (loop->parent != nullptr)
+                loop->parent->children.push_back(loop.get());
+        }
+    }
+
+    // inner loops come before the loops containing them
+    vector<Loop*> InnerToOuter() const {
+        vector<Loop*> res;
+        for (auto &loop : loops)
+            res.push_back(loop.get());
+        sort(res.begin(), res.end(), [](Loop *a, Loop *b) {
+            return a->blocks.size() < b->blocks.size();
+        });
+        return res;
+    }
+
+    Loop *LoopOf(IRBasicBlock *bb) const {
+        Loop *res = nullptr;
+        for (auto &loop : loops) {
+            if (loop->Contains(bb) && (res == nullptr || loop->blocks.size() < res->blocks.size()))
+                res = loop.get();
+        }
+        return res;
+    }
+};
+
+// clone the given blocks; branches between them are redirected to the copies,
+// branches leaving the region keep their targets and can be fixed up through bmap
+static vector<IRBasicBlock*> CloneRegion(IRFunction *func, const vector<IRBasicBlock*> &region,
+                                         map<IRValue*, IRValue*> &vmap,
+                                         map<IRBasicBlock*, IRBasicBlock*> &bmap,
+                                         const string &prefix) {
+    vector<IRBasicBlock*> copies;
+    for (auto bb : region) {
+        IRBasicBlock *copy = func->NewBlock(prefix);
+        bmap[bb] = copy;
+        copies.push_back(copy);
+    }
+    for (auto bb : region) {
+        IRBasicBlock *copy = bmap[bb];
+        for (auto inst : bb->insts) {
+            IRValue *v = func->Clone(inst, vmap, bmap);
+            v->bb = copy;
+            copy->insts.push_back(v);
+        }
+    }
+    // operands defined later in the region
+    for (auto copy : copies) {
+        for (auto inst : copy->insts) {
+            for (auto &op : inst->ops) {
+                auto it = vmap.find(op);
+                if (it != vmap.end())
+                    op = it->second;
+            }
+        }
+    }
+    return copies;
+}
+
+// binary appended to bb, folded where possible
+static IRValue *EmitBinary(IRFunction *func, IRBasicBlock *bb, int op, IRValue *lhs, IRValue *rhs) {
+    int result;
+    if (lhs->IsConst() && rhs->IsConst() && FoldBinary(op, lhs->imm, rhs->imm, result))
+        return IRConst(result);
+    if (op == KOOPA_RBO_ADD && lhs == IRConst(0))
+        return rhs;
+    if ((op == KOOPA_RBO_ADD || op == KOOPA_RBO_SUB) && rhs == IRConst(0))
+        return lhs;
+    if (op == KOOPA_RBO_MUL) {
+        if (lhs == IRConst(0) || rhs == IRConst(0))
+            return IRConst(0);
+        if (lhs == IRConst(1))
+            return rhs;
+        if (rhs == IRConst(1))
+            return lhs;
+    }
+    IRValue *v = func->NewBinary(op, lhs, rhs);
+    bb->Append(v);
+    return v;
+}
+
+// the value of an invariant of the loop on entry to it, computed at the end
+// of the preheader; hoisted keeps the copies made so far
+static IRValue *HoistInvariant(IRFunction *func, const Loop *loop, IRBasicBlock *preheader, IRValue *v,
+                               map<IRValue*, IRValue*> &hoisted) {
+    if (loop->IsDefinedOutside(v))
+        return v;
+    auto it = hoisted.find(v);
+    if (it != hoisted.end())
+        return it->second;
+    IRValue *res;
+    if (v->tag == KOOPA_RVT_BINARY) {
+        IRValue *lhs = HoistInvariant(func, loop, preheader, v->ops[0], hoisted);
+        IRValue *rhs = HoistInvariant(func, loop, preheader, v->ops[1], hoisted);
+        res = EmitBinary(func, preheader, v->imm, lhs, rhs);
+    }
+    else {
+        map<IRValue*, IRValue*> vmap;
+        map<IRBasicBlock*, IRBasicBlock*> bmap;
+        for (auto op : v->ops)
+            vmap[op] = HoistInvariant(func, loop, preheader, op, hoisted);
+        res = func->Clone(v, vmap, bmap);
+        preheader->Append(res);
+    }
+    hoisted[v] = res;
+    return res;
+}
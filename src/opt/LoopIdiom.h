@@ -0,0 +1,291 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "options.h"
+#include "opt/IR.h"
+#include "opt/Loop.h"
+#include "opt/Alias.h"
+
+using namespace std;
+
+// Loop idiom recognition.
+// Innermost loops with a single body and a unit step that do one thing to
+// a range of an array are replaced by a call to a routine the backend
+// writes in assembly:
+//   while (i < n) { a[i] = 0; i = i + 1; }
+//     => __fill(&a[i], 0, n - i); i = max(i, n);
+// Filling a range with an invariant value and copying one array into
+// another are always recognized; the routines use word stores, or vector
+// stores when the vector extension is there. With the vector extension,
+// one element-wise operation of arrays and invariant scalars, and a sum of
+// an array into a scalar, become strip-mined RVV routines as well:
+//   while (i < n) { c[i] = a[i] + b[i]; i = i + 1; }
+//     => __rvv_add_vv(&c[i], &a[i], &b[i], n - i); i = max(i, n);
+// Koopa has no vector types, so this is how loops are vectorized.
+
+class LoopIdiom {
+public:
+    LoopIdiom(IRFunction *_func, IRProgram *_prog) : func(_func), prog(_prog), aa(_func) {
+    }
+
+    // returns true if some loops were replaced
+    bool Run() {
+        bool changed = false, replaced = true;
+        while (replaced) {
+            replaced = false;
+            LoopInfo li(func);
+            auto users = func->ComputeUsers();
+            for (auto loop : li.InnerToOuter()) {
+                if (loop->children.empty() && RunOnLoop(loop, li.dom, users)) {
+                    replaced = changed = true;
+                    break;
+                }
+            }
+        }
+        if (changed)
+            func->RemoveUnreachable();
+        return changed;
+    }
+
+private:
+    IRFunction *func;
+    IRProgram *prog;
+    AliasAnalysis aa;
+    Loop *loop;
+    IRBasicBlock *body;
+    IRValue *var;
+    set<IRValue*> stored;
+    map<IRValue*, IRValue*> hoisted;
+
+    bool RunOnLoop(Loop *_loop, DomTree &dom, map<IRValue*, vector<IRValue*>> &users) {
+        loop = _loop;
+        IRBasicBlock *preheader = loop->Preheader(dom);
+        if (preheader == nullptr || loop->blocks.size() != 2 || loop->latches.size() != 1 || !loop->IsClosed(users))
+            return false;
+        IRBasicBlock *header = loop->header;
+        body = loop->latches[0];
+        IRValue *br = header->Terminator();
+        if (br->tag != KOOPA_RVT_BRANCH || br->targets[0] != body || loop->Contains(br->targets[1]))
+            return false;
+        if (body->Terminator()->tag != KOOPA_RVT_JUMP)
+            return false;
+        IRBasicBlock *exit = br->targets[1];
+
+        // `i = i + 1` ends the body
+        auto &insts = body->insts;
+        if (insts.size() < 4)
+            return false;
+        IRValue *update = insts[insts.size() - 2], *next = insts[insts.size() - 3], *load = insts[insts.size() - 4];
+        if (update->tag != KOOPA_RVT_STORE || update->ops[0] != next || next->tag != KOOPA_RVT_BINARY)
+            return false;
+        var = update->ops[1];
+        if (!func->IsPromotable(var, users) || load->tag != KOOPA_RVT_LOAD || load->ops[0] != var)
+            return false;
+        if (next->imm != KOOPA_RBO_ADD || next->ops[0] != load || next->ops[1] != IRConst(1))
+            return false;
+
+        // one more store and nothing else with side effects
+        stored.clear();
+        IRValue *store = nullptr;
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_CALL)
+                    return false;
+                if (inst->tag != KOOPA_RVT_STORE || inst == update)
+                    continue;
+                if (store != nullptr)
+                    return false;
+                store = inst;
+            }
+        }
+        if (store == nullptr)
+            return false;
+        stored.insert(var);
+        stored.insert(store->ops[1]);
+
+        // the trip count, from `i < n` or `i <= n` in the header
+        IRValue *cond = br->ops[0];
+        if (cond->tag != KOOPA_RVT_BINARY || cond->bb != header)
+            return false;
+        for (auto inst : header->insts) {
+            for (auto user : users[inst]) {
+                if (user->bb != header)
+                    return false;
+            }
+        }
+        int side = (cond->ops[0]->tag == KOOPA_RVT_LOAD && cond->ops[0]->ops[0] == var) ? 0 : 1;
+        IRValue *bound = cond->ops[1 - side];
+        if (cond->ops[side]->tag != KOOPA_RVT_LOAD || cond->ops[side]->ops[0] != var || !IsInvariant(bound))
+            return false;
+        int op = cond->imm;
+        bool inclusive;
+        if ((side == 0 && op == KOOPA_RBO_LT) || (side == 1 && op == KOOPA_RBO_GT))
+            inclusive = false;
+        else if ((side == 0 && op == KOOPA_RBO_LE) || (side == 1 && op == KOOPA_RBO_GE))
+            inclusive = true;
+        else
+            return false;
+
+        hoisted.clear();
+        vector<IRValue*> args;
+        string routine;
+        if (!MatchFill(store, routine, args) && !MatchCopy(store, routine, args)) {
+            if (!options.rvv)
+                return false;
+            if (!MatchElementWise(store, routine, args) && !MatchSum(store, users, routine, args))
+                return false;
+        }
+
+        // the routine runs max(n - i, 0) iterations, then the loop is left
+        IRValue *init = func->NewLoad(var);
+        preheader->Append(init);
+        IRValue *count = EmitBinary(func, preheader, KOOPA_RBO_SUB, HoistInvariant(func, loop, preheader, bound, hoisted), init);
+        if (inclusive)
+            count = EmitBinary(func, preheader, KOOPA_RBO_ADD, count, IRConst(1));
+        for (auto &arg : args)
+            arg = Materialize(arg, init, preheader);
+        args.push_back(count);
+        bool isSum = (routine == "__rvv_redsum");
+        vector<IRType*> params;
+        for (auto arg : args)
+            params.push_back(arg->ty);
+        IRFunction *callee = prog->Declare("@" + routine, params, isSum ? IRType::Int32() : IRType::Unit());
+        IRValue *call = func->NewCall(callee, args);
+        preheader->Append(call);
+        if (isSum) {
+            IRValue *sum = store->ops[1];
+            IRValue *old = func->NewLoad(sum);
+            preheader->Append(old);
+            preheader->Append(func->NewStore(EmitBinary(func, preheader, KOOPA_RBO_ADD, old, call), sum));
+        }
+        IRValue *positive = EmitBinary(func, preheader, KOOPA_RBO_GT, count, IRConst(0));
+        IRValue *advance = EmitBinary(func, preheader, KOOPA_RBO_MUL, count, positive);
+        preheader->Append(func->NewStore(EmitBinary(func, preheader, KOOPA_RBO_ADD, init, advance), var));
+        preheader->RedirectSucc(header, exit);
+        return true;
+    }
+
+    // loops with calls are left alone
+    bool IsInvariant(IRValue *v) {
+        return loop->IsInvariant(v, stored, false);
+    }
+
+    // &base[i] with base invariant, the address of the element of this iteration
+    bool IsElement(IRValue *ptr) {
+        if (ptr->tag != KOOPA_RVT_GET_PTR && ptr->tag != KOOPA_RVT_GET_ELEM_PTR)
+            return false;
+        if (ptr->ty->base != IRType::Int32() || ptr->bb != body)
+            return false;
+        IRValue *index = ptr->ops[1];
+        return index->tag == KOOPA_RVT_LOAD && index->ops[0] == var && IsInvariant(ptr->ops[0]);
+    }
+
+    bool IsElementLoad(IRValue *v) {
+        return v->tag == KOOPA_RVT_LOAD && v->bb == body && IsElement(v->ops[0]);
+    }
+
+    // the arguments: addresses of elements are rebuilt for the first iteration
+    IRValue *Materialize(IRValue *arg, IRValue *init, IRBasicBlock *preheader) {
+        if (arg->ty->tag != KOOPA_RTT_POINTER)
+            return HoistInvariant(func, loop, preheader, arg, hoisted);
+        map<IRValue*, IRValue*> vmap;
+        map<IRBasicBlock*, IRBasicBlock*> bmap;
+        vmap[arg->ops[0]] = HoistInvariant(func, loop, preheader, arg->ops[0], hoisted);
+        vmap[arg->ops[1]] = init;
+        IRValue *res = func->Clone(arg, vmap, bmap);
+        preheader->Append(res);
+        return res;
+    }
+
+    // the arrays read and written only overlap element by element
+    bool Independent(IRValue *dst, IRValue *src) {
+        MemLoc a = aa.Decompose(dst), b = aa.Decompose(src);
+        if (a.base == b.base && a.kind == b.kind)
+            return true;
+        a.path.clear();
+        b.path.clear();
+        return !aa.MayAlias(a, b);
+    }
+
+    // a[i] = x, with x invariant
+    bool MatchFill(IRValue *store, string &routine, vector<IRValue*> &args) {
+        IRValue *dst = store->ops[1], *val = store->ops[0];
+        if (!IsElement(dst) || !IsInvariant(val))
+            return false;
+        routine = "__fill";
+        args = {dst, val};
+        return true;
+    }
+
+    // a[i] = b[i]
+    bool MatchCopy(IRValue *store, string &routine, vector<IRValue*> &args) {
+        IRValue *dst = store->ops[1], *val = store->ops[0];
+        if (!IsElement(dst) || !IsElementLoad(val) || !Independent(dst, val->ops[0]))
+            return false;
+        routine = "__copy";
+        args = {dst, val->ops[0]};
+        return true;
+    }
+
+    // c[i] = x op y, each operand an element or an invariant
+    bool MatchElementWise(IRValue *store, string &routine, vector<IRValue*> &args) {
+        IRValue *dst = store->ops[1], *val = store->ops[0];
+        if (!IsElement(dst) || val->tag != KOOPA_RVT_BINARY || val->bb != body)
+            return false;
+        static const map<int, string> names = {
+            {KOOPA_RBO_ADD, "add"}, {KOOPA_RBO_SUB, "sub"}, {KOOPA_RBO_MUL, "mul"},
+            {KOOPA_RBO_AND, "and"}, {KOOPA_RBO_OR, "or"}, {KOOPA_RBO_XOR, "xor"},
+        };
+        auto it = names.find(val->imm);
+        if (it == names.end())
+            return false;
+        IRValue *lhs = val->ops[0], *rhs = val->ops[1];
+        bool vec[2] = {IsElementLoad(lhs), IsElementLoad(rhs)};
+        if ((!vec[0] && !IsInvariant(lhs)) || (!vec[1] && !IsInvariant(rhs)) || (!vec[0] && !vec[1]))
+            return false;
+        for (int k = 0; k < 2; k++) {
+            if (vec[k] && !Independent(dst, val->ops[k]->ops[0]))
+                return false;
+        }
+        routine = "__rvv_" + it->second;
+        if (vec[0] && vec[1]) {
+            routine += "_vv";
+            args = {dst, lhs->ops[0], rhs->ops[0]};
+        }
+        else if (vec[0]) {
+            routine += "_vx";
+            args = {dst, lhs->ops[0], rhs};
+        }
+        else {
+            // x - a[i] is a reversed subtraction, the other operations commute
+            routine = (val->imm == KOOPA_RBO_SUB) ? "__rvv_rsub_vx" : routine + "_vx";
+            args = {dst, rhs->ops[0], lhs};
+        }
+        return true;
+    }
+
+    // s = s + a[i], with s read nowhere else in the loop
+    bool MatchSum(IRValue *store, map<IRValue*, vector<IRValue*>> &users, string &routine, vector<IRValue*> &args) {
+        IRValue *sum = store->ops[1], *val = store->ops[0];
+        if (sum->ty->base != IRType::Int32() || (sum->tag != KOOPA_RVT_ALLOC && sum->tag != KOOPA_RVT_GLOBAL_ALLOC))
+            return false;
+        if (val->tag != KOOPA_RVT_BINARY || val->imm != KOOPA_RBO_ADD || val->bb != body)
+            return false;
+        for (int k = 0; k < 2; k++) {
+            IRValue *old = val->ops[k], *elem = val->ops[1 - k];
+            if (old->tag != KOOPA_RVT_LOAD || old->ops[0] != sum || !IsElementLoad(elem))
+                continue;
+            for (auto user : users[sum]) {
+                if (loop->Contains(user->bb) && user != old && user != store)
+                    return false;
+            }
+            routine = "__rvv_redsum";
+            args = {elem->ops[0]};
+            return true;
+        }
+        return false;
+    }
+};
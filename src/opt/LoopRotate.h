@@ -0,0 +1,101 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+
+using namespace std;
+
+// Loop rotation.
+// A while loop is lowered with the test in the header and a jump back to it
+// from the end of the body, so each iteration takes a jump and a branch.
+// Rotation copies the header into the preheader, as the guard of the first
+// iteration, and into every latch, where the test decides whether to go
+// around again: `if (c) do { body } while (c);`. The old header becomes
+// unreachable and the body is the new header, entered by a single
+// conditional backward branch.
+
+class LoopRotate {
+public:
+    LoopRotate(IRFunction *_func) : func(_func) {
+    }
+
+    // returns true if some loops were rotated
+    bool Run() {
+        bool changed = false, rotated = true;
+        // the copies change the loops, so start over after each one
+        while (rotated) {
+            rotated = false;
+            LoopInfo li(func);
+            auto users = func->ComputeUsers();
+            for (auto loop : li.InnerToOuter()) {
+                if (RunOnLoop(loop, li.dom, users)) {
+                    rotated = changed = true;
+                    break;
+                }
+            }
+        }
+        if (changed)
+            func->RemoveUnreachable();
+        return changed;
+    }
+
+private:
+    IRFunction *func;
+    set<IRBasicBlock*> done; // headers of rotated loops, left as they are
+
+    static const int headerBudget = 16; // instructions copied into each latch
+
+    bool RunOnLoop(Loop *loop, DomTree &dom, map<IRValue*, vector<IRValue*>> &users) {
+        IRBasicBlock *header = loop->header;
+        if (done.count(header))
+            return false;
+        IRBasicBlock *preheader = loop->Preheader(dom);
+        if (preheader == nullptr || preheader->Terminator()->tag != KOOPA_RVT_JUMP)
+            return false;
+        IRValue *br = header->Terminator();
+        if (br == nullptr || br->tag != KOOPA_RVT_BRANCH)
+            return false;
+        // the header tests whether to leave the loop or to run the body
+        bool inLoop[2] = {loop->Contains(br->targets[0]), loop->Contains(br->targets[1])};
+        if (inLoop[0] == inLoop[1])
+            return false;
+        IRBasicBlock *body = inLoop[0] ? br->targets[0] : br->targets[1];
+        if (body == header || (int)header->insts.size() > headerBudget)
+            return false;
+        for (auto latch : loop->latches) {
+            if (latch->Terminator()->tag != KOOPA_RVT_JUMP)
+                return false;
+        }
+        // the header values get one definition per copy, so only the header may use them
+        for (auto inst : header->insts) {
+            for (auto user : users[inst]) {
+                if (user->bb != header)
+                    return false;
+            }
+        }
+
+        CopyHeader(header, preheader);
+        for (auto latch : loop->latches)
+            CopyHeader(header, latch);
+        done.insert(body);
+        return true;
+    }
+
+    // replace the jump to the header at the end of bb by the header itself
+    void CopyHeader(IRBasicBlock *header, IRBasicBlock *bb) {
+        IRValue *jump = bb->Terminator();
+        assert(jump->tag == KOOPA_RVT_JUMP && jump->targets[0] == header);
+        bb->Remove(jump);
+        map<IRValue*, IRValue*> vmap;
+        map<IRBasicBlock*, IRBasicBlock*> bmap;
+        for (auto inst : header->insts) {
+            IRValue *v = func->Clone(inst, vmap, bmap);
+            v->bb = bb;
+            bb->insts.push_back(v);
+        }
+    }
+};
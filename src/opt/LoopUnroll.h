@@ -0,0 +1,347 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+#include "opt/Simplify.h"
+
+using namespace std;
+
+// A counted loop, as lowered from `while (i < n) { ...; i = i + c; }`:
+// the header only loads and compares, the single latch adds a constant to
+// a local variable, and the bound is invariant in the loop.
+struct CountedLoop {
+    Loop *loop;
+    IRBasicBlock *preheader;
+    IRBasicBlock *body;  // first block of the body
+    IRBasicBlock *exit;
+    IRBasicBlock *latch;
+    IRValue *var;        // alloc of the induction variable
+    IRValue *cond;       // compare in the header
+    int varSide;         // operand index of the induction variable in cond
+    IRValue *bound;
+    int step;
+    vector<IRBasicBlock*> region; // loop blocks except the header
+};
+
+class LoopUnroll {
+public:
+    LoopUnroll(IRFunction *_func, int _factor) {
+        func = _func;
+        factor = _factor;
+    }
+
+    void Run() {
+        while (RunOnce())
+            ;
+        SimplifyFunction(func);
+    }
+
+private:
+    IRFunction *func;
+    int factor;
+    set<IRBasicBlock*> done; // headers that have been unrolled or rejected
+
+    static const int maxFullUnrollTrip = 16;
+    static const int fullUnrollBudget = 256; // instructions after full unrolling
+    static const int unrollBudget = 256;     // instructions in the unrolled body
+
+    bool RunOnce() {
+        LoopInfo li(func);
+        auto users = func->ComputeUsers();
+        for (auto loop : li.InnerToOuter()) {
+            if (!loop->children.empty() || done.count(loop->header))
+                continue;
+            CountedLoop cl;
+            if (!Analyze(loop, li.dom, users, cl)) {
+                done.insert(loop->header);
+                continue;
+            }
+            if (FullUnroll(cl))
+                return true;
+            if (PartialUnroll(cl))
+                return true;
+            done.insert(loop->header);
+        }
+        return false;
+    }
+
+    static int SwapCompare(int op) {
+        switch (op) {
+        case KOOPA_RBO_LT:
+            return KOOPA_RBO_GT;
+        case KOOPA_RBO_GT:
+            return KOOPA_RBO_LT;
+        case KOOPA_RBO_LE:
+            return KOOPA_RBO_GE;
+        case KOOPA_RBO_GE:
+            return KOOPA_RBO_LE;
+        }
+        return op;
+    }
+
+    bool Analyze(Loop *loop, DomTree &dom, map<IRValue*, vector<IRValue*>> &users, CountedLoop &cl) {
+        cl.loop = loop;
+        IRBasicBlock *header = loop->header;
+        if (loop->latches.size() != 1 || !loop->IsClosed(users))
+            return false;
+        cl.latch = loop->latches[0];
+        cl.preheader = loop->Preheader(dom);
+        if (cl.preheader == nullptr || cl.latch->Terminator()->tag != KOOPA_RVT_JUMP)
+            return false;
+        IRValue *br = header->Terminator();
+        if (br->tag != KOOPA_RVT_BRANCH || !loop->Contains(br->targets[0]) || loop->Contains(br->targets[1]))
+            return false;
+        cl.body = br->targets[0];
+        cl.exit = br->targets[1];
+        if (cl.body == header)
+            return false;
+        for (auto inst : header->insts) {
+            if (inst != br && inst->HasSideEffect())
+                return false;
+        }
+
+        // compare of the induction variable against the bound
+        cl.cond = br->ops[0];
+        if (cl.cond->tag != KOOPA_RVT_BINARY || cl.cond->bb != header)
+            return false;
+        int op = cl.cond->imm;
+        if (op != KOOPA_RBO_LT && op != KOOPA_RBO_LE && op != KOOPA_RBO_GT && op != KOOPA_RBO_GE)
+            return false;
+        cl.var = nullptr;
+        for (int side = 0; side < 2; side++) {
+            IRValue *v = cl.cond->ops[side];
+            if (v->tag == KOOPA_RVT_LOAD && v->bb == header && func->IsPromotable(v->ops[0], users)) {
+                cl.var = v->ops[0];
+                cl.varSide = side;
+                break;
+            }
+        }
+        if (cl.var == nullptr)
+            return false;
+        cl.bound = cl.cond->ops[1 - cl.varSide];
+
+        // the only store to the variable is `i = i + c` in the latch
+        IRValue *update = nullptr;
+        set<IRValue*> stored;
+        bool hasCall = false;
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_CALL)
+                    hasCall = true;
+                if (inst->tag != KOOPA_RVT_STORE)
+                    continue;
+                stored.insert(inst->ops[1]);
+                if (inst->ops[1] == cl.var) {
+                    if (update != nullptr || bb != cl.latch)
+                        return false;
+                    update = inst;
+                }
+            }
+        }
+        if (update == nullptr)
+            return false;
+        IRValue *next = update->ops[0];
+        if (next->tag != KOOPA_RVT_BINARY || next->bb != cl.latch)
+            return false;
+        IRValue *lhs = next->ops[0], *rhs = next->ops[1];
+        auto isVarLoad = [&](IRValue *v) {
+            return v->tag == KOOPA_RVT_LOAD && v->ops[0] == cl.var && v->bb == cl.latch;
+        };
+        if (next->imm == KOOPA_RBO_ADD && isVarLoad(lhs) && rhs->IsConst())
+            cl.step = rhs->imm;
+        else if (next->imm == KOOPA_RBO_ADD && isVarLoad(rhs) && lhs->IsConst())
+            cl.step = lhs->imm;
+        else if (next->imm == KOOPA_RBO_SUB && isVarLoad(lhs) && rhs->IsConst() && rhs->imm != INT32_MIN)
+            cl.step = -rhs->imm;
+        else
+            return false;
+
+        // the variable has to move towards the bound
+        int dir = (cl.varSide == 0) ? op : SwapCompare(op);
+        if (cl.step == 0)
+            return false;
+        if ((dir == KOOPA_RBO_LT || dir == KOOPA_RBO_LE) && cl.step < 0)
+            return false;
+        if ((dir == KOOPA_RBO_GT || dir == KOOPA_RBO_GE) && cl.step > 0)
+            return false;
+        if (!loop->IsInvariant(cl.bound, stored, hasCall))
+            return false;
+
+        // the header is dropped from the unrolled copies, so nothing may depend on it
+        cl.region.clear();
+        for (auto bb : loop->OrderedBlocks(func)) {
+            if (bb == header)
+                continue;
+            cl.region.push_back(bb);
+            for (auto inst : bb->insts) {
+                for (auto operand : inst->ops) {
+                    if (operand->bb == header)
+                        return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    int RegionSize(CountedLoop &cl) {
+        int size = 0;
+        for (auto bb : cl.region)
+            size += bb->insts.size();
+        return size;
+    }
+
+    // clone the body n times; copy j falls through to copy j + 1, the last one goes to last
+    vector<IRBasicBlock*> CloneBody(CountedLoop &cl, int n, IRBasicBlock *last, IRBasicBlock *&first) {
+        vector<vector<IRBasicBlock*>> copies(n);
+        vector<IRBasicBlock*> entries(n);
+        for (int j = 0; j < n; j++) {
+            map<IRValue*, IRValue*> vmap;
+            map<IRBasicBlock*, IRBasicBlock*> bmap;
+            copies[j] = CloneRegion(func, cl.region, vmap, bmap, "unroll");
+            entries[j] = bmap[cl.body];
+        }
+        first = (n > 0) ? entries[0] : last;
+        vector<IRBasicBlock*> res;
+        for (int j = 0; j < n; j++) {
+            IRBasicBlock *next = (j + 1 < n) ? entries[j + 1] : last;
+            for (auto bb : copies[j]) {
+                bb->RedirectSucc(cl.loop->header, next);
+                res.push_back(bb);
+            }
+        }
+        return res;
+    }
+
+    // loops with a small constant trip count lose their compare and back edge
+    bool FullUnroll(CountedLoop &cl) {
+        if (!cl.bound->IsConst())
+            return false;
+        IRValue *init = nullptr;
+        auto &insts = cl.preheader->insts;
+        for (auto it = insts.rbegin(); it != insts.rend(); it++) {
+            if ((*it)->tag == KOOPA_RVT_STORE && (*it)->ops[1] == cl.var) {
+                init = (*it)->ops[0];
+                break;
+            }
+        }
+        if (init == nullptr || !init->IsConst())
+            return false;
+
+        int trip = 0;
+        long long i = init->imm;
+        while (true) {
+            int taken;
+            FoldBinary(cl.cond->imm, cl.varSide == 0 ? i : cl.bound->imm, cl.varSide == 0 ? cl.bound->imm : i, taken);
+            if (!taken)
+                break;
+            trip++;
+            i += cl.step;
+            if (trip > maxFullUnrollTrip || i < INT32_MIN || i > INT32_MAX)
+                return false;
+        }
+        if (trip * RegionSize(cl) > fullUnrollBudget)
+            return false;
+
+        IRBasicBlock *first;
+        vector<IRBasicBlock*> copies = CloneBody(cl, trip, cl.exit, first);
+        for (auto bb : copies)
+            func->InsertBlockBefore(cl.loop->header, bb);
+        cl.preheader->RedirectSucc(cl.loop->header, first);
+        func->RemoveUnreachable();
+        return true;
+    }
+
+    // unroll by factor, with the original loop left as the remainder loop:
+    //   while (i < n - (k-1)*c) { body; body; ... }  while (i < n) { body; }
+    // a runtime n this close to the end of the int range would make
+    // n - (k-1)*c wrap, so a guard in front sends it to the remainder loop
+    bool PartialUnroll(CountedLoop &cl) {
+        int k = factor;
+        int size = RegionSize(cl);
+        while (k > 1 && size * k > unrollBudget)
+            k--;
+        if (k < 2)
+            return false;
+        long long adjust = (long long)(k - 1) * cl.step;
+        if (cl.bound->IsConst()) {
+            long long b = (long long)cl.bound->imm - adjust;
+            if (b < INT32_MIN || b > INT32_MAX)
+                return false;
+        }
+        if (adjust < INT32_MIN || adjust > INT32_MAX)
+            return false;
+
+        IRBasicBlock *header = cl.loop->header;
+        IRBasicBlock *newHeader = func->NewBlock("unroll");
+        map<IRValue*, IRValue*> vmap;
+        map<IRBasicBlock*, IRBasicBlock*> bmap;
+        for (auto inst : header->insts) {
+            IRValue *v = func->Clone(inst, vmap, bmap);
+            v->bb = newHeader;
+            newHeader->insts.push_back(v);
+        }
+        IRValue *newCond = vmap[cl.cond];
+        IRValue *newBound;
+        if (cl.bound->IsConst()) {
+            newBound = IRConst(cl.bound->imm - (int)adjust);
+        }
+        else {
+            newBound = func->NewBinary(KOOPA_RBO_SUB, newCond->ops[1 - cl.varSide], IRConst((int)adjust));
+            newHeader->InsertBefore(newCond, newBound);
+        }
+        newCond->ops[1 - cl.varSide] = newBound;
+
+        IRBasicBlock *first;
+        vector<IRBasicBlock*> copies = CloneBody(cl, k, newHeader, first);
+        IRValue *br = newHeader->Terminator();
+        br->targets = {first, header};
+
+        IRBasicBlock *entry = newHeader;
+        if (!cl.bound->IsConst()) {
+            // the unrolled loop keeps a preheader of its own, LoopRotate needs one
+            IRBasicBlock *enter = func->NewBlock("unroll");
+            enter->Append(func->NewJump(newHeader));
+            entry = NewGuard(cl, adjust, enter);
+            func->InsertBlockBefore(header, entry);
+            func->InsertBlockBefore(header, enter);
+        }
+        func->InsertBlockBefore(header, newHeader);
+        for (auto bb : copies)
+            func->InsertBlockBefore(header, bb);
+        cl.preheader->RedirectSucc(header, entry);
+        done.insert(header);
+        done.insert(newHeader);
+        return true;
+    }
+
+    // evaluates the bound once more, as the header does, and goes to the
+    // unrolled loop only if n - adjust stays in range
+    IRBasicBlock *NewGuard(CountedLoop &cl, long long adjust, IRBasicBlock *unrolled) {
+        IRBasicBlock *header = cl.loop->header;
+        IRBasicBlock *guard = func->NewBlock("unroll_guard");
+        map<IRValue*, IRValue*> vmap;
+        map<IRBasicBlock*, IRBasicBlock*> bmap;
+        for (auto inst : header->insts) {
+            IRValue *v = func->Clone(inst, vmap, bmap);
+            v->bb = guard;
+            guard->insts.push_back(v);
+        }
+        IRValue *bound = vmap.count(cl.bound) ? vmap[cl.bound] : cl.bound;
+        IRValue *inRange;
+        if (adjust > 0)
+            inRange = func->NewBinary(KOOPA_RBO_GE, bound, IRConst((int)(INT32_MIN + adjust)));
+        else
+            inRange = func->NewBinary(KOOPA_RBO_LE, bound, IRConst((int)(INT32_MAX + adjust)));
+        IRValue *br = guard->Terminator();
+        guard->InsertBefore(br, inRange);
+        br->ops[0] = inRange;
+        br->targets = {unrolled, header};
+        return guard;
+    }
+};
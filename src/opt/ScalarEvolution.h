@@ -0,0 +1,381 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+#include "opt/Simplify.h"
+
+using namespace std;
+
+// Scalar evolution.
+// A variable whose only store in a loop is `s = s + d` once per iteration,
+// with d an invariant or another such variable, has a closed form in the
+// iteration number m:
+//   s(m) = s0 + a * m + b * m(m-1)/2
+// `i = i + 1` has a = 1, b = 0, and `s = s + i` then has a = i0, b = 1.
+// With the trip count k of the exit test `i < n`, the value after the loop
+// is s(k). A variable only read by its own update is stored with that value
+// before the loop and no longer updated in it; a loop left with nothing but
+// such updates is deleted, turning O(n) loops into O(1) code.
+
+struct AddRec {
+    IRValue *coef[3]; // s0, a, b of the closed form, defined in the preheader
+
+    int Degree() const {
+        if (coef[2] != IRConst(0))
+            return 2;
+        return (coef[1] != IRConst(0)) ? 1 : 0;
+    }
+};
+
+class ScalarEvolution {
+public:
+    ScalarEvolution(IRFunction *_func) : func(_func) {
+    }
+
+    // returns true if some loops were rewritten
+    bool Run() {
+        bool changed = false, rewritten = true;
+        // a deleted inner loop can make the outer one a candidate
+        while (rewritten) {
+            rewritten = false;
+            LoopInfo li(func);
+            auto users = func->ComputeUsers();
+            for (auto loop : li.InnerToOuter()) {
+                if (RunOnLoop(loop, li.dom, users)) {
+                    rewritten = changed = true;
+                    break;
+                }
+            }
+            RemoveDeadCode(func);
+        }
+        if (changed)
+            func->RemoveUnreachable();
+        return changed;
+    }
+
+private:
+    IRFunction *func;
+    Loop *loop;
+    IRBasicBlock *preheader;
+    IRBasicBlock *latch;
+    map<IRValue*, IRValue*> updates; // variable -> `store s + d, s` in the latch
+    set<IRValue*> stored;
+    bool hasCall;
+    map<IRValue*, IRValue*> hoisted;
+    map<IRValue*, AddRec> recs;
+    set<IRValue*> failed, visiting;
+
+    bool RunOnLoop(Loop *_loop, DomTree &dom, map<IRValue*, vector<IRValue*>> &users) {
+        loop = _loop;
+        preheader = loop->Preheader(dom);
+        if (preheader == nullptr || loop->latches.size() != 1 || !loop->IsClosed(users))
+            return false;
+        latch = loop->latches[0];
+        if (latch->Terminator()->tag != KOOPA_RVT_JUMP)
+            return false;
+        // the header test is the only way out
+        IRBasicBlock *header = loop->header;
+        IRValue *br = header->Terminator();
+        if (br == nullptr || br->tag != KOOPA_RVT_BRANCH || loop->ExitBlocks().size() != 1)
+            return false;
+        bool inLoop[2] = {loop->Contains(br->targets[0]), loop->Contains(br->targets[1])};
+        if (inLoop[0] == inLoop[1])
+            return false;
+        for (auto bb : loop->blocks) {
+            if (bb == header)
+                continue;
+            for (auto succ : bb->Succs()) {
+                if (!loop->Contains(succ))
+                    return false;
+            }
+        }
+        IRBasicBlock *exit = inLoop[0] ? br->targets[1] : br->targets[0];
+
+        updates.clear();
+        stored.clear();
+        hoisted.clear();
+        recs.clear();
+        failed.clear();
+        visiting.clear();
+        FindUpdates(users);
+        if (updates.empty())
+            return false;
+
+        IRValue *trip = TripCount(br->ops[0], inLoop[0]);
+        if (trip == nullptr)
+            return false;
+
+        // everything the loop does is updating variables with a closed form
+        bool deletable = !hasCall;
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_STORE && !(updates.count(inst->ops[1]) && updates[inst->ops[1]] == inst))
+                    deletable = false;
+            }
+        }
+        vector<IRValue*> vars;
+        for (auto &kv : updates) {
+            if (deletable && !VarRecurrence(kv.first))
+                deletable = false;
+        }
+        for (auto &kv : updates) {
+            if (deletable || (IsAccumulator(kv.first, users) && VarRecurrence(kv.first)))
+                vars.push_back(kv.first);
+        }
+        if (vars.empty())
+            return false;
+
+        // the exit values are computed from the values on entry, then stored
+        vector<IRValue*> values;
+        for (auto var : vars)
+            values.push_back(Evaluate(recs[var], trip));
+        for (size_t k = 0; k < vars.size(); k++)
+            preheader->Append(func->NewStore(values[k], vars[k]));
+        if (deletable) {
+            preheader->RedirectSucc(header, exit);
+        }
+        else {
+            for (auto var : vars)
+                latch->Remove(updates[var]);
+        }
+        return true;
+    }
+
+    // variables whose only store in the loop is `s = s + d` or `s = s - d` in the latch
+    void FindUpdates(map<IRValue*, vector<IRValue*>> &users) {
+        map<IRValue*, int> storeCount;
+        hasCall = false;
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_CALL)
+                    hasCall = true;
+                if (inst->tag == KOOPA_RVT_STORE) {
+                    stored.insert(inst->ops[1]);
+                    storeCount[inst->ops[1]]++;
+                }
+            }
+        }
+        auto &insts = latch->insts;
+        for (auto inst : insts) {
+            if (inst->tag != KOOPA_RVT_STORE)
+                continue;
+            IRValue *var = inst->ops[1], *next = inst->ops[0];
+            if (storeCount[var] != 1 || !func->IsPromotable(var, users))
+                continue;
+            if (next->tag != KOOPA_RVT_BINARY || (next->imm != KOOPA_RBO_ADD && next->imm != KOOPA_RBO_SUB))
+                continue;
+            IRValue *lhs = next->ops[0], *rhs = next->ops[1];
+            bool fromLhs = lhs->tag == KOOPA_RVT_LOAD && lhs->ops[0] == var;
+            bool fromRhs = next->imm == KOOPA_RBO_ADD && rhs->tag == KOOPA_RVT_LOAD && rhs->ops[0] == var;
+            if (!fromLhs && !fromRhs)
+                continue;
+            // a load after the update sees the value of the next iteration
+            bool later = false;
+            for (auto it = find(insts.begin(), insts.end(), inst); it != insts.end(); it++) {
+                if ((*it)->tag == KOOPA_RVT_LOAD && (*it)->ops[0] == var)
+                    later = true;
+            }
+            if (!later)
+                updates[var] = inst;
+        }
+    }
+
+    bool IsInvariant(IRValue *v) {
+        return loop->IsInvariant(v, stored, hasCall);
+    }
+
+    IRValue *Hoist(IRValue *v) {
+        return HoistInvariant(func, loop, preheader, v, hoisted);
+    }
+
+    // binary in the preheader, folded where possible
+    IRValue *Emit(int op, IRValue *lhs, IRValue *rhs) {
+        return EmitBinary(func, preheader, op, lhs, rhs);
+    }
+
+    // s(m) = s0 + d(0) + ... + d(m - 1), which needs d of degree 1 at most
+    bool VarRecurrence(IRValue *var) {
+        if (recs.count(var))
+            return true;
+        if (failed.count(var) || visiting.count(var))
+            return false;
+        visiting.insert(var);
+        IRValue *next = updates[var]->ops[0];
+        IRValue *lhs = next->ops[0], *rhs = next->ops[1];
+        IRValue *delta = (lhs->tag == KOOPA_RVT_LOAD && lhs->ops[0] == var) ? rhs : lhs;
+        bool ok = GetRecurrence(delta) && recs[delta].Degree() <= 1;
+        visiting.erase(var);
+        if (!ok) {
+            failed.insert(var);
+            return false;
+        }
+        AddRec &d = recs[delta];
+        AddRec rec;
+        rec.coef[0] = InitialValue(var);
+        rec.coef[1] = Emit(next->imm, IRConst(0), d.coef[0]);
+        rec.coef[2] = Emit(next->imm, IRConst(0), d.coef[1]);
+        recs[var] = rec;
+        return true;
+    }
+
+    // the value on entry, taken from the last store in the preheader so that constants fold
+    IRValue *InitialValue(IRValue *var) {
+        auto it = hoisted.find(var);
+        if (it != hoisted.end())
+            return it->second;
+        IRValue *init = nullptr;
+        for (auto inst = preheader->insts.rbegin(); inst != preheader->insts.rend(); inst++) {
+            if ((*inst)->tag == KOOPA_RVT_STORE && (*inst)->ops[1] == var) {
+                init = (*inst)->ops[0];
+                break;
+            }
+        }
+        if (init == nullptr) {
+            init = func->NewLoad(var);
+            preheader->Append(init);
+        }
+        hoisted[var] = init;
+        return init;
+    }
+
+    bool GetRecurrence(IRValue *v) {
+        if (recs.count(v))
+            return true;
+        if (failed.count(v))
+            return false;
+        AddRec rec;
+        if (IsInvariant(v)) {
+            rec.coef[0] = Hoist(v);
+            rec.coef[1] = rec.coef[2] = IRConst(0);
+        }
+        else if (v->tag == KOOPA_RVT_LOAD && updates.count(v->ops[0])) {
+            if (!VarRecurrence(v->ops[0])) {
+                failed.insert(v);
+                return false;
+            }
+            rec = recs[v->ops[0]];
+        }
+        else if (v->tag == KOOPA_RVT_BINARY && (v->imm == KOOPA_RBO_ADD || v->imm == KOOPA_RBO_SUB || v->imm == KOOPA_RBO_MUL)) {
+            if (!GetRecurrence(v->ops[0]) || !GetRecurrence(v->ops[1])) {
+                failed.insert(v);
+                return false;
+            }
+            AddRec &a = recs[v->ops[0]], &b = recs[v->ops[1]];
+            if (v->imm != KOOPA_RBO_MUL) {
+                for (int k = 0; k < 3; k++)
+                    rec.coef[k] = Emit(v->imm, a.coef[k], b.coef[k]);
+            }
+            else if (a.Degree() == 0 || b.Degree() == 0) {
+                AddRec &poly = (a.Degree() == 0) ? b : a;
+                IRValue *scale = (a.Degree() == 0) ? a.coef[0] : b.coef[0];
+                for (int k = 0; k < 3; k++)
+                    rec.coef[k] = Emit(KOOPA_RBO_MUL, poly.coef[k], scale);
+            }
+            else {
+                failed.insert(v);
+                return false;
+            }
+        }
+        else {
+            failed.insert(v);
+            return false;
+        }
+        recs[v] = rec;
+        return true;
+    }
+
+    // read only by its own update, so its value only matters after the loop
+    bool IsAccumulator(IRValue *var, map<IRValue*, vector<IRValue*>> &users) {
+        IRValue *next = updates[var]->ops[0];
+        for (auto user : users[var]) {
+            if (user->tag != KOOPA_RVT_LOAD || !loop->Contains(user->bb))
+                continue;
+            if (users[user].size() != 1 || users[user][0] != next)
+                return false;
+        }
+        return users[next].size() == 1;
+    }
+
+    static int Negate(int op) {
+        switch (op) {
+        case KOOPA_RBO_LT: return KOOPA_RBO_GE;
+        case KOOPA_RBO_GE: return KOOPA_RBO_LT;
+        case KOOPA_RBO_GT: return KOOPA_RBO_LE;
+        case KOOPA_RBO_LE: return KOOPA_RBO_GT;
+        case KOOPA_RBO_EQ: return KOOPA_RBO_NOT_EQ;
+        case KOOPA_RBO_NOT_EQ: return KOOPA_RBO_EQ;
+        default: return -1;
+        }
+    }
+
+    static int Mirror(int op) {
+        switch (op) {
+        case KOOPA_RBO_LT: return KOOPA_RBO_GT;
+        case KOOPA_RBO_GT: return KOOPA_RBO_LT;
+        case KOOPA_RBO_LE: return KOOPA_RBO_GE;
+        case KOOPA_RBO_GE: return KOOPA_RBO_LE;
+        default: return op;
+        }
+    }
+
+    // Iterations of the loop, from a test `x op n` that stays in it, with
+    // x(m) = x0 + m or x0 - m. The difference of the two ends counts the
+    // iterations exactly as an unsigned number, even when it does not fit in
+    // an int.
+    IRValue *TripCount(IRValue *cond, bool stayIfTrue) {
+        if (cond->tag != KOOPA_RVT_BINARY || cond->bb != loop->header)
+            return nullptr;
+        int op = stayIfTrue ? cond->imm : Negate(cond->imm);
+        if (Negate(op) < 0)
+            return nullptr;
+        if (!GetRecurrence(cond->ops[0]) || !GetRecurrence(cond->ops[1]))
+            return nullptr;
+        AddRec *x = &recs[cond->ops[0]], *n = &recs[cond->ops[1]];
+        if (x->Degree() == 0) {
+            swap(x, n);
+            op = Mirror(op);
+        }
+        if (x->Degree() != 1 || n->Degree() != 0)
+            return nullptr;
+        IRValue *x0 = x->coef[0], *bound = n->coef[0];
+        if (x->coef[1] == IRConst(1)) {
+            if (op == KOOPA_RBO_NOT_EQ)
+                return Emit(KOOPA_RBO_SUB, bound, x0);
+            if (op == KOOPA_RBO_LT)
+                return Emit(KOOPA_RBO_MUL, Emit(KOOPA_RBO_GT, bound, x0), Emit(KOOPA_RBO_SUB, bound, x0));
+            if (op == KOOPA_RBO_LE) {
+                IRValue *span = Emit(KOOPA_RBO_ADD, Emit(KOOPA_RBO_SUB, bound, x0), IRConst(1));
+                return Emit(KOOPA_RBO_MUL, Emit(KOOPA_RBO_GE, bound, x0), span);
+            }
+        }
+        else if (x->coef[1] == IRConst(-1)) {
+            if (op == KOOPA_RBO_NOT_EQ)
+                return Emit(KOOPA_RBO_SUB, x0, bound);
+            if (op == KOOPA_RBO_GT)
+                return Emit(KOOPA_RBO_MUL, Emit(KOOPA_RBO_GT, x0, bound), Emit(KOOPA_RBO_SUB, x0, bound));
+            if (op == KOOPA_RBO_GE) {
+                IRValue *span = Emit(KOOPA_RBO_ADD, Emit(KOOPA_RBO_SUB, x0, bound), IRConst(1));
+                return Emit(KOOPA_RBO_MUL, Emit(KOOPA_RBO_GE, x0, bound), span);
+            }
+        }
+        return nullptr;
+    }
+
+    // s0 + a * k + b * k(k-1)/2, where k(k-1)/2 = (k >> 1) * (k - 1 + (k & 1))
+    // halves the even factor first, so nothing is lost when the product wraps
+    IRValue *Evaluate(AddRec &rec, IRValue *k) {
+        IRValue *res = Emit(KOOPA_RBO_ADD, rec.coef[0], Emit(KOOPA_RBO_MUL, rec.coef[1], k));
+        if (rec.coef[2] == IRConst(0))
+            return res;
+        IRValue *half = Emit(KOOPA_RBO_SHR, k, IRConst(1));
+        IRValue *odd = Emit(KOOPA_RBO_AND, k, IRConst(1));
+        IRValue *other = Emit(KOOPA_RBO_ADD, Emit(KOOPA_RBO_SUB, k, IRConst(1)), odd);
+        IRValue *pairs = Emit(KOOPA_RBO_MUL, half, other);
+        return Emit(KOOPA_RBO_ADD, res, Emit(KOOPA_RBO_MUL, rec.coef[2], pairs));
+    }
+};
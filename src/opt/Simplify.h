@@ -0,0 +1,208 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "opt/IR.h"
+
+using namespace std;
+
+// Cleanups run before and after the other passes:
+// allocs are hoisted to the entry block, constants are folded,
+// branches on constants become jumps, dead code is removed
+// and straight-line chains of blocks are merged.
+
+// returns false for division by zero
+static bool FoldBinary(int op, int lhs, int rhs, int &result) {
+    // wrap around like the target does
+    unsigned int l = lhs, r = rhs;
+    switch (op) {
+    case KOOPA_RBO_NOT_EQ:
+        result = (lhs != rhs);
+        break;
+    case KOOPA_RBO_EQ:
+        result = (lhs == rhs);
+        break;
+    case KOOPA_RBO_GT:
+        result = (lhs > rhs);
+        break;
+    case KOOPA_RBO_LT:
+        result = (lhs < rhs);
+        break;
+    case KOOPA_RBO_GE:
+        result = (lhs >= rhs);
+        break;
+    case KOOPA_RBO_LE:
+        result = (lhs <= rhs);
+        break;
+    case KOOPA_RBO_ADD:
+        result = (int)(l + r);
+        break;
+    case KOOPA_RBO_SUB:
+        result = (int)(l - r);
+        break;
+    case KOOPA_RBO_MUL:
+        result = (int)(l * r);
+        break;
+    case KOOPA_RBO_DIV:
+        if (rhs == 0 || (lhs == INT32_MIN && rhs == -1))
+            return false;
+        result = lhs / rhs;
+        break;
+    case KOOPA_RBO_MOD:
+        if (rhs == 0 || (lhs == INT32_MIN && rhs == -1))
+            return false;
+        result = lhs % rhs;
+        break;
+    case KOOPA_RBO_AND:
+        result = lhs & rhs;
+        break;
+    case KOOPA_RBO_OR:
+        result = lhs | rhs;
+        break;
+    case KOOPA_RBO_XOR:
+        result = lhs ^ rhs;
+        break;
+    case KOOPA_RBO_SHL:
+        result = (int)(l << (r & 31));
+        break;
+    case KOOPA_RBO_SHR:
+        result = (int)(l >> (r & 31));
+        break;
+    case KOOPA_RBO_SAR:
+        result = lhs >> (rhs & 31);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static void HoistAllocs(IRFunction *func) {
+    IRBasicBlock *entry = func->bbs[0];
+    vector<IRValue*> allocs;
+    for (auto bb : func->bbs) {
+        for (auto inst : bb->insts) {
+            if (inst->tag == KOOPA_RVT_ALLOC)
+                allocs.push_back(inst);
+        }
+        bb->insts.erase(remove_if(bb->insts.begin(), bb->insts.end(), [](IRValue *inst) {
+            return inst->tag == KOOPA_RVT_ALLOC;
+        }), bb->insts.end());
+    }
+    for (auto alloc : allocs)
+        alloc->bb = entry;
+    entry->insts.insert(entry->insts.begin(), allocs.begin(), allocs.end());
+}
+
+static bool FoldConstants(IRFunction *func) {
+    bool changed = false;
+    map<IRValue*, IRValue*> folded;
+    for (auto bb : func->bbs) {
+        for (auto inst : bb->insts) {
+            for (auto &op : inst->ops) {
+                auto it = folded.find(op);
+                if (it != folded.end())
+                    op = it->second;
+            }
+            if (inst->tag == KOOPA_RVT_BINARY) {
+                IRValue *lhs = inst->ops[0], *rhs = inst->ops[1];
+                int result;
+                if (lhs->IsConst() && rhs->IsConst() && FoldBinary(inst->imm, lhs->imm, rhs->imm, result))
+                    folded[inst] = IRConst(result);
+            }
+            else if (inst->tag == KOOPA_RVT_BRANCH) {
+                IRValue *cond = inst->ops[0];
+                if (cond->IsConst() || inst->targets[0] == inst->targets[1]) {
+                    IRBasicBlock *target = (!cond->IsConst() || cond->imm != 0) ? inst->targets[0] : inst->targets[1];
+                    inst->tag = KOOPA_RVT_JUMP;
+                    inst->ops.clear();
+                    inst->targets = {target};
+                    changed = true;
+                }
+            }
+        }
+    }
+    if (!folded.empty()) {
+        // uses that appear before their definitions
+        for (auto bb : func->bbs) {
+            for (auto inst : bb->insts) {
+                for (auto &op : inst->ops) {
+                    auto it = folded.find(op);
+                    if (it != folded.end())
+                        op = it->second;
+                }
+            }
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+static bool RemoveDeadCode(IRFunction *func) {
+    bool changed = false;
+    bool removed = true;
+    while (removed) {
+        removed = false;
+        auto users = func->ComputeUsers();
+        for (auto bb : func->bbs) {
+            size_t oldSize = bb->insts.size();
+            bb->insts.erase(remove_if(bb->insts.begin(), bb->insts.end(), [&](IRValue *inst) {
+                return !inst->HasSideEffect() && users[inst].empty();
+            }), bb->insts.end());
+            if (bb->insts.size() != oldSize)
+                removed = true;
+        }
+        changed |= removed;
+    }
+    return changed;
+}
+
+// a block reached only by a jump from its predecessor is appended to it
+static bool MergeBlocks(IRFunction *func) {
+    bool changed = false;
+    auto preds = func->ComputePreds();
+    for (size_t i = 0; i < func->bbs.size(); i++) {
+        IRBasicBlock *bb = func->bbs[i];
+        while (true) {
+            IRValue *term = bb->Terminator();
+            if (term == nullptr || term->tag != KOOPA_RVT_JUMP)
+                break;
+            IRBasicBlock *succ = term->targets[0];
+            if (succ == bb || succ == func->bbs[0] || preds[succ].size() != 1)
+                break;
+            bb->insts.pop_back();
+            for (auto inst : succ->insts) {
+                inst->bb = bb;
+                bb->insts.push_back(inst);
+            }
+            for (auto next : succ->Succs()) {
+                for (auto &pred : preds[next]) {
+                    if (pred == succ)
+                        pred = bb;
+                }
+            }
+            succ->insts.clear();
+            func->bbs.erase(find(func->bbs.begin(), func->bbs.end(), succ));
+            i = find(func->bbs.begin(), func->bbs.end(), bb) - func->bbs.begin();
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void SimplifyFunction(IRFunction *func) {
+    if (func->IsDecl())
+        return;
+    HoistAllocs(func);
+    bool changed = true;
+    while (changed) {
+        changed = FoldConstants(func);
+        changed |= func->RemoveUnreachable();
+        changed |= RemoveDeadCode(func);
+        changed |= MergeBlocks(func);
+    }
+}
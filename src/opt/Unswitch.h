@@ -0,0 +1,121 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "opt/IR.h"
+#include "opt/Loop.h"
+#include "opt/Simplify.h"
+
+using namespace std;
+
+// Loop unswitching.
+// A branch in a loop body on a condition that does not change in the loop,
+// such as a flag or a parameter, is taken the same way on every iteration.
+// The loop is duplicated: the original keeps only the true side of the
+// branch, the copy only the false side, and the preheader evaluates the
+// condition once to choose between them.
+
+class LoopUnswitch {
+public:
+    LoopUnswitch(IRFunction *_func) : func(_func) {
+    }
+
+    void Run() {
+        int growth = 0;
+        while (RunOnce(growth))
+            ;
+        SimplifyFunction(func);
+    }
+
+private:
+    IRFunction *func;
+    Loop *loop;
+    set<IRValue*> stored;
+    bool hasCall;
+
+    static const int loopBudget = 128;   // instructions in a loop that is duplicated
+    static const int growthBudget = 512; // instructions added to the function
+
+    bool RunOnce(int &growth) {
+        LoopInfo li(func);
+        auto users = func->ComputeUsers();
+        for (auto l : li.InnerToOuter()) {
+            loop = l;
+            int size = loop->Size();
+            if (size > loopBudget || growth + size > growthBudget)
+                continue;
+            IRBasicBlock *preheader = loop->Preheader(li.dom);
+            if (preheader == nullptr || !loop->IsClosed(users))
+                continue;
+            IRValue *br = FindInvariantBranch();
+            if (br == nullptr)
+                continue;
+            Unswitch(br, preheader);
+            growth += size;
+            return true;
+        }
+        return false;
+    }
+
+    // a branch between two blocks of the loop on an invariant condition
+    IRValue *FindInvariantBranch() {
+        stored.clear();
+        hasCall = false;
+        for (auto bb : loop->blocks) {
+            for (auto inst : bb->insts) {
+                if (inst->tag == KOOPA_RVT_STORE)
+                    stored.insert(inst->ops[1]);
+                else if (inst->tag == KOOPA_RVT_CALL)
+                    hasCall = true;
+            }
+        }
+        for (auto bb : loop->OrderedBlocks(func)) {
+            IRValue *br = bb->Terminator();
+            if (bb == loop->header || br == nullptr || br->tag != KOOPA_RVT_BRANCH)
+                continue;
+            if (br->ops[0]->IsConst() || br->targets[0] == br->targets[1])
+                continue;
+            if (!loop->Contains(br->targets[0]) || !loop->Contains(br->targets[1]))
+                continue;
+            if (loop->IsInvariant(br->ops[0], stored, hasCall))
+                return br;
+        }
+        return nullptr;
+    }
+
+    void Unswitch(IRValue *br, IRBasicBlock *preheader) {
+        // evaluate the condition again at the end of the preheader
+        map<IRValue*, IRValue*> hoisted;
+        IRValue *cond = HoistInvariant(func, loop, preheader, br->ops[0], hoisted);
+
+        vector<IRBasicBlock*> region = loop->OrderedBlocks(func);
+        map<IRValue*, IRValue*> vmap;
+        map<IRBasicBlock*, IRBasicBlock*> bmap;
+        vector<IRBasicBlock*> copies = CloneRegion(func, region, vmap, bmap, "unswitch");
+        for (auto bb : copies)
+            func->InsertBlockBefore(loop->header, bb);
+
+        // the original loop takes the true side, the copy the false side
+        IRBasicBlock *bb = br->bb;
+        IRBasicBlock *trueBB = br->targets[0], *falseBB = br->targets[1];
+        bb->Remove(br);
+        bb->Append(func->NewJump(trueBB));
+        IRBasicBlock *copy = bmap[bb];
+        copy->Remove(copy->Terminator());
+        copy->Append(func->NewJump(bmap[falseBB]));
+
+        // each loop gets a preheader of its own, so it can be unswitched again
+        IRBasicBlock *pre[2];
+        IRBasicBlock *headers[2] = {loop->header, bmap[loop->header]};
+        for (int i = 0; i < 2; i++) {
+            pre[i] = func->NewBlock("unswitch");
+            pre[i]->Append(func->NewJump(headers[i]));
+            func->InsertBlockBefore(headers[i], pre[i]);
+        }
+        preheader->Remove(preheader->Terminator());
+        preheader->Append(func->NewBranch(cond, pre[0], pre[1]));
+        func->RemoveUnreachable();
+    }
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include "koopa.h"
+#include "options.h"
+#include "opt/IR.h"
+#include "opt/Simplify.h"
+#include "opt/IndVars.h"
+#include "opt/Interchange.h"
+#include "opt/Unswitch.h"
+#include "opt/IfConvert.h"
+#include "opt/ScalarEvolution.h"
+#include "opt/LoopIdiom.h"
+#include "opt/LoopUnroll.h"
+#include "opt/LoopRotate.h"
+#include "opt/LoadElim.h"
+#include "opt/DeadStore.h"
+#include "opt/GlobalConst.h"
+#include "opt/GlobalPromote.h"
+#include "opt/Layout.h"
+
+using namespace std;
+
+// rewrite the Koopa IR text generated by the AST with the optimizer passes
+void optimize(string &koopa) {
+    koopa_program_t program;
+    koopa_error_code_t ret = koopa_parse_from_string(koopa.c_str(), &program);
+    assert(ret == KOOPA_EC_SUCCESS);
+    koopa_raw_program_builder_t builder = koopa_new_raw_program_builder();
+    koopa_raw_program_t raw = koopa_build_raw_program(builder, program);
+    koopa_delete_program(program);
+
+    IRProgram ir(raw);
+    koopa_delete_raw_program_builder(builder);
+
+    GlobalConstProp globalConst(&ir);
+    GlobalRefs globalRefs(&ir);
+    // loop idioms declare the routines they call, so iterate over a copy
+    vector<IRFunction*> funcs = ir.funcs;
+    for (auto func : funcs) {
+        if (func->IsDecl())
+            continue;
+        globalConst.Run(func);
+        SimplifyFunction(func);
+        GlobalPromote(func, globalRefs).Run();
+        LoopInterchange(func).Run();
+        LoopUnswitch(func).Run();
+        IfConvert(func).Run();
+        ScalarEvolution(func).Run();
+        LoopIdiom(func, &ir).Run();
+        IndVarReduce(func).Run();
+        LoopUnroll(func, options.unrollFactor).Run();
+        LoopRotate(func).Run();
+        // forwarded values fold into constant addresses, which forward further
+        for (int round = 0; round < 4; round++) {
+            bool changed = LoadElim(func).Run();
+            changed |= globalConst.Run(func);
+            if (!changed)
+                break;
+            SimplifyFunction(func);
+        }
+        DeadStoreElim(func).Run();
+        SimplifyFunction(func);
+        LayoutBlocks(func);
+    }
+
+    koopa = "";
+    ir.GenKoopa(koopa);
+}
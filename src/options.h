@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdlib>
+#include <string>
+
+using namespace std;
+
+// extra options may follow the output file:
+// compiler -riscv input -o output (or -koopa, -obj) [-O0] [-unroll=N] [-march=ISA] [-latency=load:N,mul:N,div:N]
+struct CompileOptions {
+    bool optimize = true; // -O0 turns the optimizer off
+    int unrollFactor = 4; // -unroll=N, 1 disables partial unrolling
+    bool zicond = false;  // -march=ISA with _zicond, conditional zero instructions
+    bool rvv = false;     // -march=ISA with v, the vector extension
+    // cycles until the result can be used, for instruction scheduling
+    int loadLatency = 3;
+    int mulLatency = 3;
+    int divLatency = 20;
+};
+static CompileOptions options;
+
+// extensions of an ISA string like rv32imv_zicond: single letters up to
+// the first underscore, longer names after underscores
+static bool HasExtension(const string &isa, const string &ext) {
+    size_t start = (isa.rfind("rv", 0) == 0) ? 4 : 0;
+    size_t end = isa.find('_');
+    if (ext.size() == 1)
+        return isa.substr(start, end == string::npos ? string::npos : end - start).find(ext) != string::npos;
+    return end != string::npos && (isa + "_").find("_" + ext + "_", end) != string::npos;
+}
+
+// -latency=load:2,div:34, the unit names may come in any order
+static void ParseLatencies(const string &list) {
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos)
+            end = list.size();
+        string item = list.substr(start, end - start);
+        size_t colon = item.find(':');
+        if (colon != string::npos) {
+            string unit = item.substr(0, colon);
+            int cycles = atoi(item.c_str() + colon + 1);
+            if (unit == "load")
+                options.loadLatency = cycles;
+            else if (unit == "mul")
+                options.mulLatency = cycles;
+            else if (unit == "div")
+                options.divLatency = cycles;
+        }
+        start = end + 1;
+    }
+}
+
+static void ParseOptions(int argc, const char *argv[], int first) {
+    for (int i = first; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-O0")
+            options.optimize = false;
+        else if (arg == "-O1" || arg == "-O2")
+            options.optimize = true;
+        else if (arg.rfind("-unroll=", 0) == 0)
+            options.unrollFactor = atoi(arg.c_str() + 8);
+        else if (arg.rfind("-march=", 0) == 0) {
+            string isa = arg.substr(7);
+            options.zicond = HasExtension(isa, "zicond");
+            options.rvv = HasExtension(isa, "v");
+        }
+        else if (arg.rfind("-latency=", 0) == 0)
+            ParseLatencies(arg.substr(9));
+    }
+}
@@ -0,0 +1,256 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "options.h"
+#include "riscv/MachineInst.h"
+
+using namespace std;
+
+// 基本块内指令的依赖图, 供指令调度使用
+// 生成的代码只在基本块内使用临时寄存器 t0-t6, 先把每次写临时寄存器重命名为一个
+// 新值, 去掉反复使用 t0-t3 带来的假依赖, 图中只剩真依赖, 其他寄存器的读写顺序,
+// 访存之间的依赖以及调用和跳转的顺序. 延迟由 -latency=load:N,mul:N,div:N 指定.
+
+// 调度时用到的栈帧信息, 偏移量相对于 sp
+struct FrameInfo {
+    vector<pair<int, int>> arrays; // 局部数组所占的区间 [begin, end), 栈帧的其余部分不会通过指针访问
+    set<int> locals;               // 只在当前基本块内读写的值
+
+    // offset 处的字不在局部数组中
+    bool IsPrivate(int offset) const {
+        for (auto &range : arrays) {
+            if (offset < range.second && range.first < offset + 4)
+                return false;
+        }
+        return true;
+    }
+};
+
+class DepGraph {
+public:
+    DepGraph(const vector<MInst> &_insts, const FrameInfo *_frame = nullptr) : insts(_insts), frame(_frame) {
+    }
+
+    // 临时寄存器的每次使用都要找到块内的定义, 否则返回 false
+    bool Build() {
+        n = insts.size();
+        if (!Rename())
+            return false;
+        BuildGraph();
+        return true;
+    }
+
+    static const int numTemps = 7;
+
+    struct Edge {
+        int to;
+        int latency;
+    };
+    // 重命名后的值: 每次写临时寄存器产生一个新值
+    struct Operands {
+        int rd = -1, rs1 = -1, rs2 = -1;
+    };
+    // 值 = base + offset, base 为 sp, s1 或全局变量时可以判断访存是否重叠
+    struct Address {
+        string base;
+        int offset = 0;
+        bool isConst = false;
+    };
+
+    const vector<MInst> &insts;
+    int n = 0;
+    vector<vector<Edge>> succs;
+    vector<int> numPreds;
+    vector<Operands> values;
+    vector<int> defOf;      // 值 -> 定义它的指令
+    vector<int> numUses;    // 值 -> 使用次数
+    vector<Address> addrs;  // 值 -> 作为地址时的基址和偏移
+    vector<Address> memAddrs; // 访存指令 -> 访问的地址
+
+    static bool IsTemp(const string &reg) {
+        return reg.size() == 2 && reg[0] == 't' && reg[1] >= '0' && reg[1] < '0' + numTemps;
+    }
+
+    int Latency(const MInst &inst) const {
+        if (inst.IsLoad())
+            return options.loadLatency;
+        if (inst.op == "mul")
+            return options.mulLatency;
+        if (inst.op == "div" || inst.op == "rem")
+            return options.divLatency;
+        return 1;
+    }
+
+    // 栈, 全局变量块和各个全局变量互不重叠, 同一基址时比较偏移量;
+    // 基址未知的访存只可能访问到栈帧中的局部数组
+    bool MayAlias(const Address &a, const Address &b) const {
+        if (a.base.empty() && b.base.empty())
+            return true;
+        if (a.base.empty() || b.base.empty())
+            return !IsPrivate(a.base.empty() ? b : a);
+        if (a.base.substr(0, a.base.find('#')) != b.base.substr(0, b.base.find('#')))
+            return false;
+        return a.base != b.base || (a.offset < b.offset + 4 && b.offset < a.offset + 4);
+    }
+
+    // 写入只在本块内使用的栈上的值
+    bool IsLocal(const Address &addr) const {
+        return IsPrivate(addr) && frame->locals.count(addr.offset);
+    }
+
+    // 在依赖图上模拟顺序发射, 每个周期发射一条
+    int Cycles(const vector<int> &order) const {
+        vector<int> ready(n, 0);
+        int cycle = 0;
+        for (int i : order) {
+            cycle = max(cycle, ready[i]);
+            for (auto &e : succs[i])
+                ready[e.to] = max(ready[e.to], cycle + e.latency);
+            cycle++;
+        }
+        return cycle;
+    }
+
+private:
+    const FrameInfo *frame;
+    bool spChanged = false;
+
+    bool IsPrivate(const Address &addr) const {
+        return frame != nullptr && !spChanged && addr.base == "sp#0" && frame->IsPrivate(addr.offset);
+    }
+
+    Address AddressOf(int value, const string &reg, map<string, int> &version) {
+        if (value >= 0)
+            return addrs[value];
+        Address addr;
+        if (reg == "sp" || reg == "s1")
+            addr.base = reg + "#" + to_string(version[reg]);
+        return addr;
+    }
+
+    bool Rename() {
+        values.assign(n, Operands());
+        defOf.clear();
+        numUses.clear();
+        addrs.clear();
+        map<string, int> cur, version;
+        spChanged = false;
+        for (int i = 0; i < n; i++) {
+            const MInst &inst = insts[i];
+            // 调用会改写临时寄存器
+            if (inst.IsCall())
+                cur.clear();
+            for (auto p : {make_pair(&inst.rs1, &values[i].rs1), make_pair(&inst.rs2, &values[i].rs2)}) {
+                if (!IsTemp(*p.first))
+                    continue;
+                auto it = cur.find(*p.first);
+                if (it == cur.end())
+                    return false;
+                *p.second = it->second;
+                numUses[it->second]++;
+            }
+            string def = inst.Def();
+            if (def == "sp" || def == "s1")
+                version[def]++;
+            if (def == "sp")
+                spChanged = true;
+            if (!IsTemp(def))
+                continue;
+            Address addr;
+            Address lhs = AddressOf(values[i].rs1, inst.rs1, version);
+            Address rhs = AddressOf(values[i].rs2, inst.rs2, version);
+            if (inst.op == "li") {
+                addr.isConst = true;
+                addr.offset = inst.imm;
+            }
+            else if (inst.op == "la") {
+                addr.base = inst.label;
+            }
+            else if (inst.op == "addi" && !lhs.base.empty()) {
+                addr.base = lhs.base;
+                addr.offset = lhs.offset + inst.imm;
+            }
+            else if (inst.op == "add" && !lhs.base.empty() && rhs.isConst) {
+                addr.base = lhs.base;
+                addr.offset = lhs.offset + rhs.offset;
+            }
+            else if (inst.op == "add" && lhs.isConst && !rhs.base.empty()) {
+                addr.base = rhs.base;
+                addr.offset = lhs.offset + rhs.offset;
+            }
+            values[i].rd = defOf.size();
+            cur[def] = defOf.size();
+            defOf.push_back(i);
+            numUses.push_back(0);
+            addrs.push_back(addr);
+        }
+        return true;
+    }
+
+    void AddEdge(int from, int to, int latency) {
+        succs[from].push_back({to, latency});
+        numPreds[to]++;
+    }
+
+    void BuildGraph() {
+        succs.assign(n, vector<Edge>());
+        numPreds.assign(n, 0);
+        memAddrs.assign(n, Address());
+        map<string, int> lastDef, version;
+        map<string, vector<int>> readers;
+        vector<int> memOps;
+        int barrier = -1;
+        for (int i = 0; i < n; i++) {
+            const MInst &inst = insts[i];
+            // 调用和跳转前的指令都不能移到它后面
+            if (inst.IsCall() || inst.IsTerminator()) {
+                for (int j = max(barrier, 0); j < i; j++)
+                    AddEdge(j, i, 0);
+            }
+            else if (barrier >= 0) {
+                AddEdge(barrier, i, 0);
+            }
+            if (inst.IsCall())
+                barrier = i;
+
+            // 重命名过的值只有真依赖, 其他寄存器还要保持读写顺序
+            for (int v : {values[i].rs1, values[i].rs2}) {
+                if (v >= 0)
+                    AddEdge(defOf[v], i, Latency(insts[defOf[v]]));
+            }
+            for (auto &reg : inst.Uses()) {
+                if (IsTemp(reg))
+                    continue;
+                if (lastDef.count(reg))
+                    AddEdge(lastDef[reg], i, Latency(insts[lastDef[reg]]));
+                readers[reg].push_back(i);
+            }
+            string def = inst.Def();
+            if (!def.empty() && !IsTemp(def)) {
+                for (int r : readers[def]) {
+                    if (r != i)
+                        AddEdge(r, i, 0);
+                }
+                if (lastDef.count(def))
+                    AddEdge(lastDef[def], i, 1);
+                lastDef[def] = i;
+                readers[def].clear();
+                if (def == "sp" || def == "s1")
+                    version[def]++;
+            }
+
+            if (inst.IsLoad() || inst.IsStore()) {
+                memAddrs[i] = AddressOf(values[i].rs1, inst.rs1, version);
+                memAddrs[i].offset += inst.imm;
+                for (int m : memOps) {
+                    if ((inst.IsStore() || insts[m].IsStore()) && MayAlias(memAddrs[m], memAddrs[i]))
+                        AddEdge(m, i, insts[m].IsStore() ? 1 : 0);
+                }
+                memOps.push_back(i);
+            }
+        }
+    }
+};
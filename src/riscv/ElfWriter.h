@@ -0,0 +1,196 @@
+#pragma once
+#include <cassert>
+#include <cstring>
+#include <elf.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "riscv/MachineIR.h"
+#include "riscv/Encoder.h"
+
+using namespace std;
+
+// 把机器层的模块写成 RV32 的可重定位 ELF 目标文件 (ilp32 软浮点 ABI).
+// 节为 .text, .data, .bss 和 .rodata, .text 的重定位在 .rela.text 中;
+// 函数和 .globl 的全局变量是全局符号, 调用或引用而没有定义的 (运行时库的函数) 是未定义符号.
+
+class ElfWriter {
+public:
+    ElfWriter(const MModule &module) : module(module) {}
+
+    string Write() {
+        text.Encode(module.funcs);
+        LayoutData();
+        BuildSymbols();
+
+        string rela;
+        for (auto &reloc : text.relocs) {
+            Elf32_Rela entry = {};
+            entry.r_offset = reloc.offset;
+            entry.r_info = ELF32_R_INFO(symbolIndex.at(reloc.symbol), reloc.type);
+            rela.append((const char*)&entry, sizeof(entry));
+        }
+
+        string file(sizeof(Elf32_Ehdr), '\0');
+        headers.assign(SECTION_NUM, Elf32_Shdr());
+        AddSection(file, TEXT, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, text.code);
+        AddSection(file, DATA, ".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, data[DATA]);
+        AddSection(file, BSS, ".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, "");
+        headers[BSS].sh_size = bssSize;
+        AddSection(file, RODATA, ".rodata", SHT_PROGBITS, SHF_ALLOC, data[RODATA]);
+        AddSection(file, RELA_TEXT, ".rela.text", SHT_RELA, SHF_INFO_LINK, rela);
+        headers[RELA_TEXT].sh_link = SYMTAB;
+        headers[RELA_TEXT].sh_info = TEXT;
+        headers[RELA_TEXT].sh_entsize = sizeof(Elf32_Rela);
+        AddSection(file, SYMTAB, ".symtab", SHT_SYMTAB, 0,
+                   string((const char*)symbols.data(), sizeof(Elf32_Sym) * symbols.size()));
+        headers[SYMTAB].sh_link = STRTAB;
+        headers[SYMTAB].sh_info = firstGlobal;
+        headers[SYMTAB].sh_entsize = sizeof(Elf32_Sym);
+        AddSection(file, STRTAB, ".strtab", SHT_STRTAB, 0, strtab);
+        AddSection(file, SHSTRTAB, ".shstrtab", SHT_STRTAB, 0, shstrtab);
+
+        Align(file, 4);
+        Elf32_Ehdr header = {};
+        memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = ELFCLASS32;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header.e_type = ET_REL;
+        header.e_machine = EM_RISCV;
+        header.e_version = EV_CURRENT;
+        header.e_shoff = file.size();
+        header.e_flags = 0;
+        header.e_ehsize = sizeof(Elf32_Ehdr);
+        header.e_shentsize = sizeof(Elf32_Shdr);
+        header.e_shnum = SECTION_NUM;
+        header.e_shstrndx = SHSTRTAB;
+        memcpy(&file[0], &header, sizeof(header));
+        file.append((const char*)headers.data(), sizeof(Elf32_Shdr) * SECTION_NUM);
+        return file;
+    }
+
+private:
+    enum { TEXT = 1, DATA, BSS, RODATA, RELA_TEXT, SYMTAB, STRTAB, SHSTRTAB, SECTION_NUM };
+
+    // 全局变量在所在节中的位置
+    struct DataSymbol {
+        string name;
+        int section, offset, size;
+        bool global;
+    };
+
+    const MModule &module;
+    TextEncoder text;
+    string data[SECTION_NUM];
+    int bssSize = 0;
+    vector<DataSymbol> dataSymbols;
+    vector<Elf32_Sym> symbols;
+    map<string, int> symbolIndex;
+    int firstGlobal = 0;
+    string strtab = string(1, '\0');
+    string shstrtab = string(1, '\0');
+    vector<Elf32_Shdr> headers;
+
+    static int SectionOf(const string &section) {
+        if (section == ".data")
+            return DATA;
+        if (section == ".bss")
+            return BSS;
+        if (section == ".section .rodata" || section == ".rodata")
+            return RODATA;
+        assert(false);
+        return DATA;
+    }
+
+    void LayoutData() {
+        int section = DATA;
+        for (auto &global : module.globals) {
+            if (!global.section.empty())
+                section = SectionOf(global.section);
+            int start = (section == BSS) ? bssSize : data[section].size();
+            for (auto &item : global.items) {
+                if (section == BSS) {
+                    assert(item.zero);
+                    bssSize += item.value;
+                }
+                else if (item.zero) {
+                    data[section].append(item.value, '\0');
+                }
+                else {
+                    for (int k = 0; k < 4; k++)
+                        data[section].push_back((char)(((uint32_t)item.value >> (8 * k)) & 0xff));
+                }
+            }
+            int end = (section == BSS) ? bssSize : data[section].size();
+            dataSymbols.push_back({global.name, section, start, end - start, global.globl});
+        }
+    }
+
+    static int AddName(string &table, const string &name) {
+        int offset = table.size();
+        table += name;
+        table.push_back('\0');
+        return offset;
+    }
+
+    void AddSymbol(const string &name, int binding, int type, int section, int value, int size) {
+        Elf32_Sym symbol = {};
+        symbol.st_name = name.empty() ? 0 : AddName(strtab, name);
+        symbol.st_info = ELF32_ST_INFO(binding, type);
+        symbol.st_shndx = section;
+        symbol.st_value = value;
+        symbol.st_size = size;
+        if (!name.empty())
+            symbolIndex[name] = symbols.size();
+        symbols.push_back(symbol);
+    }
+
+    // 局部符号必须排在全局符号之前
+    void BuildSymbols() {
+        AddSymbol("", STB_LOCAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+        for (int section : {TEXT, DATA, BSS, RODATA})
+            AddSymbol("", STB_LOCAL, STT_SECTION, section, 0, 0);
+        for (auto &symbol : dataSymbols) {
+            if (!symbol.global)
+                AddSymbol(symbol.name, STB_LOCAL, STT_NOTYPE, symbol.section, symbol.offset, 0);
+        }
+        for (auto &symbol : text.symbols) {
+            if (!symbol.func)
+                AddSymbol(symbol.name, STB_LOCAL, STT_NOTYPE, TEXT, symbol.offset, 0);
+        }
+        firstGlobal = symbols.size();
+        for (auto &symbol : text.symbols) {
+            if (symbol.func)
+                AddSymbol(symbol.name, STB_GLOBAL, STT_FUNC, TEXT, symbol.offset, symbol.size);
+        }
+        for (auto &symbol : dataSymbols) {
+            if (symbol.global)
+                AddSymbol(symbol.name, STB_GLOBAL, STT_OBJECT, symbol.section, symbol.offset, symbol.size);
+        }
+        for (auto &reloc : text.relocs) {
+            if (symbolIndex.find(reloc.symbol) == symbolIndex.end())
+                AddSymbol(reloc.symbol, STB_GLOBAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+        }
+    }
+
+    static void Align(string &file, size_t align) {
+        while (file.size() % align != 0)
+            file.push_back('\0');
+    }
+
+    void AddSection(string &file, int index, const string &name, int type, int flags, const string &content) {
+        Align(file, 4);
+        Elf32_Shdr &header = headers[index];
+        // 先加名字再取内容, 这样 .shstrtab 的内容里也有它自己的名字
+        header.sh_name = AddName(shstrtab, name);
+        header.sh_type = type;
+        header.sh_flags = flags;
+        header.sh_offset = file.size();
+        header.sh_size = content.size();
+        header.sh_addralign = 4;
+        if (type != SHT_NOBITS)
+            file += content;
+    }
+};
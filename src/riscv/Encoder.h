@@ -0,0 +1,295 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <elf.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "riscv/MachineIR.h"
+
+using namespace std;
+
+// 把机器层的函数编码为 RV32IM 机器码 (以及 Zicond 的 czero), 伪指令按汇编器的方式展开:
+//   li 超出 12 位时为 lui + addi, la 为 auipc + addi, call 为 auipc + jalr,
+//   跳不到目标的条件跳转改为反向跳过一条 jal.
+// 块的标号在这里直接算出偏移, 函数和全局变量的地址留给链接器, 记录为重定位.
+
+// .text 中的一个重定位, 没有 addend
+struct MReloc {
+    int offset;
+    int type; // R_RISCV_*
+    string symbol;
+};
+
+// .text 中的符号: 函数, 或 la 的 auipc 处的局部标号 (pcrel_lo 重定位指向它)
+struct MTextSymbol {
+    string name;
+    int offset, size;
+    bool func;
+};
+
+class TextEncoder {
+public:
+    string code;
+    vector<MReloc> relocs;
+    vector<MTextSymbol> symbols;
+
+    void Encode(const vector<MFunction> &funcs) {
+        // 所有指令排成一列, 记下每个函数和标号从第几条指令开始
+        vector<size_t> starts;
+        for (auto &func : funcs) {
+            starts.push_back(insts.size());
+            for (auto &block : func.blocks) {
+                if (!block.label.empty())
+                    labels[block.label] = insts.size();
+                for (auto &inst : block.insts)
+                    insts.push_back(&inst);
+            }
+        }
+        starts.push_back(insts.size());
+
+        Layout();
+        for (size_t i = 0; i < funcs.size(); i++) {
+            int start = offsets[starts[i]];
+            symbols.push_back({funcs[i].name, start, offsets[starts[i + 1]] - start, true});
+        }
+        for (size_t i = 0; i < insts.size(); i++)
+            Emit(i);
+    }
+
+    static int RegNumber(const string &reg) {
+        static const map<string, int> numbers = {
+            {"zero", 0}, {"ra", 1}, {"sp", 2}, {"gp", 3}, {"tp", 4}, {"t0", 5}, {"t1", 6}, {"t2", 7},
+            {"s0", 8}, {"fp", 8}, {"s1", 9}, {"a0", 10}, {"a1", 11}, {"a2", 12}, {"a3", 13}, {"a4", 14},
+            {"a5", 15}, {"a6", 16}, {"a7", 17}, {"s2", 18}, {"s3", 19}, {"s4", 20}, {"s5", 21},
+            {"s6", 22}, {"s7", 23}, {"s8", 24}, {"s9", 25}, {"s10", 26}, {"s11", 27},
+            {"t3", 28}, {"t4", 29}, {"t5", 30}, {"t6", 31},
+        };
+        auto it = numbers.find(reg);
+        if (it == numbers.end()) {
+            cerr << "unknown register " << reg << endl;
+            assert(false);
+        }
+        return it->second;
+    }
+
+private:
+    vector<const MInst*> insts;
+    map<string, size_t> labels;
+    vector<int> offsets;      // 每条指令的偏移, 最后多一项为总长度
+    vector<bool> longBranch;  // 展开为反向跳转 + jal 的条件跳转
+
+    static bool InRange(int value, int bits) {
+        return value >= -(1 << (bits - 1)) && value < (1 << (bits - 1));
+    }
+
+    // imm = (Hi20(imm) << 12) + Lo12(imm), Lo12 是有符号的
+    static uint32_t Hi20(int imm) {
+        return (((uint32_t)imm + 0x800) >> 12) & 0xfffff;
+    }
+
+    static int Lo12(int imm) {
+        return (int32_t)((uint32_t)imm << 20) >> 20;
+    }
+
+    int Size(size_t i) const {
+        const MInst &inst = *insts[i];
+        if (inst.op == "li")
+            return (InRange(inst.imm, 12) || Lo12(inst.imm) == 0) ? 4 : 8;
+        if (inst.op == "la" || inst.IsCall())
+            return 8;
+        if (inst.IsBranch() && longBranch[i])
+            return 8;
+        return 4;
+    }
+
+    int Target(size_t i) const {
+        auto it = labels.find(insts[i]->label);
+        if (it == labels.end()) {
+            cerr << "unknown label " << insts[i]->label << endl;
+            assert(false);
+        }
+        return offsets[it->second];
+    }
+
+    // 条件跳转先都按一条指令算, 跳不到的改为两条后重新计算偏移, 直到不再变化
+    void Layout() {
+        longBranch.assign(insts.size(), false);
+        bool changed = true;
+        while (changed) {
+            offsets.assign(1, 0);
+            for (size_t i = 0; i < insts.size(); i++)
+                offsets.push_back(offsets[i] + Size(i));
+            changed = false;
+            for (size_t i = 0; i < insts.size(); i++) {
+                if (insts[i]->IsBranch() && !longBranch[i] && !InRange(Target(i) - offsets[i], 13)) {
+                    longBranch[i] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    void Put(uint32_t word) {
+        for (int k = 0; k < 4; k++)
+            code.push_back((char)((word >> (8 * k)) & 0xff));
+    }
+
+    static uint32_t EncodeR(uint32_t funct7, int rd, int rs1, int rs2, uint32_t funct3) {
+        return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | 0x33;
+    }
+
+    static uint32_t EncodeI(uint32_t opcode, int rd, int rs1, int imm, uint32_t funct3) {
+        assert(InRange(imm, 12));
+        return ((uint32_t)imm & 0xfff) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+    }
+
+    static uint32_t EncodeS(int rs1, int rs2, int imm, uint32_t funct3) {
+        assert(InRange(imm, 12));
+        uint32_t u = (uint32_t)imm;
+        return ((u >> 5) & 0x7f) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (u & 0x1f) << 7 | 0x23;
+    }
+
+    static uint32_t EncodeB(int rs1, int rs2, int offset, uint32_t funct3) {
+        assert(InRange(offset, 13));
+        uint32_t u = (uint32_t)offset;
+        return ((u >> 12) & 1) << 31 | ((u >> 5) & 0x3f) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 |
+               ((u >> 1) & 0xf) << 8 | ((u >> 11) & 1) << 7 | 0x63;
+    }
+
+    static uint32_t EncodeU(uint32_t opcode, int rd, uint32_t imm20) {
+        return imm20 << 12 | rd << 7 | opcode;
+    }
+
+    static uint32_t EncodeJ(int rd, int offset) {
+        assert(InRange(offset, 21));
+        uint32_t u = (uint32_t)offset;
+        return ((u >> 20) & 1) << 31 | ((u >> 1) & 0x3ff) << 21 | ((u >> 11) & 1) << 20 |
+               ((u >> 12) & 0xff) << 12 | rd << 7 | 0x6f;
+    }
+
+    // 把与零比较和交换操作数的跳转伪指令还原成 beq/bne/blt/bge/bltu/bgeu
+    static void BaseBranch(const MInst &inst, string &op, int &rs1, int &rs2) {
+        op = inst.op;
+        rs1 = RegNumber(inst.rs1);
+        rs2 = inst.rs2.empty() ? 0 : RegNumber(inst.rs2);
+        if (op == "beqz")
+            op = "beq";
+        else if (op == "bnez")
+            op = "bne";
+        else if (op == "bgez")
+            op = "bge";
+        else if (op == "bltz")
+            op = "blt";
+        else if (op == "blez" || op == "ble")
+            op = "bge", swap(rs1, rs2);
+        else if (op == "bgtz" || op == "bgt")
+            op = "blt", swap(rs1, rs2);
+    }
+
+    static uint32_t BranchFunct3(const string &op) {
+        static const map<string, uint32_t> funct3 = {
+            {"beq", 0}, {"bne", 1}, {"blt", 4}, {"bge", 5}, {"bltu", 6}, {"bgeu", 7},
+        };
+        return funct3.at(op);
+    }
+
+    void Emit(size_t i) {
+        const MInst &inst = *insts[i];
+        const string &op = inst.op;
+        int pc = offsets[i];
+        // funct7, funct3
+        static const map<string, pair<uint32_t, uint32_t>> rOps = {
+            {"add", {0, 0}}, {"sub", {0x20, 0}}, {"sll", {0, 1}}, {"slt", {0, 2}}, {"sltu", {0, 3}},
+            {"xor", {0, 4}}, {"srl", {0, 5}}, {"sra", {0x20, 5}}, {"or", {0, 6}}, {"and", {0, 7}},
+            {"mul", {1, 0}}, {"mulh", {1, 1}}, {"mulhsu", {1, 2}}, {"mulhu", {1, 3}},
+            {"div", {1, 4}}, {"divu", {1, 5}}, {"rem", {1, 6}}, {"remu", {1, 7}},
+            {"czero.eqz", {7, 5}}, {"czero.nez", {7, 7}},
+        };
+        static const map<string, uint32_t> iOps = {
+            {"addi", 0}, {"slli", 1}, {"slti", 2}, {"sltiu", 3}, {"xori", 4}, {"srli", 5}, {"srai", 5},
+            {"ori", 6}, {"andi", 7},
+        };
+
+        if (op == "li") {
+            int rd = RegNumber(inst.rd);
+            if (InRange(inst.imm, 12)) {
+                Put(EncodeI(0x13, rd, 0, inst.imm, 0));
+            }
+            else {
+                Put(EncodeU(0x37, rd, Hi20(inst.imm)));
+                if (Lo12(inst.imm) != 0)
+                    Put(EncodeI(0x13, rd, rd, Lo12(inst.imm), 0));
+            }
+        }
+        else if (op == "la") {
+            int rd = RegNumber(inst.rd);
+            string anchor = ".Lpcrel_hi" + to_string(symbols.size());
+            symbols.push_back({anchor, pc, 0, false});
+            relocs.push_back({pc, R_RISCV_PCREL_HI20, inst.label});
+            relocs.push_back({pc + 4, R_RISCV_PCREL_LO12_I, anchor});
+            Put(EncodeU(0x17, rd, 0));
+            Put(EncodeI(0x13, rd, rd, 0, 0));
+        }
+        else if (inst.IsCall()) {
+            relocs.push_back({pc, R_RISCV_CALL_PLT, inst.label});
+            Put(EncodeU(0x17, 1, 0));
+            Put(EncodeI(0x67, 1, 1, 0, 0));
+        }
+        else if (op == "ret") {
+            Put(EncodeI(0x67, 0, 1, 0, 0));
+        }
+        else if (op == "j") {
+            Put(EncodeJ(0, Target(i) - pc));
+        }
+        else if (inst.IsBranch()) {
+            string base;
+            int rs1, rs2;
+            BaseBranch(inst, base, rs1, rs2);
+            if (longBranch[i]) {
+                // 相反的条件跳过下面的 jal
+                Put(EncodeB(rs1, rs2, 8, BranchFunct3(base) ^ 1));
+                Put(EncodeJ(0, Target(i) - pc - 4));
+            }
+            else {
+                Put(EncodeB(rs1, rs2, Target(i) - pc, BranchFunct3(base)));
+            }
+        }
+        else if (inst.IsLoad()) {
+            Put(EncodeI(0x03, RegNumber(inst.rd), RegNumber(inst.rs1), inst.imm, 2));
+        }
+        else if (inst.IsStore()) {
+            Put(EncodeS(RegNumber(inst.rs1), RegNumber(inst.rs2), inst.imm, 2));
+        }
+        else if (op == "mv") {
+            Put(EncodeI(0x13, RegNumber(inst.rd), RegNumber(inst.rs1), 0, 0));
+        }
+        else if (op == "neg") {
+            Put(EncodeR(0x20, RegNumber(inst.rd), 0, RegNumber(inst.rs1), 0));
+        }
+        else if (op == "seqz") {
+            Put(EncodeI(0x13, RegNumber(inst.rd), RegNumber(inst.rs1), 1, 3));
+        }
+        else if (op == "snez") {
+            Put(EncodeR(0, RegNumber(inst.rd), 0, RegNumber(inst.rs1), 3));
+        }
+        else if (op == "sgt") {
+            Put(EncodeR(0, RegNumber(inst.rd), RegNumber(inst.rs2), RegNumber(inst.rs1), 2));
+        }
+        else if (rOps.count(op)) {
+            auto funct = rOps.at(op);
+            Put(EncodeR(funct.first, RegNumber(inst.rd), RegNumber(inst.rs1), RegNumber(inst.rs2), funct.second));
+        }
+        else if (iOps.count(op)) {
+            int imm = inst.imm;
+            if (op == "slli" || op == "srli" || op == "srai")
+                imm = (imm & 31) | (op == "srai" ? 0x400 : 0);
+            Put(EncodeI(0x13, RegNumber(inst.rd), RegNumber(inst.rs1), imm, iOps.at(op)));
+        }
+        else {
+            cerr << "cannot encode " << inst.ToString() << endl;
+            assert(false);
+        }
+    }
+};
@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "riscv/MachineInst.h"
+
+using namespace std;
+
+// 机器层的中间表示: 模块由全局数据和函数组成, 函数由基本块组成, 基本块是 MInst 的序列.
+// KoopaVisitor 把 Koopa IR 翻译成这一层, 窥孔优化和指令调度直接在上面进行,
+// 最后由 Printer 输出汇编.
+
+struct MBlock {
+    string label; // 函数开头的块没有标号
+    vector<MInst> insts;
+};
+
+// 栈帧中的对象, 偏移量相对于分配栈帧后的 sp
+struct MFrameObject {
+    enum Kind {
+        Value,    // 一个值或标量变量
+        Array,    // 局部数组
+        Saved,    // 保存的 ra 或 s1
+        OutArgs,  // 传给被调用函数的第 9 个及以后的参数
+    };
+    Kind kind;
+    int offset, size;
+};
+
+struct MFunction {
+    string name;
+    int stackSize = 0;
+    vector<MFrameObject> objects;
+    vector<MBlock> blocks;
+};
+
+// 全局数据中的一项, zero 时为 value 个字节的零, 否则为一个字
+struct MDataItem {
+    bool zero;
+    int value;
+};
+
+// 一个全局变量, 或者只有标号的一段数据的开头
+struct MGlobal {
+    string section; // 为空时接着上一个全局变量的段
+    string name;
+    bool globl = true;
+    vector<MDataItem> items;
+};
+
+struct MModule {
+    vector<MGlobal> globals;
+    vector<MFunction> funcs;
+};
@@ -0,0 +1,152 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+// 一条 RISC-V 机器指令, 寄存器操作数用名字表示, 不用的为空
+//   R 型:   op rd, rs1, rs2
+//   I 型:   op rd, rs1, imm
+//   访存:   lw rd, imm(rs1) / sw rs2, imm(rs1)
+//   跳转:   op rs1, [rs2,] label / j label / call label
+//   向量:   vsetvli rd, rs1, label / vle32.v rd, (rs1) / vse32.v rs2, (rs1), 其余同 R 型
+struct MInst {
+    string op;
+    string rd, rs1, rs2;
+    int imm = 0;
+    string label; // 跳转目标, 被调用的函数, la 的符号或 vsetvli 的 vtype
+
+    static MInst R(const string &op, const string &rd, const string &rs1, const string &rs2) {
+        MInst inst;
+        inst.op = op, inst.rd = rd, inst.rs1 = rs1, inst.rs2 = rs2;
+        return inst;
+    }
+
+    static MInst I(const string &op, const string &rd, const string &rs1, int imm) {
+        MInst inst;
+        inst.op = op, inst.rd = rd, inst.rs1 = rs1, inst.imm = imm;
+        return inst;
+    }
+
+    // mv, seqz 等只有一个源寄存器的伪指令
+    static MInst U(const string &op, const string &rd, const string &rs1) {
+        return R(op, rd, rs1, "");
+    }
+
+    static MInst Li(const string &rd, int imm) {
+        return I("li", rd, "", imm);
+    }
+
+    static MInst La(const string &rd, const string &symbol) {
+        MInst inst = U("la", rd, "");
+        inst.label = symbol;
+        return inst;
+    }
+
+    static MInst Lw(const string &rd, int imm, const string &base) {
+        return I("lw", rd, base, imm);
+    }
+
+    static MInst Sw(const string &rs2, int imm, const string &base) {
+        MInst inst = I("sw", "", base, imm);
+        inst.rs2 = rs2;
+        return inst;
+    }
+
+    static MInst Branch(const string &op, const string &rs1, const string &rs2, const string &label) {
+        MInst inst = R(op, "", rs1, rs2);
+        inst.label = label;
+        return inst;
+    }
+
+    static MInst Branch(const string &op, const string &rs1, const string &label) {
+        return Branch(op, rs1, "", label);
+    }
+
+    static MInst Jump(const string &op, const string &label) {
+        MInst inst;
+        inst.op = op, inst.label = label;
+        return inst;
+    }
+
+    static MInst Ret() {
+        return Jump("ret", "");
+    }
+
+    bool IsLoad() const { return op == "lw"; }
+    bool IsStore() const { return op == "sw"; }
+    bool IsCall() const { return op == "call"; }
+    bool IsBranch() const { return FormatOf(op) == 'Z' || FormatOf(op) == 'B'; }
+    bool IsTerminator() const { return IsBranch() || op == "j" || op == "ret"; }
+
+    // 写入的寄存器
+    string Def() const {
+        if (IsStore() || IsTerminator() || IsCall() || rd == "zero")
+            return "";
+        return rd;
+    }
+
+    // 读取的寄存器
+    vector<string> Uses() const {
+        vector<string> uses;
+        if (!rs1.empty() && rs1 != "zero")
+            uses.push_back(rs1);
+        if (!rs2.empty() && rs2 != "zero")
+            uses.push_back(rs2);
+        return uses;
+    }
+
+    string ToString() const {
+        if (op == "vsetvli")
+            return op + " " + rd + ", " + rs1 + ", " + label;
+        if (op == "vle32.v")
+            return op + " " + rd + ", (" + rs1 + ")";
+        if (op == "vse32.v")
+            return op + " " + rs2 + ", (" + rs1 + ")";
+        if (op == "li")
+            return op + " " + rd + ", " + to_string(imm);
+        if (op == "la")
+            return op + " " + rd + ", " + label;
+        if (IsLoad())
+            return op + " " + rd + ", " + to_string(imm) + "(" + rs1 + ")";
+        if (IsStore())
+            return op + " " + rs2 + ", " + to_string(imm) + "(" + rs1 + ")";
+        if (op == "j" || IsCall())
+            return op + " " + label;
+        if (op == "ret")
+            return op;
+        if (IsBranch())
+            return op + " " + rs1 + (rs2.empty() ? "" : ", " + rs2) + ", " + label;
+        if (rs2.empty() && FormatOf(op) == 'I')
+            return op + " " + rd + ", " + rs1 + ", " + to_string(imm);
+        if (rs2.empty())
+            return op + " " + rd + ", " + rs1;
+        return op + " " + rd + ", " + rs1 + ", " + rs2;
+    }
+
+    // R: 三个寄存器, I: 寄存器和立即数, U: 一个源寄存器, Z: 与零比较的跳转, B: 两个寄存器的跳转
+    static char FormatOf(const string &op) {
+        size_t dot = op.rfind('.');
+        if (op[0] == 'v' && dot != string::npos) {
+            string suffix = op.substr(dot + 1);
+            if (suffix == "vv" || suffix == "vx" || suffix == "vs")
+                return 'R';
+            if (suffix == "x" || suffix == "s")
+                return 'U';
+        }
+        static const map<string, char> formats = {
+            {"add", 'R'}, {"sub", 'R'}, {"mul", 'R'}, {"div", 'R'}, {"rem", 'R'}, {"and", 'R'}, {"or", 'R'},
+            {"xor", 'R'}, {"sll", 'R'}, {"srl", 'R'}, {"sra", 'R'}, {"slt", 'R'}, {"sltu", 'R'}, {"sgt", 'R'},
+            {"czero.eqz", 'R'}, {"czero.nez", 'R'},
+            {"addi", 'I'}, {"andi", 'I'}, {"ori", 'I'}, {"xori", 'I'}, {"slli", 'I'}, {"srli", 'I'},
+            {"srai", 'I'}, {"slti", 'I'}, {"sltiu", 'I'},
+            {"mv", 'U'}, {"neg", 'U'}, {"seqz", 'U'}, {"snez", 'U'},
+            {"beqz", 'Z'}, {"bnez", 'Z'}, {"blez", 'Z'}, {"bgez", 'Z'}, {"bltz", 'Z'}, {"bgtz", 'Z'},
+            {"beq", 'B'}, {"bne", 'B'}, {"blt", 'B'}, {"bge", 'B'}, {"bltu", 'B'}, {"bgeu", 'B'},
+            {"bgt", 'B'}, {"ble", 'B'},
+        };
+        auto it = formats.find(op);
+        return (it == formats.end()) ? 0 : it->second;
+    }
+};
@@ -0,0 +1,391 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "riscv/MachineIR.h"
+#include "riscv/DepGraph.h"
+#include "riscv/Schedule.h"
+
+using namespace std;
+
+// 最内层单基本块循环的模调度 (modulo scheduling / software pipelining)
+// 循环体是跳回自身的基本块. 给每条指令找一个时刻 t, 每 II 个周期开始一次迭代,
+// t < II 的指令 (第 0 级) 与上一次迭代 t >= II 的指令 (第 1 级) 交错在同一个循环核
+// 里执行, 这样下一次迭代开头的 lw 就能与这一次迭代的计算重叠:
+//     label:          第 0 次迭代的第 0 级 (序言)
+//     label_kernel:   第 i 次迭代的第 1 级 + 第 i+1 次迭代的第 0 级 (循环核)
+//                     bnez t, label_kernel
+// 第 0 级为空时只是重新排列了循环体. 跳转在第 1 级的末尾. 退出循环时多执行的第 0 级只能含有没有副作用的指令: 计算,
+// 地址落在栈帧或全局变量中的 lw, 以及写只在本块内使用的值的 sw, 它们写的临时寄存器
+// 和栈上的值在循环之后都不再使用, 因此不需要收尾代码.
+// 顺序发射时 II 不小于指令数, 也不小于循环间依赖环的长度, 从下界开始逐个尝试. 放不下
+// 的指令会挤掉冲突的指令重新放置 (iterative modulo scheduling); 跨越循环核的值在寄存器中
+// 存活不能超过 II 个周期, 不需要展开循环核. 只在 II 小于表调度后每次迭代的周期数时使用.
+
+class ModuloScheduler {
+public:
+    ModuloScheduler(vector<MInst> &_insts, const string &_label, const FrameInfo *_frame = nullptr)
+        : insts(_insts), label(_label), frame(_frame), graph(_insts, _frame) {
+    }
+
+    // 成功时得到序言和循环核
+    vector<MInst> prologue, kernel;
+
+    bool Run() {
+        vector<MInst> exit;
+        if (!insts.empty() && insts.back().op == "j") {
+            exit.push_back(insts.back());
+            insts.pop_back();
+        }
+        n = insts.size();
+        if (n < 3 || !insts.back().IsBranch() || insts.back().label != label)
+            return false;
+        for (auto &inst : insts) {
+            string def = inst.Def();
+            if (inst.IsCall() || (!def.empty() && !DepGraph::IsTemp(def)))
+                return false;
+        }
+        if (!graph.Build())
+            return false;
+
+        // 表调度后每次迭代的周期数
+        vector<MInst> listed = insts;
+        ListScheduler(listed, frame).Run();
+        DepGraph listedGraph(listed, frame);
+        listedGraph.Build();
+        vector<int> order;
+        for (int i = 0; i < n; i++)
+            order.push_back(i);
+        int cycles = listedGraph.Cycles(order);
+
+        BuildDeps();
+        int minII = max(n, RecurrenceBound(cycles));
+        for (int ii = minII; ii < cycles && ii < minII + maxTries; ii++) {
+            if (Schedule(ii) && AssignRegisters(ii)) {
+                Emit(ii);
+                kernel.insert(kernel.end(), exit.begin(), exit.end());
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    vector<MInst> &insts;
+    string label;
+    const FrameInfo *frame;
+    DepGraph graph;
+    int n;
+
+    static const int maxTries = 32;
+
+    // 约束 t(to) >= t(from) + latency - II * distance
+    struct Dep {
+        int from, to;
+        int latency;
+        int distance;
+    };
+    vector<Dep> deps;
+    vector<vector<int>> in, out; // 指令 -> deps 的下标
+    vector<int> time;
+    vector<int> slots; // 循环核中每个周期发射的指令
+    vector<vector<int>> users; // 值 -> 使用它的指令
+    vector<string> reg; // 值 -> 分配的寄存器
+
+    bool IsSpeculable(int i) const {
+        const MInst &inst = insts[i];
+        if (inst.IsLoad())
+            return !graph.memAddrs[i].base.empty();
+        if (inst.IsStore())
+            return graph.IsLocal(graph.memAddrs[i]);
+        return !inst.IsTerminator() && !inst.IsCall();
+    }
+
+    void AddDep(int from, int to, int latency, int distance) {
+        in[to].push_back(deps.size());
+        out[from].push_back(deps.size());
+        deps.push_back({from, to, latency, distance});
+    }
+
+    void BuildDeps() {
+        in.assign(n, vector<int>());
+        out.assign(n, vector<int>());
+        users.assign(graph.defOf.size(), vector<int>());
+        for (int i = 0; i < n; i++) {
+            for (auto &e : graph.succs[i])
+                AddDep(i, e.to, e.latency, 0);
+            // 跨越循环核的值: 下一次迭代写同一个寄存器之前要用完
+            for (int v : {graph.values[i].rs1, graph.values[i].rs2}) {
+                if (v >= 0) {
+                    AddDep(i, graph.defOf[v], 1, 1);
+                    users[v].push_back(i);
+                }
+            }
+        }
+        // 相邻两次迭代之间的访存依赖
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                const MInst &a = insts[i], &b = insts[j];
+                if (i == j || !(a.IsLoad() || a.IsStore()) || !(b.IsLoad() || b.IsStore()))
+                    continue;
+                if ((a.IsStore() || b.IsStore()) && graph.MayAlias(graph.memAddrs[i], graph.memAddrs[j]))
+                    AddDep(i, j, a.IsStore() ? 1 : 0, 1);
+            }
+        }
+    }
+
+    // 依赖约束有解, 即不存在正权环时 II 满足循环间的依赖
+    bool Feasible(int ii) const {
+        vector<int> start(n, 0);
+        for (int round = 0; round <= n; round++) {
+            bool changed = false;
+            for (auto &dep : deps) {
+                int t = start[dep.from] + dep.latency - ii * dep.distance;
+                if (t > start[dep.to]) {
+                    start[dep.to] = t;
+                    changed = true;
+                }
+            }
+            if (!changed)
+                return true;
+        }
+        return false;
+    }
+
+    // 二分查找满足所有环的最小 II, 不超过 limit
+    int RecurrenceBound(int limit) const {
+        int lo = 1, hi = limit;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (Feasible(mid))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return lo;
+    }
+
+    // 已放置的后继允许的最晚时刻
+    int LatestStart(int i, int ii) const {
+        int start = 2 * ii - 2;
+        for (int d : out[i]) {
+            const Dep &dep = deps[d];
+            if (dep.to != i && time[dep.to] >= 0)
+                start = min(start, time[dep.to] - dep.latency + ii * dep.distance);
+        }
+        return start;
+    }
+
+    void Place(int i, int t) {
+        time[i] = t;
+        slots[t % slots.size()] = i;
+    }
+
+    void Unschedule(int i) {
+        slots[time[i] % slots.size()] = -1;
+        time[i] = -1;
+    }
+
+    // 从跳转开始倒着做迭代模调度, 每条指令尽量靠近它的使用者, 只有延迟放不下的才提前到
+    // 第 0 级, 这样值的存活时间短. 跳转固定在 2 * II - 1, 其余指令在 [0, 2 * II - 2] 内
+    bool Schedule(int ii) {
+        // 从块开头的最长延迟作为优先级
+        vector<int> depth(n, 0);
+        for (int i = 0; i < n; i++) {
+            for (auto &e : graph.succs[i])
+                depth[e.to] = max(depth[e.to], depth[i] + e.latency);
+        }
+        time.assign(n, -1);
+        vector<int> last(n, 2 * ii);
+        slots.assign(ii, -1);
+        int branch = n - 1;
+        Place(branch, 2 * ii - 1);
+        int unscheduled = n - 1;
+        for (int budget = 4 * n; unscheduled > 0; budget--) {
+            if (budget == 0)
+                return false;
+            // 同一次迭代中的后继都放好了的指令里, 选能放得最晚的
+            int i = -1, latest = 0;
+            for (int k = n - 1; k >= 0; k--) {
+                bool ready = time[k] < 0;
+                for (int j = 0; ready && j < (int)graph.succs[k].size(); j++)
+                    ready = time[graph.succs[k][j].to] >= 0;
+                int start = ready ? LatestStart(k, ii) : 0;
+                if (ready && (i < 0 || start > latest || (start == latest && depth[k] > depth[i]))) {
+                    i = k;
+                    latest = start;
+                }
+            }
+            // 后继被挤掉时按深度选
+            if (i < 0) {
+                for (int k = n - 1; k >= 0; k--) {
+                    if (time[k] < 0 && (i < 0 || depth[k] > depth[i]))
+                        i = k;
+                }
+                latest = LatestStart(i, ii);
+            }
+            int earliest = IsSpeculable(i) ? 0 : ii, t = -1;
+            for (int c = latest; c > latest - ii && c >= earliest; c--) {
+                if (slots[c % ii] < 0) {
+                    t = c;
+                    break;
+                }
+            }
+            // 没有空位时挤掉占用的指令, 每次重新放置都比上次早
+            if (t < 0) {
+                t = min(latest, last[i] - 1);
+                if (t % ii == ii - 1)
+                    t--;
+                if (t < earliest)
+                    return false;
+                if (slots[t % ii] >= 0) {
+                    Unschedule(slots[t % ii]);
+                    unscheduled++;
+                }
+            }
+            Place(i, t);
+            last[i] = t;
+            unscheduled--;
+            // 挤掉不再满足约束的前驱
+            for (int d : in[i]) {
+                const Dep &dep = deps[d];
+                if (dep.from == i || time[dep.from] < 0 || time[dep.from] + dep.latency - ii * dep.distance <= t)
+                    continue;
+                Unschedule(dep.from);
+                unscheduled++;
+            }
+        }
+        for (auto &dep : deps) {
+            if (time[dep.to] < time[dep.from] + dep.latency - ii * dep.distance)
+                return false;
+        }
+        Compact(ii);
+        return true;
+    }
+
+    // 被挤到较早空位的指令可能离使用很远. 在不违反约束的空位之间移动指令:
+    // 推迟一条指令会缩短它定义的值, 延长以它为最后一次使用的操作数, 朝缩短的方向移动
+    void Compact(int ii) {
+        for (int round = 0; round < 8; round++) {
+            bool moved = false;
+            for (int i = 0; i < n - 1; i++) {
+                int gain = 0;
+                int v = graph.values[i].rd;
+                if (v >= 0 && !users[v].empty())
+                    gain++;
+                for (int u : {graph.values[i].rs1, graph.values[i].rs2}) {
+                    bool last = u >= 0;
+                    for (int j = 0; last && j < (int)users[u].size(); j++)
+                        last = users[u][j] == i || time[users[u][j]] < time[i];
+                    if (last)
+                        gain--;
+                }
+                if (gain == 0)
+                    continue;
+                int earliest = IsSpeculable(i) ? 0 : ii, latest = 2 * ii - 2;
+                for (int d : in[i]) {
+                    if (deps[d].from != i)
+                        earliest = max(earliest, time[deps[d].from] + deps[d].latency - ii * deps[d].distance);
+                }
+                for (int d : out[i]) {
+                    if (deps[d].to != i)
+                        latest = min(latest, time[deps[d].to] - deps[d].latency + ii * deps[d].distance);
+                }
+                int step = gain > 0 ? 1 : -1, from = time[i];
+                Unschedule(i);
+                for (int t = gain > 0 ? latest : earliest; t != from; t -= step) {
+                    if (slots[t % ii] < 0) {
+                        Place(i, t);
+                        moved = true;
+                        break;
+                    }
+                }
+                if (time[i] < 0)
+                    Place(i, from);
+            }
+            if (!moved)
+                break;
+        }
+    }
+
+    // 值占用寄存器的位置: 定义之后到最后一次使用之前, 按 II 取模
+    bool AssignRegisters(int ii) {
+        int numValues = graph.defOf.size();
+        vector<int> lastUse(numValues, -1);
+        for (int i = 0; i < n; i++) {
+            for (int v : {graph.values[i].rs1, graph.values[i].rs2}) {
+                if (v >= 0)
+                    lastUse[v] = max(lastUse[v], time[i]);
+            }
+        }
+        // 跨越循环核的值先分配
+        vector<pair<int, int>> order;
+        for (int v = 0; v < numValues; v++) {
+            int def = time[graph.defOf[v]];
+            order.push_back({(lastUse[v] >= ii && def < ii) ? -1 : def % ii, v});
+        }
+        sort(order.begin(), order.end());
+        vector<vector<bool>> busy(DepGraph::numTemps, vector<bool>(ii, false));
+        reg.assign(numValues, "");
+        for (auto &p : order) {
+            int v = p.second, def = time[graph.defOf[v]];
+            int end = max(lastUse[v], def + 1);
+            for (int r = 0; r < DepGraph::numTemps && reg[v].empty(); r++) {
+                bool free = true;
+                for (int c = def + 1; c <= end && free; c++)
+                    free = !busy[r][c % ii];
+                if (!free)
+                    continue;
+                for (int c = def + 1; c <= end; c++)
+                    busy[r][c % ii] = true;
+                reg[v] = "t" + to_string(r);
+            }
+            if (reg[v].empty())
+                return false;
+        }
+        return true;
+    }
+
+    MInst Renamed(int i) const {
+        MInst inst = insts[i];
+        if (graph.values[i].rd >= 0)
+            inst.rd = reg[graph.values[i].rd];
+        if (graph.values[i].rs1 >= 0)
+            inst.rs1 = reg[graph.values[i].rs1];
+        if (graph.values[i].rs2 >= 0)
+            inst.rs2 = reg[graph.values[i].rs2];
+        return inst;
+    }
+
+    void Emit(int ii) {
+        vector<int> byTime(2 * ii, -1);
+        for (int i = 0; i < n; i++)
+            byTime[time[i]] = i;
+        prologue.clear();
+        kernel.clear();
+        for (int t = 0; t < ii; t++) {
+            if (byTime[t] >= 0)
+                prologue.push_back(Renamed(byTime[t]));
+        }
+        for (int c = 0; c < ii; c++) {
+            for (int t : {c, c + ii}) {
+                if (byTime[t] >= 0)
+                    kernel.push_back(Renamed(byTime[t]));
+            }
+        }
+        if (!prologue.empty())
+            kernel.back().label = label + "_kernel";
+    }
+};
+
+// 对跳回自身的基本块做模调度, 成功时把序言和循环核两个块加到 blocks 末尾
+static bool PipelineBlock(const MBlock &block, vector<MBlock> &blocks, const FrameInfo *frame = nullptr) {
+    vector<MInst> insts = block.insts;
+    ModuloScheduler scheduler(insts, block.label, frame);
+    if (!scheduler.Run())
+        return false;
+    if (!scheduler.prologue.empty())
+        blocks.push_back({block.label, scheduler.prologue});
+    blocks.push_back({scheduler.prologue.empty() ? block.label : block.label + "_kernel", scheduler.kernel});
+    return true;
+}
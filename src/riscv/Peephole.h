@@ -0,0 +1,443 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "riscv/MachineIR.h"
+#include "riscv/DepGraph.h"
+
+using namespace std;
+
+// 基本块内的窥孔优化
+// 逐条翻译时每个值都先存到栈上再读出来, 代码中有很多冗余:
+//   sw t0, 8(sp); lw t0, 8(sp)          刚存入的值还在寄存器里
+//   li t1, 1; ...; li t1, 1             寄存器里已经是这个常数
+//   li t3, 2048; add t3, sp, t3; ...    重复计算同一个栈地址
+// 先向前扫描, 记住寄存器中的常数, 栈地址以及内存中的字在哪个寄存器里, 删掉重复的
+// li 和地址计算, 把 lw 换成 mv; 再做复写传播; 只在本块内使用的值不再被读取时删掉
+// 它的 sw; 最后删掉结果没有用到的指令. 临时寄存器在块末尾都是死的.
+
+class Peephole {
+public:
+    Peephole(vector<MInst> &_insts, const FrameInfo *_frame = nullptr) : insts(_insts), frame(_frame) {
+    }
+
+    // 返回是否有改动
+    bool Run() {
+        // 反复使用 t0-t3 会让值很快被覆盖, 先把临时寄存器重命名, 优化后再分配;
+        // 寄存器不够时不共享常数再试, 仍然不够就在原来的寄存器上做
+        vector<MInst> original = insts;
+        for (bool share : {shareConstants, false}) {
+            shareConstants = share;
+            if (Rename()) {
+                Optimize();
+                if (AssignTemps())
+                    return true;
+            }
+            insts = original;
+        }
+        return Optimize();
+    }
+
+private:
+    vector<MInst> &insts;
+    const FrameInfo *frame;
+    bool shareConstants = true; // 用已经保存着同一个常数的寄存器代替 li, 会延长寄存器的生存期
+
+    bool Optimize() {
+        bool changed = Forward();
+        changed |= PropagateCopies();
+        changed |= RemoveDeadStores();
+        changed |= RemoveDeadCode();
+        return changed;
+    }
+
+    // 重命名后的值叫 %0, %1, ...
+    static bool IsTemp(const string &reg) {
+        return DepGraph::IsTemp(reg) || (!reg.empty() && reg[0] == '%');
+    }
+
+    // 每次写临时寄存器都改为写一个新值, 读取在块内找不到定义时返回 false
+    bool Rename() {
+        map<string, string> current;
+        int count = 0;
+        for (auto &inst : insts) {
+            for (string *reg : {&inst.rs1, &inst.rs2}) {
+                if (!DepGraph::IsTemp(*reg))
+                    continue;
+                if (!current.count(*reg))
+                    return false;
+                *reg = current[*reg];
+            }
+            if (inst.IsCall())
+                current.clear();
+            string def = inst.Def();
+            if (DepGraph::IsTemp(def)) {
+                current[def] = "%" + to_string(count++);
+                inst.rd = current[def];
+            }
+        }
+        return true;
+    }
+
+    // 按顺序给值分配 t0-t6, 最后一次读取后寄存器即可重用
+    bool AssignTemps() {
+        map<string, int> lastUse;
+        for (size_t i = 0; i < insts.size(); i++) {
+            for (auto &reg : insts[i].Uses())
+                lastUse[reg] = i;
+        }
+        map<string, string> reg;
+        set<string> freeRegs;
+        for (int k = 0; k < DepGraph::numTemps; k++)
+            freeRegs.insert("t" + to_string(k));
+        for (size_t i = 0; i < insts.size(); i++) {
+            MInst &inst = insts[i];
+            for (string *use : {&inst.rs1, &inst.rs2}) {
+                if (!IsTemp(*use))
+                    continue;
+                string value = *use;
+                *use = reg[value];
+                if (lastUse[value] == (int)i)
+                    freeRegs.insert(*use);
+            }
+            string def = inst.Def();
+            if (!IsTemp(def))
+                continue;
+            if (freeRegs.empty())
+                return false;
+            inst.rd = *freeRegs.begin();
+            reg[def] = inst.rd;
+            if (lastUse.count(def) && lastUse[def] > (int)i)
+                freeRegs.erase(freeRegs.begin());
+        }
+        return true;
+    }
+
+    // 内存中的一个字: sp 或 s1 (全局变量块) 加偏移
+    typedef pair<string, int> Slot;
+
+    map<string, int> constOf; // 寄存器中的常数
+    map<string, int> frameOf; // 寄存器中的栈地址 sp + offset
+    map<Slot, string> holder; // 内存中的字和哪个寄存器的值相同
+
+    bool Forward() {
+        constOf.clear();
+        frameOf.clear();
+        holder.clear();
+        vector<MInst> result;
+        bool changed = false;
+        for (size_t i = 0; i < insts.size(); i++) {
+            MInst inst = insts[i];
+            Slot slot;
+            if (inst.op == "li" && i + 1 < insts.size() && IsFrameAddress(insts[i + 1], inst.rd)
+                && !FrameRegister(inst.imm).empty()) {
+                // 栈地址已经在寄存器中
+                string reg = FrameRegister(inst.imm);
+                i++;
+                changed = true;
+                if (reg == inst.rd)
+                    continue;
+                inst = MInst::U("mv", inst.rd, reg);
+            }
+            else if (inst.op == "li" && !ConstRegister(inst.imm, inst.rd).empty()) {
+                // 常数已经在寄存器中
+                string reg = ConstRegister(inst.imm, inst.rd);
+                changed = true;
+                if (reg == inst.rd)
+                    continue;
+                inst = MInst::U("mv", inst.rd, reg);
+            }
+            else if (inst.op == "add" && inst.rd != "sp" && IsFrameOffset(inst) && !FrameRegister(constOf[OffsetOf(inst)]).empty()) {
+                string reg = FrameRegister(constOf[OffsetOf(inst)]);
+                changed = true;
+                if (reg == inst.rd)
+                    continue;
+                inst = MInst::U("mv", inst.rd, reg);
+            }
+            else if (inst.op == "mv" && inst.rd == inst.rs1) {
+                changed = true;
+                continue;
+            }
+            else if (inst.IsLoad() && SlotOf(inst, slot) && holder.count(slot)) {
+                changed = true;
+                if (holder[slot] == inst.rd)
+                    continue;
+                inst = MInst::U("mv", inst.rd, holder[slot]);
+            }
+            else if (inst.IsStore() && SlotOf(inst, slot) && holder.count(slot) && holder[slot] == inst.rs2) {
+                // 写回的就是内存中原来的值
+                changed = true;
+                continue;
+            }
+            Update(inst);
+            result.push_back(inst);
+        }
+        insts = result;
+        return changed;
+    }
+
+    // 按执行 inst 后的状态更新记录
+    void Update(const MInst &inst) {
+        if (inst.IsCall()) {
+            constOf.clear();
+            frameOf.clear();
+            holder.clear();
+            return;
+        }
+        Slot slot;
+        bool known = (inst.IsLoad() || inst.IsStore()) && SlotOf(inst, slot);
+        if (inst.IsStore()) {
+            if (known) {
+                holder[slot] = inst.rs2;
+                return;
+            }
+            // 通过指针写, 只有不在局部数组中的栈上的字不受影响
+            for (auto it = holder.begin(); it != holder.end();) {
+                if (!IsPrivate(it->first))
+                    it = holder.erase(it);
+                else
+                    ++it;
+            }
+            return;
+        }
+        string def = inst.Def();
+        if (def.empty())
+            return;
+        bool isConst = false, isFrame = false;
+        int value = 0;
+        if (inst.op == "li") {
+            isConst = true;
+            value = inst.imm;
+        }
+        else if (inst.op == "mv" && (constOf.count(inst.rs1) || frameOf.count(inst.rs1))) {
+            isConst = constOf.count(inst.rs1);
+            isFrame = !isConst;
+            value = isConst ? constOf[inst.rs1] : frameOf[inst.rs1];
+        }
+        else if (inst.op == "addi" && inst.rs1 == "sp") {
+            isFrame = true;
+            value = inst.imm;
+        }
+        else if (inst.op == "add" && IsFrameOffset(inst)) {
+            isFrame = true;
+            value = constOf[OffsetOf(inst)];
+        }
+        Kill(def);
+        if (def == "sp" || def == "s1") {
+            if (def == "sp")
+                frameOf.clear();
+            for (auto it = holder.begin(); it != holder.end();) {
+                if (it->first.first == def)
+                    it = holder.erase(it);
+                else
+                    ++it;
+            }
+            return;
+        }
+        if (isConst)
+            constOf[def] = value;
+        if (isFrame)
+            frameOf[def] = value;
+        if (inst.IsLoad() && known)
+            holder[slot] = def;
+    }
+
+    // reg 被改写, 与它有关的记录都失效
+    void Kill(const string &reg) {
+        constOf.erase(reg);
+        frameOf.erase(reg);
+        for (auto it = holder.begin(); it != holder.end();) {
+            if (it->second == reg)
+                it = holder.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    // 访存指令访问的字, 地址不确定时返回 false
+    bool SlotOf(const MInst &inst, Slot &slot) {
+        if (inst.rs1 == "sp" || inst.rs1 == "s1") {
+            slot = Slot(inst.rs1, inst.imm);
+            return true;
+        }
+        auto it = frameOf.find(inst.rs1);
+        if (it == frameOf.end())
+            return false;
+        slot = Slot("sp", it->second + inst.imm);
+        return true;
+    }
+
+    bool IsPrivate(const Slot &slot) const {
+        return frame != nullptr && slot.first == "sp" && frame->IsPrivate(slot.second);
+    }
+
+    // add reg, sp, reg 形式的栈地址计算
+    static bool IsFrameAddress(const MInst &inst, const string &reg) {
+        return inst.op == "add" && inst.rd == reg
+            && ((inst.rs1 == "sp" && inst.rs2 == reg) || (inst.rs2 == "sp" && inst.rs1 == reg));
+    }
+
+    // add rd, sp, rs 且 rs 中是常数
+    bool IsFrameOffset(const MInst &inst) const {
+        return (inst.rs1 == "sp" || inst.rs2 == "sp") && constOf.count(OffsetOf(inst));
+    }
+
+    static string OffsetOf(const MInst &inst) {
+        return inst.rs1 == "sp" ? inst.rs2 : inst.rs1;
+    }
+
+    // 保存着常数 value 的寄存器, 不共享常数时只看 rd 自己, 0 直接用 zero
+    string ConstRegister(int value, const string &rd) const {
+        if (value == 0)
+            return "zero";
+        for (auto &p : constOf) {
+            if (p.second == value && (shareConstants || p.first == rd))
+                return p.first;
+        }
+        return "";
+    }
+
+    string FrameRegister(int offset) const {
+        for (auto &p : frameOf) {
+            if (p.second == offset)
+                return p.first;
+        }
+        return "";
+    }
+
+    // 复写传播: mv t0, rs 之后 t0 和 rs 都没有改写时, 读 t0 改为读 rs
+    bool PropagateCopies() {
+        map<string, string> copyOf;
+        bool changed = false;
+        for (auto &inst : insts) {
+            for (string *reg : {&inst.rs1, &inst.rs2}) {
+                auto it = copyOf.find(*reg);
+                if (it != copyOf.end()) {
+                    *reg = it->second;
+                    changed = true;
+                }
+            }
+            if (inst.IsCall()) {
+                copyOf.clear();
+                continue;
+            }
+            string def = inst.Def();
+            if (def.empty())
+                continue;
+            copyOf.erase(def);
+            for (auto it = copyOf.begin(); it != copyOf.end();) {
+                if (it->second == def)
+                    it = copyOf.erase(it);
+                else
+                    ++it;
+            }
+            if (inst.op == "mv" && IsTemp(def) && inst.rs1 != "sp")
+                copyOf[def] = inst.rs1;
+        }
+        return changed;
+    }
+
+    // 只在本块内使用的值写到栈上后不再被读取, 删掉这个 sw
+    bool RemoveDeadStores() {
+        if (frame == nullptr || frame->locals.empty())
+            return false;
+        // 先向前求出每条访存指令的地址
+        constOf.clear();
+        frameOf.clear();
+        holder.clear();
+        vector<Slot> slots(insts.size());
+        vector<bool> known(insts.size(), false);
+        for (size_t i = 0; i < insts.size(); i++) {
+            if (insts[i].Def() == "sp")
+                return false;
+            if (insts[i].IsLoad() || insts[i].IsStore())
+                known[i] = SlotOf(insts[i], slots[i]);
+            Update(insts[i]);
+        }
+        set<Slot> read;
+        vector<MInst> result;
+        bool changed = false;
+        for (int i = (int)insts.size() - 1; i >= 0; i--) {
+            if (insts[i].IsStore() && known[i]) {
+                if (IsPrivate(slots[i]) && frame->locals.count(slots[i].second) && !read.count(slots[i])) {
+                    changed = true;
+                    continue;
+                }
+                read.erase(slots[i]);
+            }
+            if (insts[i].IsLoad() && known[i])
+                read.insert(slots[i]);
+            result.push_back(insts[i]);
+        }
+        insts.assign(result.rbegin(), result.rend());
+        return changed;
+    }
+
+    // 删掉结果写到临时寄存器但之后没有读取的指令
+    bool RemoveDeadCode() {
+        set<string> live;
+        vector<MInst> result;
+        bool changed = false;
+        for (int i = (int)insts.size() - 1; i >= 0; i--) {
+            const MInst &inst = insts[i];
+            string def = inst.Def();
+            bool pure = !inst.IsStore() && !inst.IsCall() && !inst.IsTerminator();
+            if (pure && IsTemp(def) && !live.count(def)) {
+                changed = true;
+                continue;
+            }
+            live.erase(def);
+            for (auto &reg : inst.Uses()) {
+                if (IsTemp(reg))
+                    live.insert(reg);
+            }
+            result.push_back(inst);
+        }
+        insts.assign(result.rbegin(), result.rend());
+        return changed;
+    }
+};
+
+// 条件跳转的反义
+static string InvertBranch(const string &op) {
+    static const map<string, string> inverse = {
+        {"beqz", "bnez"}, {"bnez", "beqz"}, {"blez", "bgtz"}, {"bgtz", "blez"}, {"bltz", "bgez"}, {"bgez", "bltz"},
+        {"beq", "bne"}, {"bne", "beq"}, {"blt", "bge"}, {"bge", "blt"}, {"bltu", "bgeu"}, {"bgeu", "bltu"},
+        {"bgt", "ble"}, {"ble", "bgt"},
+    };
+    auto it = inverse.find(op);
+    return (it == inverse.end()) ? "" : it->second;
+}
+
+// 函数中跨基本块的跳转优化
+//   j L; L:                       删掉跳到下一个块的 j
+//   bnez t0, L1; j L2; L1:        改为 beqz t0, L2; L1:
+static void PeepholeJumps(MFunction &func) {
+    auto &blocks = func.blocks;
+    // 从 i 之后顺序执行能到达标号 label 处, 中间只有空的块
+    auto fallsInto = [&](size_t i, const string &label) {
+        for (size_t k = i + 1; k < blocks.size(); k++) {
+            if (blocks[k].label == label)
+                return true;
+            if (!blocks[k].insts.empty())
+                return false;
+        }
+        return false;
+    };
+    for (size_t i = 0; i < blocks.size(); i++) {
+        auto &insts = blocks[i].insts;
+        if (insts.empty() || insts.back().op != "j")
+            continue;
+        if (fallsInto(i, insts.back().label)) {
+            insts.pop_back();
+            continue;
+        }
+        size_t n = insts.size();
+        if (n >= 2 && insts[n - 2].IsBranch() && fallsInto(i, insts[n - 2].label)) {
+            insts[n - 2].op = InvertBranch(insts[n - 2].op);
+            insts[n - 2].label = insts.back().label;
+            insts.pop_back();
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include "riscv/MachineIR.h"
+
+using namespace std;
+
+// 把机器层的模块输出为汇编
+
+static string PrintBlock(const MBlock &block) {
+    string code = block.label.empty() ? "" : block.label + ":\n";
+    for (auto &inst : block.insts)
+        code += inst.ToString() + "\n";
+    return code + "\n";
+}
+
+static string PrintGlobal(const MGlobal &global) {
+    string code;
+    if (!global.section.empty())
+        code += "  " + global.section + "\n";
+    if (global.globl)
+        code += "  .globl " + global.name + "\n";
+    code += global.name + ":\n";
+    for (auto &item : global.items)
+        code += (item.zero ? "  .zero " : "  .word ") + to_string(item.value) + "\n";
+    return global.items.empty() ? code : code + "\n";
+}
+
+static string PrintFunction(const MFunction &func) {
+    string code = "  .text\n";
+    code += "  .globl " + func.name + "\n";
+    code += func.name + ":\n";
+    for (auto &block : func.blocks)
+        code += PrintBlock(block);
+    return code;
+}
+
+static string PrintModule(const MModule &module) {
+    string code;
+    for (auto &global : module.globals)
+        code += PrintGlobal(global);
+    for (auto &func : module.funcs)
+        code += PrintFunction(func);
+    return code;
+}
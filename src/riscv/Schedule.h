@@ -0,0 +1,143 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include "riscv/MachineInst.h"
+#include "riscv/DepGraph.h"
+
+using namespace std;
+
+// 基本块内的表调度 (list scheduling)
+// 顺序发射的处理器上, 紧跟在 lw 或 mul 后面使用结果会停顿. 按依赖图重新排列
+// 指令, 优先发射关键路径上且操作数已就绪的指令, 让后面的 lw 提前到停顿的位置.
+// 调度后再分配临时寄存器; 不够用或没有变快时保持原来的顺序.
+
+class ListScheduler {
+public:
+    ListScheduler(vector<MInst> &_insts, const FrameInfo *frame = nullptr)
+        : insts(_insts), graph(_insts, frame), n(_insts.size()) {
+    }
+
+    // 返回是否改变了指令顺序
+    bool Run() {
+        if (n < 3 || !graph.Build())
+            return false;
+        vector<int> original;
+        for (int i = 0; i < n; i++)
+            original.push_back(i);
+        // 寄存器不够时优先保证临时寄存器够用, 并逐步降低同时活跃的值的上限,
+        // 取能分配寄存器的最快的顺序
+        int best = graph.Cycles(original);
+        vector<MInst> result;
+        for (int limit = DepGraph::numTemps - 1; limit >= 3; limit--) {
+            for (int mode : {normal, byHeight, byOrder}) {
+                if (mode == normal && limit < DepGraph::numTemps - 1)
+                    continue;
+                vector<int> order = Schedule(mode, limit);
+                vector<MInst> scheduled;
+                int cycles = graph.Cycles(order);
+                if (cycles < best && AssignRegisters(order, scheduled)) {
+                    best = cycles;
+                    result = scheduled;
+                }
+            }
+            if (!result.empty())
+                break;
+        }
+        if (result.empty())
+            return false;
+        insts = result;
+        return true;
+    }
+
+private:
+    vector<MInst> &insts;
+    DepGraph graph;
+    int n;
+
+    // normal: 就绪优先, 按关键路径; byHeight: 寄存器够用优先, 按关键路径;
+    // byOrder: 寄存器够用优先, 按原来的顺序, 只用已就绪的指令填补停顿
+    enum { normal, byHeight, byOrder };
+
+    vector<int> Schedule(int mode, int limit) {
+        // 到块末尾的最长延迟
+        vector<int> height(n, 0);
+        for (int i = n - 1; i >= 0; i--) {
+            height[i] = graph.Latency(insts[i]);
+            for (auto &e : graph.succs[i])
+                height[i] = max(height[i], e.latency + height[e.to]);
+        }
+        vector<int> preds = graph.numPreds, ready(n, 0), remaining = graph.numUses;
+        vector<bool> done(n, false);
+        vector<int> order;
+        int cycle = 0, live = 0;
+        while ((int)order.size() < n) {
+            int best = -1, bestKey = 0;
+            for (int i = 0; i < n; i++) {
+                if (done[i] || preds[i] > 0)
+                    continue;
+                int freed = 0;
+                for (int v : {graph.values[i].rs1, graph.values[i].rs2}) {
+                    if (v >= 0 && remaining[v] == 1)
+                        freed++;
+                }
+                bool fits = live - freed + (graph.values[i].rd >= 0 ? 1 : 0) <= limit;
+                bool tight = mode != normal;
+                int key = (ready[i] <= cycle ? 1 << (tight ? 19 : 20) : 0) + (fits ? 1 << (tight ? 20 : 19) : 0)
+                    + (mode == byOrder ? n - i : height[i] * 64 - min(ready[i], 63));
+                if (best < 0 || key > bestKey) {
+                    best = i;
+                    bestKey = key;
+                }
+            }
+            cycle = max(cycle, ready[best]);
+            done[best] = true;
+            order.push_back(best);
+            for (int v : {graph.values[best].rs1, graph.values[best].rs2}) {
+                if (v >= 0 && --remaining[v] == 0)
+                    live--;
+            }
+            if (graph.values[best].rd >= 0 && remaining[graph.values[best].rd] > 0)
+                live++;
+            for (auto &e : graph.succs[best]) {
+                preds[e.to]--;
+                ready[e.to] = max(ready[e.to], cycle + e.latency);
+            }
+            cycle++;
+        }
+        return order;
+    }
+
+    // 按新的顺序给值分配临时寄存器, 读完最后一次后寄存器即可重用
+    bool AssignRegisters(const vector<int> &order, vector<MInst> &result) {
+        vector<int> remaining = graph.numUses;
+        vector<string> reg(graph.defOf.size());
+        set<string> freeRegs;
+        for (int k = 0; k < DepGraph::numTemps; k++)
+            freeRegs.insert("t" + to_string(k));
+        result.clear();
+        for (int i : order) {
+            MInst inst = insts[i];
+            if (graph.values[i].rs1 >= 0)
+                inst.rs1 = reg[graph.values[i].rs1];
+            if (graph.values[i].rs2 >= 0)
+                inst.rs2 = reg[graph.values[i].rs2];
+            for (int v : {graph.values[i].rs1, graph.values[i].rs2}) {
+                if (v >= 0 && --remaining[v] == 0)
+                    freeRegs.insert(reg[v]);
+            }
+            int v = graph.values[i].rd;
+            if (v >= 0) {
+                if (freeRegs.empty())
+                    return false;
+                reg[v] = *freeRegs.begin();
+                inst.rd = reg[v];
+                if (remaining[v] > 0)
+                    freeRegs.erase(freeRegs.begin());
+            }
+            result.push_back(inst);
+        }
+        return true;
+    }
+};
@@ -3,8 +3,17 @@
 #include <cassert>
 #include <iostream>
 #include <map>
+#include <set>
 #include <vector>
+#include <algorithm>
 #include "koopa.h"
+#include "options.h"
+#include "riscv/MachineIR.h"
+#include "riscv/Printer.h"
+#include "riscv/ElfWriter.h"
+#include "riscv/Schedule.h"
+#include "riscv/ModuloSchedule.h"
+#include "riscv/Peephole.h"
 
 using namespace std;
 
@@ -35,39 +44,6 @@ public:
     }
 };
 
-struct offsetData {
-    int offset; // current offset
-    int index;  // index of the array dimensions
-    koopa_raw_value_t arr; // ptr of the array;
-};
-
-class ArrayOffsetTable {
-public:
-    map<koopa_raw_value_t, offsetData> table;
-
-    ArrayOffsetTable() {
-        table.clear();
-    }
-
-    bool check(const koopa_raw_value_t &ptr) {
-        return (table.find(ptr) != table.end());
-    }
-
-    void insert(const koopa_raw_value_t &ptr, const offsetData &data) {
-        assert(!check(ptr));
-        table[ptr] = data;
-    }
-
-    offsetData get (const koopa_raw_value_t &ptr) {
-        assert(check(ptr));
-        return table[ptr];
-    }
-
-    void clear() {
-        table.clear();
-    }
-};
-
 class StackTable {
 public:
     map<koopa_raw_value_t, int> table;
@@ -103,29 +79,131 @@ public:
 
 class KoopaVisitor {
 public:
-    KoopaVisitor(string *target) { 
-        riscv = target;
+    KoopaVisitor(MModule *target) { 
+        module = target;
     }
 
     // 访问 raw program
     void Visit(const koopa_raw_program_t &program) {
         // 执行一些其他的必要操作
+        FindWrittenGlobals(program.funcs);
+        LayoutGlobals(program);
 
         // 访问所有全局变量
+        VisitGlobalBlock();
         Visit(program.values);
         // 访问所有函数
         Visit(program.funcs);
     }
 
 private:
-    string *riscv;
+    MModule *module;
+    MFunction *curFunc = nullptr; // 正在生成的函数
+    MBlock *curBlock = nullptr;   // 正在生成的基本块
     ArrayDimTable globalArrTable;
+    set<koopa_raw_value_t> writtenGlobals; // 可能被写入的全局变量，其余的放在 .rodata
     ArrayDimTable arrTable;
     StackTable stackTable;
     int stackSpace = 0;
     int paramStackSpace = 0;
     int raLoc = -1;
-    ArrayOffsetTable offsetTable; // for array visit in getElemPtr and getPtr
+    int baseLoc = -1; // main 中保存 s1 的位置
+    FrameInfo frame; // 调度时判断访存是否重叠, 以及哪些值只在当前基本块内使用
+    koopa_raw_basic_block_t nextBB = nullptr; // 下一个输出的基本块, 跳转到它时可省略
+
+    // 小的全局变量连续放在一块数据中，s1 指向其开头，访问时只需一条 lw/sw
+    // 我们生成的代码不使用 s1，库函数按调用约定会保存它，因此只在 main 中设置一次
+    static const int smallGlobalSize = 256;
+    static const int globalBlockSize = 2048; // 偏移量需放得进 12 位立即数
+    vector<koopa_raw_value_t> globalBlock; // 按访问次数从多到少排列
+    map<koopa_raw_value_t, int> globalOffset;
+
+    // 指针所指向的对象，全局变量或局部的 alloc 等
+    koopa_raw_value_t PointerRoot(koopa_raw_value_t ptr) {
+        while (ptr->kind.tag == KOOPA_RVT_GET_ELEM_PTR || ptr->kind.tag == KOOPA_RVT_GET_PTR) {
+            if (ptr->kind.tag == KOOPA_RVT_GET_ELEM_PTR)
+                ptr = ptr->kind.data.get_elem_ptr.src;
+            else
+                ptr = ptr->kind.data.get_ptr.src;
+        }
+        return ptr;
+    }
+
+    void MarkWritten(koopa_raw_value_t ptr) {
+        if (ptr->ty->tag != KOOPA_RTT_POINTER)
+            return;
+        ptr = PointerRoot(ptr);
+        if (ptr->kind.tag == KOOPA_RVT_GLOBAL_ALLOC)
+            writtenGlobals.insert(ptr);
+    }
+
+    // 被 store 写入，或地址被保存、传给函数的全局变量都视为可能被写入
+    void FindWrittenGlobals(const koopa_raw_slice_t &funcs) {
+        for (size_t i = 0; i < funcs.len; i++) {
+            auto func = reinterpret_cast<koopa_raw_function_t>(funcs.buffer[i]);
+            for (size_t j = 0; j < func->bbs.len; j++) {
+                auto bb = reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[j]);
+                for (size_t k = 0; k < bb->insts.len; k++) {
+                    auto inst = reinterpret_cast<koopa_raw_value_t>(bb->insts.buffer[k]);
+                    if (inst->kind.tag == KOOPA_RVT_STORE) {
+                        MarkWritten(inst->kind.data.store.dest);
+                        MarkWritten(inst->kind.data.store.value);
+                    }
+                    else if (inst->kind.tag == KOOPA_RVT_CALL) {
+                        auto args = inst->kind.data.call.args;
+                        for (size_t a = 0; a < args.len; a++)
+                            MarkWritten(reinterpret_cast<koopa_raw_value_t>(args.buffer[a]));
+                    }
+                }
+            }
+        }
+    }
+
+    // 静态引用次数多的全局变量排在前面，使常用的数据集中在一起
+    void LayoutGlobals(const koopa_raw_program_t &program) {
+        map<koopa_raw_value_t, int> refCount;
+        for (size_t i = 0; i < program.funcs.len; i++) {
+            auto func = reinterpret_cast<koopa_raw_function_t>(program.funcs.buffer[i]);
+            for (size_t j = 0; j < func->bbs.len; j++) {
+                auto bb = reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[j]);
+                for (size_t k = 0; k < bb->insts.len; k++) {
+                    auto inst = reinterpret_cast<koopa_raw_value_t>(bb->insts.buffer[k]);
+                    if (inst->kind.tag == KOOPA_RVT_LOAD)
+                        refCount[inst->kind.data.load.src]++;
+                    else if (inst->kind.tag == KOOPA_RVT_STORE)
+                        refCount[inst->kind.data.store.dest]++;
+                    else if (inst->kind.tag == KOOPA_RVT_GET_ELEM_PTR)
+                        refCount[inst->kind.data.get_elem_ptr.src]++;
+                }
+            }
+        }
+        vector<koopa_raw_value_t> candidates;
+        for (size_t i = 0; i < program.values.len; i++) {
+            auto value = reinterpret_cast<koopa_raw_value_t>(program.values.buffer[i]);
+            if (refCount[value] > 0 && TypeSize(value->ty->data.pointer.base) <= smallGlobalSize)
+                candidates.push_back(value);
+        }
+        stable_sort(candidates.begin(), candidates.end(), [&](koopa_raw_value_t a, koopa_raw_value_t b) {
+            return refCount[a] > refCount[b];
+        });
+        int offset = 0;
+        for (auto value : candidates) {
+            int size = TypeSize(value->ty->data.pointer.base);
+            if (offset + size > globalBlockSize)
+                continue;
+            globalOffset[value] = offset;
+            globalBlock.push_back(value);
+            offset += size;
+        }
+    }
+
+    bool InGlobalBlock(const koopa_raw_value_t &value, int &offset) {
+        auto it = globalOffset.find(value);
+        if (it == globalOffset.end())
+            return false;
+        offset = it->second;
+        return true;
+    }
 
     // 访问 raw slice
     void Visit(const koopa_raw_slice_t &slice) {
@@ -151,13 +229,54 @@ private:
         }
     }
 
+    void Emit(const MInst &inst) {
+        curBlock->insts.push_back(inst);
+    }
+
+    // 在当前函数的末尾开始一个新的基本块
+    void StartBlock(const string &label) {
+        curFunc->blocks.push_back({label, {}});
+        curBlock = &curFunc->blocks.back();
+    }
+
+    // 读写栈上 loc 处的字, 偏移量超出 12 位立即数时先在 t3 中算出地址
+    void LoadSlot(const string &reg, int loc) {
+        if (loc >= 2048) {
+            Emit(MInst::Li("t3", loc));
+            Emit(MInst::R("add", "t3", "sp", "t3"));
+            Emit(MInst::Lw(reg, 0, "t3"));
+        }
+        else {
+            Emit(MInst::Lw(reg, loc, "sp"));
+        }
+    }
+
+    void StoreSlot(const string &reg, int loc) {
+        if (loc >= 2048) {
+            Emit(MInst::Li("t3", loc));
+            Emit(MInst::R("add", "t3", "sp", "t3"));
+            Emit(MInst::Sw(reg, 0, "t3"));
+        }
+        else {
+            Emit(MInst::Sw(reg, loc, "sp"));
+        }
+    }
+
+    // 把值读到 reg 中, 常数用 li
+    void LoadValue(const string &reg, const koopa_raw_value_t &value) {
+        if (value->kind.tag == KOOPA_RVT_INTEGER)
+            Emit(MInst::Li(reg, value->kind.data.integer.value));
+        else
+            LoadSlot(reg, stackTable.access(value));
+    }
+
     void AllocStack(const koopa_raw_function_t &func) {
         for (size_t i = 0; i < func->bbs.len;i++) {
             auto bb = reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[i]);
             for (size_t i = 0; i < bb->insts.len; ++i) {
                 koopa_raw_value_t inst = reinterpret_cast<koopa_raw_value_t>(bb->insts.buffer[i]);
                 if (inst->ty->tag==KOOPA_RTT_INT32) {
-                    stackTable.access(inst);
+                    curFunc->objects.push_back({MFrameObject::Value, stackTable.access(inst), 4});
                 }
                 else if (inst->ty->tag == KOOPA_RTT_POINTER) {
                     if (inst->kind.tag == KOOPA_RVT_ALLOC && inst->ty->data.pointer.base->tag == KOOPA_RTT_ARRAY) {
@@ -167,24 +286,34 @@ private:
                             arrSpace *= base->data.array.len;
                             base = base->data.array.base;
                         }
-                        stackTable.access(inst, arrSpace);
+                        curFunc->objects.push_back({MFrameObject::Array, stackTable.access(inst, arrSpace), arrSpace});
                     }
                     else {
-                        stackTable.access(inst);
+                        curFunc->objects.push_back({MFrameObject::Value, stackTable.access(inst), 4});
                     }
                 }
             }
         }
+        frame.arrays.clear();
+        for (auto &object : curFunc->objects) {
+            if (object.kind == MFrameObject::Array)
+                frame.arrays.push_back({object.offset, object.offset + object.size});
+        }
     }
 
     // 访问函数
     void Visit(const koopa_raw_function_t &func) {
-        if (func->bbs.len==0)
+        if (func->bbs.len==0) {
+            if (string(func->name).rfind("@__", 0) == 0)
+                VisitRoutine(func);
             return;
+        }
         // 执行一些其他的必要操作
-        *riscv += "  .text\n";
-        *riscv += "  .globl " + string(func->name + 1) + "\n";
-        *riscv += string(func->name+1) + ":\n";
+        MFunction mfunc;
+        mfunc.name = string(func->name + 1);
+        curFunc = &mfunc;
+        MBlock prologue;
+        curBlock = &prologue;
 
         int varSpace = 0, raSpace = 0, maxParamNum = 0;
         for (size_t i = 0; i < func->bbs.len;i++) {
@@ -234,41 +363,226 @@ private:
         paramStackSpace = (paramSpace < 0) ? 0 : paramSpace;
         cout << "paramStackSpace " << paramStackSpace << endl;
         stackTable.usedSpace = paramStackSpace;
-        int space = varSpace + raSpace + paramStackSpace;
+        if (paramStackSpace > 0)
+            mfunc.objects.push_back({MFrameObject::OutArgs, 0, paramStackSpace});
+        int baseSpace = (string(func->name) == "@main" && !globalBlock.empty()) ? 4 : 0;
+        int space = varSpace + raSpace + baseSpace + paramStackSpace;
         space = ((space - 4) / 16 + 1) * 16;
-        *riscv += "li t0, -" + to_string(space) + "\n";
-        *riscv += "add sp, sp, t0\n";
+        Emit(MInst::Li("t0", -space));
+        Emit(MInst::R("add", "sp", "sp", "t0"));
         stackSpace = space;
+        mfunc.stackSize = space;
         if (raSpace==4) {
             raLoc = space - 4;
-            *riscv += "li t3, " + to_string(raLoc) + "\n";
-            *riscv += "add t3, sp, t3\n";
-            *riscv += "sw ra, 0(t3)\n";
+            mfunc.objects.push_back({MFrameObject::Saved, raLoc, 4});
+            StoreSlot("ra", raLoc);
+        }
+        if (baseSpace == 4) {
+            baseLoc = space - raSpace - 4;
+            mfunc.objects.push_back({MFrameObject::Saved, baseLoc, 4});
+            StoreSlot("s1", baseLoc);
+            Emit(MInst::La("s1", ".Lglobal_block"));
         }
         AllocStack(func);
+        mfunc.blocks.push_back(prologue);
 
         cout << "alloc done\n";
 
-        // 访问所有基本块
-        Visit(func->bbs);
+        // 访问所有基本块, 跳到下一个基本块时可以直接顺序执行
+        for (size_t i = 0; i < func->bbs.len; i++) {
+            nextBB = (i + 1 < func->bbs.len) ? reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[i + 1]) : nullptr;
+            Visit(reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[i]));
+        }
+        nextBB = nullptr;
+        if (options.optimize)
+            PeepholeJumps(mfunc);
+        module->funcs.push_back(mfunc);
+        curFunc = nullptr;
+        curBlock = nullptr;
 
         raLoc = -1;
+        baseLoc = -1;
         stackTable.clear();
-        offsetTable.clear();
         arrTable.clear();
     }
 
+    // 循环替换成的例程, 由优化时识别的循环调用
+    // __fill(dst, x, n): dst[k] = x
+    // __copy(dst, src, n): dst[k] = src[k]
+    // __rvv_<op>_vv(dst, a, b, n): dst[k] = a[k] op b[k]
+    // __rvv_<op>_vx(dst, a, x, n): dst[k] = a[k] op x, rsub 是 x - a[k]
+    // __rvv_redsum(a, n): 返回 a[0] + ... + a[n - 1]
+    void VisitRoutine(const koopa_raw_function_t &func) {
+        string name = string(func->name + 1);
+        MFunction mfunc;
+        mfunc.name = name;
+        curFunc = &mfunc;
+        StartBlock("");
+        if (name == "__fill" || name == "__copy") {
+            if (options.rvv)
+                VisitVectorFillCopy(name);
+            else
+                VisitWordFillCopy(name);
+        }
+        else {
+            VisitVectorRoutine(name);
+        }
+        module->funcs.push_back(mfunc);
+        curFunc = nullptr;
+        curBlock = nullptr;
+    }
+
+    // 每次存 4 个字, 剩下的逐个处理
+    void VisitWordFillCopy(const string &name) {
+        bool fill = (name == "__fill");
+        Emit(MInst::Li("t1", 4));
+        Emit(MInst::Branch("blt", "a2", "t1", name + "_tail"));
+        StartBlock(name + "_loop4");
+        for (int k = 0; k < 4; k++) {
+            if (fill) {
+                Emit(MInst::Sw("a1", k * 4, "a0"));
+            }
+            else {
+                Emit(MInst::Lw("t2", k * 4, "a1"));
+                Emit(MInst::Sw("t2", k * 4, "a0"));
+            }
+        }
+        Emit(MInst::I("addi", "a0", "a0", 16));
+        if (!fill)
+            Emit(MInst::I("addi", "a1", "a1", 16));
+        Emit(MInst::I("addi", "a2", "a2", -4));
+        Emit(MInst::Branch("bge", "a2", "t1", name + "_loop4"));
+        StartBlock(name + "_tail");
+        Emit(MInst::Branch("blez", "a2", name + "_end"));
+        StartBlock(name + "_loop");
+        if (fill) {
+            Emit(MInst::Sw("a1", 0, "a0"));
+        }
+        else {
+            Emit(MInst::Lw("t2", 0, "a1"));
+            Emit(MInst::Sw("t2", 0, "a0"));
+            Emit(MInst::I("addi", "a1", "a1", 4));
+        }
+        Emit(MInst::I("addi", "a0", "a0", 4));
+        Emit(MInst::I("addi", "a2", "a2", -1));
+        Emit(MInst::Branch("bgtz", "a2", name + "_loop"));
+        StartBlock(name + "_end");
+        Emit(MInst::Ret());
+    }
+
+    // vsetvli rd, avl, e32, m8, ta, ma: 每段处理 rd 个字
+    void EmitSetVL(const string &rd, const string &avl) {
+        MInst inst = MInst::U("vsetvli", rd, avl);
+        inst.label = "e32, m8, ta, ma";
+        Emit(inst);
+    }
+
+    // 用 RVV 分段处理, 每段的长度由 vsetvli 决定
+    void VisitVectorFillCopy(const string &name) {
+        bool fill = (name == "__fill");
+        Emit(MInst::Branch("blez", "a2", name + "_end"));
+        if (fill) {
+            // 缩短 vl 时前面的元素不变, 所以只需填充一次
+            EmitSetVL("t0", "a2");
+            Emit(MInst::U("vmv.v.x", "v8", "a1"));
+        }
+        StartBlock(name + "_loop");
+        EmitSetVL("t0", "a2");
+        if (!fill)
+            Emit(MInst::U("vle32.v", "v8", "a1"));
+        Emit(MInst::R("vse32.v", "", "a0", "v8"));
+        Emit(MInst::R("sub", "a2", "a2", "t0"));
+        Emit(MInst::I("slli", "t0", "t0", 2));
+        Emit(MInst::R("add", "a0", "a0", "t0"));
+        if (!fill)
+            Emit(MInst::R("add", "a1", "a1", "t0"));
+        Emit(MInst::Branch("bgtz", "a2", name + "_loop"));
+        StartBlock(name + "_end");
+        Emit(MInst::Ret());
+    }
+
+    // 向量化的循环调用的例程, 用 RVV 分段处理
+    void VisitVectorRoutine(const string &name) {
+        string op = name.substr(6);
+        if (op == "redsum") {
+            Emit(MInst::Li("t2", 0));
+            Emit(MInst::Branch("blez", "a1", name + "_end"));
+            StartBlock(name + "_loop");
+            EmitSetVL("t0", "a1");
+            Emit(MInst::U("vle32.v", "v8", "a0"));
+            Emit(MInst::U("vmv.s.x", "v16", "t2"));
+            Emit(MInst::R("vredsum.vs", "v16", "v8", "v16"));
+            Emit(MInst::U("vmv.x.s", "t2", "v16"));
+            Emit(MInst::R("sub", "a1", "a1", "t0"));
+            Emit(MInst::I("slli", "t0", "t0", 2));
+            Emit(MInst::R("add", "a0", "a0", "t0"));
+            Emit(MInst::Branch("bgtz", "a1", name + "_loop"));
+            StartBlock(name + "_end");
+            Emit(MInst::U("mv", "a0", "t2"));
+            Emit(MInst::Ret());
+            return;
+        }
+        bool vv = (op.substr(op.size() - 2) == "vv");
+        string inst = "v" + op.substr(0, op.size() - 3) + (vv ? ".vv" : ".vx");
+        Emit(MInst::Branch("blez", "a3", name + "_end"));
+        StartBlock(name + "_loop");
+        EmitSetVL("t0", "a3");
+        Emit(MInst::U("vle32.v", "v8", "a1"));
+        if (vv) {
+            Emit(MInst::U("vle32.v", "v16", "a2"));
+            Emit(MInst::R(inst, "v8", "v8", "v16"));
+        }
+        else {
+            Emit(MInst::R(inst, "v8", "v8", "a2"));
+        }
+        Emit(MInst::R("vse32.v", "", "a0", "v8"));
+        Emit(MInst::R("sub", "a3", "a3", "t0"));
+        Emit(MInst::I("slli", "t0", "t0", 2));
+        Emit(MInst::R("add", "a0", "a0", "t0"));
+        Emit(MInst::R("add", "a1", "a1", "t0"));
+        if (vv)
+            Emit(MInst::R("add", "a2", "a2", "t0"));
+        Emit(MInst::Branch("bgtz", "a3", name + "_loop"));
+        StartBlock(name + "_end");
+        Emit(MInst::Ret());
+    }
+
+    // 找出所有使用都在 bb 内的值
+    void FindLocals(const koopa_raw_basic_block_t &bb) {
+        set<koopa_raw_value_t> insts;
+        for (size_t i = 0; i < bb->insts.len; i++)
+            insts.insert(reinterpret_cast<koopa_raw_value_t>(bb->insts.buffer[i]));
+        frame.locals.clear();
+        for (auto inst : insts) {
+            if (!stackTable.check(inst) || inst->kind.tag == KOOPA_RVT_ALLOC)
+                continue;
+            bool local = true;
+            for (size_t i = 0; i < inst->used_by.len && local; i++)
+                local = insts.count(reinterpret_cast<koopa_raw_value_t>(inst->used_by.buffer[i]));
+            if (local)
+                frame.locals.insert(stackTable.access(inst));
+        }
+    }
+
+
     // 访问基本块
     void Visit(const koopa_raw_basic_block_t &bb) {
         // 执行一些其他的必要操作
         string name = string(bb->name + 1);
-        if (name != "entry")
-            *riscv += name + ":\n";
-        else
-            *riscv += "\n";
-        // 访问所有指令
+        MBlock block;
+        block.label = (name != "entry") ? name : "";
+        // 访问所有指令, 块内的代码优化和调度后再加入函数, 跳回自身的循环体做模调度
+        curBlock = &block;
         Visit(bb->insts);
-        
+        curBlock = nullptr;
+        if (options.optimize) {
+            FindLocals(bb);
+            Peephole(block.insts, &frame).Run();
+            if (PipelineBlock(block, curFunc->blocks, &frame))
+                return;
+            ListScheduler(block.insts, &frame).Run();
+        }
+        curFunc->blocks.push_back(block);
     }
 
     // 访问指令
@@ -320,56 +634,22 @@ private:
         }
     }
 
+
     //访问 return 指令
     void VisitRet(const koopa_raw_return_t &ret) {
         koopa_raw_value_t ret_value = ret.value;
         if (ret_value != nullptr) {
-            if (ret_value->kind.tag == KOOPA_RVT_INTEGER) {
-                int32_t int_val = ret_value->kind.data.integer.value;
-                *riscv += "li a0, " + to_string(int_val) + "\n";
-            }
-            else if (ret_value->kind.tag == KOOPA_RVT_BINARY) {
-                int loc = stackTable.access(ret_value);
-                if (loc>=2048) {
-                    *riscv += "li t3, " + to_string(loc) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "lw a0, 0(t3)\n";
-                }
-                else {
-                    *riscv += "lw a0, " + to_string(loc) + "(sp)\n";
-                }
-            }
-            else if (ret_value->kind.tag == KOOPA_RVT_LOAD) {
-                int loc = stackTable.access(ret_value);
-                if (loc>=2048) {
-                    *riscv += "li t3, " + to_string(loc) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "lw a0, 0(t3)\n";
-                }
-                else {
-                    *riscv += "lw a0, " + to_string(loc) + "(sp)\n";
-                }
-            }
-            else if (ret_value->kind.tag == KOOPA_RVT_CALL) {
-                int loc = stackTable.access(ret_value);
-                if (loc>=2048) {
-                    *riscv += "li t3, " + to_string(loc) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "lw a0, 0(t3)\n";
-                }
-                else {
-                    *riscv += "lw a0, " + to_string(loc) + "(sp)\n";
-                }
-            }
-        }
-        if (raLoc > 0) {
-            *riscv += "li t3, " + to_string(raLoc) + "\n";
-            *riscv += "add t3, sp, t3\n";
-            *riscv += "lw ra, 0(t3)\n";
+            if (ret_value->kind.tag == KOOPA_RVT_INTEGER || ret_value->kind.tag == KOOPA_RVT_BINARY ||
+                ret_value->kind.tag == KOOPA_RVT_LOAD || ret_value->kind.tag == KOOPA_RVT_CALL)
+                LoadValue("a0", ret_value);
         }
-        *riscv += "li t0, " + to_string(stackSpace) + "\n";
-        *riscv += "add sp, sp, t0\n";
-        *riscv += "ret\n\n";
+        if (raLoc > 0)
+            LoadSlot("ra", raLoc);
+        if (baseLoc >= 0)
+            LoadSlot("s1", baseLoc);
+        Emit(MInst::Li("t0", stackSpace));
+        Emit(MInst::R("add", "sp", "sp", "t0"));
+        Emit(MInst::Ret());
     }
 
     //访问 integer 指令
@@ -377,6 +657,15 @@ private:
 
     }
 
+    static bool IsCompare(const koopa_raw_value_t &value) {
+        if (value->kind.tag != KOOPA_RVT_BINARY)
+            return false;
+        koopa_raw_binary_op_t op = value->kind.data.binary.op;
+        return op == KOOPA_RBO_EQ || op == KOOPA_RBO_NOT_EQ || op == KOOPA_RBO_LT ||
+               op == KOOPA_RBO_GT || op == KOOPA_RBO_LE || op == KOOPA_RBO_GE;
+    }
+
+
     // 访问 binary OP 指令
     void VisitBinary(const koopa_raw_value_t &value) {
         koopa_raw_binary_t binary = value->kind.data.binary;
@@ -426,111 +715,95 @@ private:
             case KOOPA_RBO_AND:
                 imm = (lhs_kind.data.integer.value & rhs_kind.data.integer.value);
                 break;
-            case KOOPA_RBO_OR:  
+            case KOOPA_RBO_OR:
                 imm = (lhs_kind.data.integer.value | rhs_kind.data.integer.value);
                 break;
+            case KOOPA_RBO_XOR:
+                imm = (lhs_kind.data.integer.value ^ rhs_kind.data.integer.value);
+                break;
+            case KOOPA_RBO_SHL:
+                imm = (int)((unsigned)lhs_kind.data.integer.value << (rhs_kind.data.integer.value & 31));
+                break;
+            case KOOPA_RBO_SHR:
+                imm = (int)((unsigned)lhs_kind.data.integer.value >> (rhs_kind.data.integer.value & 31));
+                break;
+            case KOOPA_RBO_SAR:
+                imm = lhs_kind.data.integer.value >> (rhs_kind.data.integer.value & 31);
+                break;
             }
-            *riscv += "li " + resultReg + ", " + to_string(imm) + "\n";
-            int loc = stackTable.access(value);
-            if (loc >= 2048) {
-                *riscv += "li t3, " + to_string(loc) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "sw " + resultReg + ", 0(t3)\n\n";
-            }
-            else {
-                *riscv += "sw " + resultReg + ", " + to_string(loc) + "(sp)\n\n";
-            }
+            Emit(MInst::Li(resultReg, imm));
+            StoreSlot(resultReg, stackTable.access(value));
             return;
         }
 
-        if (lhs_kind.tag == KOOPA_RVT_INTEGER) {
-            int imm = lhs_kind.data.integer.value;
-            //r1Reg = resultReg;
-            *riscv += "li " + r1Reg + ", " + to_string(imm) + "\n";
-        }
-        else {
-            int loc = stackTable.access(binary.lhs);
-            if (loc >=2048) {
-                *riscv += "li t3, " + to_string(loc) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "lw " + r1Reg + ", 0(t3)\n";
-            }
-            else {
-                *riscv += "lw " + r1Reg + ", " + to_string(loc) + "(sp)\n";
-            }
-        }
-        if (rhs_kind.tag == KOOPA_RVT_INTEGER) {
-            int imm = rhs_kind.data.integer.value;
-            //r2Reg = resultReg;
-            *riscv += "li " + r2Reg + ", " + to_string(imm) + "\n";
-        }
-        else {
-            int loc = stackTable.access(binary.rhs);
-            if (loc >=2048) {
-                *riscv += "li t3, " + to_string(loc) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "lw " + r2Reg + ", 0(t3)\n";
-            }
-            else {
-                *riscv += "lw " + r2Reg + ", " + to_string(loc) + "(sp)\n";
-            }
-        }
-        
+        LoadValue(r1Reg, binary.lhs);
+        LoadValue(r2Reg, binary.rhs);
+
         switch (binary.op) {
         case KOOPA_RBO_ADD:
-            *riscv += "add " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            Emit(MInst::R("add", resultReg, r1Reg, r2Reg));
             break;
         case KOOPA_RBO_SUB:
-            *riscv += "sub " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            Emit(MInst::R("sub", resultReg, r1Reg, r2Reg));
             break;
         case KOOPA_RBO_MUL:
-            *riscv += "mul " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            // 乘以比较的结果 (0 或 1) 就是选择, Zicond 下不用乘法
+            if (options.zicond && IsCompare(binary.rhs))
+                Emit(MInst::R("czero.eqz", resultReg, r1Reg, r2Reg));
+            else if (options.zicond && IsCompare(binary.lhs))
+                Emit(MInst::R("czero.eqz", resultReg, r2Reg, r1Reg));
+            else
+                Emit(MInst::R("mul", resultReg, r1Reg, r2Reg));
             break;
         case KOOPA_RBO_DIV:
-            *riscv += "div " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            Emit(MInst::R("div", resultReg, r1Reg, r2Reg));
             break;
         case KOOPA_RBO_MOD:
-            *riscv += "rem " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            Emit(MInst::R("rem", resultReg, r1Reg, r2Reg));
             break;
         case KOOPA_RBO_EQ :
-            *riscv += "xor " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
-            *riscv += "seqz " + resultReg + ", " + resultReg + "\n";
+            Emit(MInst::R("xor", resultReg, r1Reg, r2Reg));
+            Emit(MInst::U("seqz", resultReg, resultReg));
             break;
         case KOOPA_RBO_NOT_EQ:
-            *riscv += "xor " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
-            *riscv += "snez " + resultReg + ", " + resultReg + "\n";
+            Emit(MInst::R("xor", resultReg, r1Reg, r2Reg));
+            Emit(MInst::U("snez", resultReg, resultReg));
             break;
         case KOOPA_RBO_LT:
-            *riscv += "slt " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            Emit(MInst::R("slt", resultReg, r1Reg, r2Reg));
             break;
         case KOOPA_RBO_GT:
-            *riscv += "sgt " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            Emit(MInst::R("sgt", resultReg, r1Reg, r2Reg));
             break;
         case KOOPA_RBO_LE:
-            *riscv += "sgt " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
-            *riscv += "seqz " + resultReg + ", " + resultReg + "\n";
+            Emit(MInst::R("sgt", resultReg, r1Reg, r2Reg));
+            Emit(MInst::U("seqz", resultReg, resultReg));
             break;
         case KOOPA_RBO_GE:
-            *riscv += "slt " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
-            *riscv += "seqz " + resultReg + ", " + resultReg + "\n";
+            Emit(MInst::R("slt", resultReg, r1Reg, r2Reg));
+            Emit(MInst::U("seqz", resultReg, resultReg));
             break;
         case KOOPA_RBO_AND:
-            *riscv += "and " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            Emit(MInst::R("and", resultReg, r1Reg, r2Reg));
             break;
         case KOOPA_RBO_OR:
-            *riscv += "or " + resultReg + ", " + r1Reg + ", " + r2Reg + "\n";
+            Emit(MInst::R("or", resultReg, r1Reg, r2Reg));
+            break;
+        case KOOPA_RBO_XOR:
+            Emit(MInst::R("xor", resultReg, r1Reg, r2Reg));
+            break;
+        case KOOPA_RBO_SHL:
+            Emit(MInst::R("sll", resultReg, r1Reg, r2Reg));
+            break;
+        case KOOPA_RBO_SHR:
+            Emit(MInst::R("srl", resultReg, r1Reg, r2Reg));
+            break;
+        case KOOPA_RBO_SAR:
+            Emit(MInst::R("sra", resultReg, r1Reg, r2Reg));
             break;
         }
 
-        int loc = stackTable.access(value);
-        if (loc >= 2048) {
-            *riscv += "li t3, " + to_string(loc) + "\n";
-            *riscv += "add t3, sp, t3\n";
-            *riscv += "sw " + resultReg + ", 0(t3)\n\n";
-        }
-        else {
-            *riscv += "sw " + resultReg + ", " + to_string(loc) + "(sp)\n\n";
-        }
+        StoreSlot(resultReg, stackTable.access(value));
     }
 
     void VisitStore(const koopa_raw_store_t &store) {
@@ -539,144 +812,69 @@ private:
             int pindex = store.value->kind.data.func_arg_ref.index; // start from 0
             int loc = stackTable.access(store.dest);
             if (pindex < 8) {
-                string reg = "a" + to_string(pindex);
-                if (loc >= 2048) {
-                    *riscv += "li t3, " + to_string(loc) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "sw " + reg + ", 0(t3)\n\n";
-                }
-                else {
-                    *riscv += "sw " + reg + ", " + to_string(loc) + "(sp)\n\n";
-                }
+                StoreSlot("a" + to_string(pindex), loc);
             }
             else {
-                int loc2 = stackSpace + 4 * (pindex - 8);
-                if (loc2 >= 2048) {
-                    *riscv += "li t3, " + to_string(loc2) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "lw t0, 0(t3)\n\n";
-                }
-                else {
-                    *riscv += "lw t0, " + to_string(loc2) + "(sp)\n\n";
-                }
-                if (loc >= 2048) {
-                    *riscv += "li t3, " + to_string(loc) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "sw t0, 0(t3)\n\n";
-                }
-                else {
-                    *riscv += "sw t0, " + to_string(loc) + "(sp)\n\n";
-                }
-            } 
+                LoadSlot("t0", stackSpace + 4 * (pindex - 8));
+                StoreSlot("t0", loc);
+            }
         }
         else {
-            if (store.value->kind.tag == KOOPA_RVT_INTEGER) {
-                int val = store.value->kind.data.integer.value;
-                *riscv += "li t0, " + to_string(val) + "\n";
-            }
-            else {
-                int loc = stackTable.access(store.value);
-                if (loc >= 2048) {
-                    *riscv += "li t3, " + to_string(loc) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "lw t0, 0(t3)\n";
-                }
-                else {
-                    *riscv += "lw t0, " + to_string(loc) + "(sp)\n";
-                }
-            }
+            LoadValue("t0", store.value);
 
-            if (store.dest->kind.tag == KOOPA_RVT_GLOBAL_ALLOC) {
-                *riscv += "la t3, " + string(store.dest->name + 1) + "\n";
-                *riscv += "sw t0, 0(t3)\n\n";
+            int offset;
+            if (InGlobalBlock(store.dest, offset)) {
+                Emit(MInst::Sw("t0", offset, "s1"));
+            }
+            else if (store.dest->kind.tag == KOOPA_RVT_GLOBAL_ALLOC) {
+                Emit(MInst::La("t3", string(store.dest->name + 1)));
+                Emit(MInst::Sw("t0", 0, "t3"));
             }
             else if (store.dest->kind.tag == KOOPA_RVT_ALLOC) {
-                int loc = stackTable.access(store.dest);
-                if (loc >= 2048) {
-                    *riscv += "li t3, " + to_string(loc) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "sw t0, 0(t3)\n\n";
-                }
-                else {
-                    *riscv += "sw t0, " + to_string(loc) + "(sp)\n\n";
-                }
+                StoreSlot("t0", stackTable.access(store.dest));
             }
             else {
-                int loc2 = stackTable.access(store.dest);
-                if (loc2 >= 2048) {
-                    *riscv += "li t3, " + to_string(loc2) + "\n";
-                    *riscv += "add t3, sp, t3\n";
-                    *riscv += "lw t3, 0(t3)\n";
-                    *riscv += "sw t0, 0(t3)\n\n";
-                }
-                else {
-                    *riscv += "lw t3, " + to_string(loc2) + "(sp)\n";
-                    *riscv += "sw t0, 0(t3)\n\n";
-                }
+                LoadSlot("t3", stackTable.access(store.dest));
+                Emit(MInst::Sw("t0", 0, "t3"));
             }
         }
     }
 
     void VisitLoad(const koopa_raw_value_t &value) {
         koopa_raw_load_t load = value->kind.data.load;
-        if (load.src->kind.tag == KOOPA_RVT_GLOBAL_ALLOC) {
-            string name = load.src->name + 1;
-            *riscv += "la t0, " + name + "\n";
-            *riscv += "lw t0, 0(t0)\n";
+        int offset;
+        if (InGlobalBlock(load.src, offset)) {
+            Emit(MInst::Lw("t0", offset, "s1"));
         }
-        else if (load.src->kind.tag == KOOPA_RVT_ALLOC) {
-            int loc1 = stackTable.access(load.src);
-            if (loc1 >= 2048) {
-                *riscv += "li t3, " + to_string(loc1) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "lw t0, 0(t3)\n";
-            }
-            else {
-                *riscv += "lw t0, " + to_string(loc1) + "(sp)\n";
-            }
+        else if (load.src->kind.tag == KOOPA_RVT_GLOBAL_ALLOC) {
+            Emit(MInst::La("t0", string(load.src->name + 1)));
+            Emit(MInst::Lw("t0", 0, "t0"));
         }
-        else {
-            int loc1 = stackTable.access(load.src);
-            if (loc1 >= 2048) {
-                *riscv += "li t3, " + to_string(loc1) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "lw t0, 0(t3)\n";
-                *riscv += "lw t0, 0(t0)\n";
-            }
-            else {
-                *riscv += "lw t0, " + to_string(loc1) + "(sp)\n";
-                *riscv += "lw t0, 0(t0)\n";
-            }
-        }
-        int loc2 = stackTable.access(value);
-        if (loc2 >= 2048) {
-            *riscv += "li t3, " + to_string(loc2) + "\n";
-            *riscv += "add t3, sp, t3\n";
-            *riscv += "sw t0, 0(t3)\n\n";
+        else if (load.src->kind.tag == KOOPA_RVT_ALLOC) {
+            LoadSlot("t0", stackTable.access(load.src));
         }
         else {
-            *riscv += "sw t0, " + to_string(loc2) + "(sp)\n\n";
+            LoadSlot("t0", stackTable.access(load.src));
+            Emit(MInst::Lw("t0", 0, "t0"));
         }
+        StoreSlot("t0", stackTable.access(value));
     }
 
     void VisitBranch(const koopa_raw_branch_t &branch) {
-        int loc = stackTable.access(branch.cond);
-        if (loc >= 2048) {
-            *riscv += "li t3, " + to_string(loc) + "\n";
-            *riscv += "add t3, sp, t3\n";
-            *riscv += "lw t0, 0(t3)\n";
+        LoadSlot("t0", stackTable.access(branch.cond));
+        if (branch.true_bb == nextBB) {
+            Emit(MInst::Branch("beqz", "t0", string(branch.false_bb->name + 1)));
         }
         else {
-            *riscv += "lw t0, " + to_string(loc) + "(sp)\n";
+            Emit(MInst::Branch("bnez", "t0", string(branch.true_bb->name + 1)));
+            if (branch.false_bb != nextBB)
+                Emit(MInst::Jump("j", string(branch.false_bb->name + 1)));
         }
-        *riscv += "bnez t0, " + string(branch.true_bb->name + 1) + "\n";
-        *riscv += "j " + string(branch.false_bb->name + 1) + "\n";
-        *riscv += "\n";
     }
 
     void VisitJump(const koopa_raw_jump_t &jump) {
-        *riscv += "j " + string(jump.target->name + 1) + "\n";
-        *riscv += "\n";
+        if (jump.target != nextBB)
+            Emit(MInst::Jump("j", string(jump.target->name + 1)));
     }
 
     void VisitCall(const koopa_raw_value_t &value) {
@@ -686,68 +884,35 @@ private:
 
         for (size_t i = 0; i < call.args.len;i++) {
             koopa_raw_value_t arg = reinterpret_cast<koopa_raw_value_t>(call.args.buffer[i]);
-            
+
             if (i < 8) {
-                string reg = "a" + to_string(i);
-                if (arg->kind.tag == KOOPA_RVT_INTEGER) {
-                    *riscv += "li " + reg + ", " + to_string(arg->kind.data.integer.value) + "\n";
-                }
-                else {
-                    int loc = stackTable.access(arg);
-                    if (loc >= 2048) {
-                        *riscv += "li t3, " + to_string(loc) + "\n";
-                        *riscv += "add t3, sp, t3\n";
-                        *riscv += "lw " + reg + ", 0(t3)\n";
-                    }
-                    else {
-                        *riscv += "lw " + reg + ", " + to_string(loc) + "(sp)\n";
-                    }
-                }
+                LoadValue("a" + to_string(i), arg);
             }
             else {
-                string argLoc = to_string((i - 8) * 4);
-                if (arg->kind.tag == KOOPA_RVT_INTEGER) {
-                    *riscv += "li t0, " + to_string(arg->kind.data.integer.value) + "\n";
-                    *riscv += "sw t0, " + argLoc +"(sp)\n";
-                }
-                else {
-                    int loc = stackTable.access(arg);
-                    if (loc >= 2048) {
-                        *riscv += "li t3, " + to_string(loc) + "\n";
-                        *riscv += "add t3, sp, t3\n";
-                        *riscv += "lw t0, 0(t3)\n";
-                    }
-                    else {
-                        *riscv += "lw t0, " + to_string(loc) + "(sp)\n";
-                    }
-                    *riscv += "sw t0, " + argLoc +"(sp)\n";
-                }
+                LoadValue("t0", arg);
+                Emit(MInst::Sw("t0", (i - 8) * 4, "sp"));
             }
         }
 
-        *riscv += "call " + string(call.callee->name + 1) + "\n";
-        if (hasType) {
-            int loc = stackTable.access(value);
-            if (loc >= 2048) {
-                *riscv += "li t3, " + to_string(loc) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "sw a0, 0(t3)\n\n";
-            }
-            else {
-                *riscv += "sw a0, " + to_string(loc) + "(sp)\n\n";
-            }
-        }
+        Emit(MInst::Jump("call", string(call.callee->name + 1)));
+        if (hasType)
+            StoreSlot("a0", stackTable.access(value));
     }
 
-    void GlobalAllocArrayDFS(const koopa_raw_slice_t &slices) {
+    // 连续的零合并为一条 .zero，zeroBytes 为尚未输出的零的字节数
+    void GlobalAllocArrayDFS(const koopa_raw_slice_t &slices, int &zeroBytes, vector<MDataItem> &items) {
         for (size_t i = 0; i < slices.len; i++) {
             koopa_raw_value_t inst = reinterpret_cast<koopa_raw_value_t>(slices.buffer[i]);
-            if (inst->kind.tag == KOOPA_RVT_INTEGER) {
-                *riscv += "  .word " + to_string(inst->kind.data.integer.value) + "\n";
+            if (IsZeroInit(inst)) {
+                zeroBytes += TypeSize(inst->ty);
+            }
+            else if (inst->kind.tag == KOOPA_RVT_INTEGER) {
+                FlushZero(zeroBytes, items);
+                items.push_back({false, inst->kind.data.integer.value});
             }
             else if (inst->kind.tag == KOOPA_RVT_AGGREGATE) {
                 auto new_slices = inst->kind.data.aggregate.elems;
-                GlobalAllocArrayDFS(new_slices);
+                GlobalAllocArrayDFS(new_slices, zeroBytes, items);
             }
             else {
                 assert(false);
@@ -755,11 +920,61 @@ private:
         }
     }
 
+    void FlushZero(int &zeroBytes, vector<MDataItem> &items) {
+        if (zeroBytes > 0)
+            items.push_back({true, zeroBytes});
+        zeroBytes = 0;
+    }
+
+    // 初始值全为零，包括全零的 aggregate
+    bool IsZeroInit(const koopa_raw_value_t &init) {
+        if (init->kind.tag == KOOPA_RVT_ZERO_INIT || init->kind.tag == KOOPA_RVT_UNDEF)
+            return true;
+        if (init->kind.tag == KOOPA_RVT_INTEGER)
+            return init->kind.data.integer.value == 0;
+        if (init->kind.tag == KOOPA_RVT_AGGREGATE) {
+            auto elems = init->kind.data.aggregate.elems;
+            for (size_t i = 0; i < elems.len; i++) {
+                if (!IsZeroInit(reinterpret_cast<koopa_raw_value_t>(elems.buffer[i])))
+                    return false;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // 放在同一块中的全局变量，都在 .data 中
+    void VisitGlobalBlock() {
+        if (globalBlock.empty())
+            return;
+        MGlobal start;
+        start.section = ".data";
+        start.name = ".Lglobal_block";
+        start.globl = false;
+        module->globals.push_back(start);
+        for (auto value : globalBlock)
+            GlobalAllocData(value, "");
+    }
+
     void VisitGlobalAlloc(const koopa_raw_value_t &value) {
+        if (globalOffset.find(value) != globalOffset.end())
+            return;
+        koopa_raw_global_alloc_t global = value->kind.data.global_alloc;
+        // 全零的变量放在 .bss，不占用可执行文件的空间
+        if (IsZeroInit(global.init))
+            GlobalAllocData(value, ".bss");
+        else if (writtenGlobals.find(value) == writtenGlobals.end())
+            GlobalAllocData(value, ".section .rodata");
+        else
+            GlobalAllocData(value, ".data");
+    }
+
+    void GlobalAllocData(const koopa_raw_value_t &value, const string &section) {
         koopa_raw_global_alloc_t global = value->kind.data.global_alloc;
-        *riscv += "  .data\n";
-        *riscv += "  .globl " + string(value->name + 1) + "\n";
-        *riscv += string(value->name + 1) + ":\n";
+        bool zero = IsZeroInit(global.init);
+        MGlobal data;
+        data.section = section;
+        data.name = string(value->name + 1);
 
         int space = 4;
         if (value->ty->data.pointer.base->tag == KOOPA_RTT_ARRAY) {
@@ -773,170 +988,100 @@ private:
             globalArrTable.insert(value, dim);
         }
 
-        if (global.init->kind.tag == KOOPA_RVT_ZERO_INIT) {
-            *riscv += "  .zero " + to_string(space) + "\n\n";
+        if (zero) {
+            data.items.push_back({true, space});
         }
         else if (global.init->kind.tag == KOOPA_RVT_INTEGER) {
-            *riscv += "  .word " + to_string(global.init->kind.data.integer.value) + "\n\n";
+            data.items.push_back({false, global.init->kind.data.integer.value});
         }
         else if (global.init->kind.tag == KOOPA_RVT_AGGREGATE) {
             auto slices = global.init->kind.data.aggregate.elems;
-            GlobalAllocArrayDFS(slices);
-            *riscv += "\n";
+            int zeroBytes = 0;
+            GlobalAllocArrayDFS(slices, zeroBytes, data.items);
+            FlushZero(zeroBytes, data.items);
         }
+        module->globals.push_back(data);
     }
 
-    void VisitGetElemPtr(const koopa_raw_value_t &value) {
-        koopa_raw_get_elem_ptr_t getElemPtr = value->kind.data.get_elem_ptr;
-        int arrOffset;
-        if (getElemPtr.src->kind.tag == KOOPA_RVT_ALLOC) {
-            auto arrPtr = getElemPtr.src;
-            vector<int> dim;
-            arrTable.get(arrPtr, dim);
-            arrOffset = 4;
-            for (auto it = dim.begin() + 1; it != dim.end();it++) {
-                arrOffset *= *it;
-            }
-            offsetTable.insert(value, offsetData{arrOffset, 1, arrPtr});
-        }
-        else if (getElemPtr.src->kind.tag == KOOPA_RVT_GLOBAL_ALLOC) {
-            auto arrPtr = getElemPtr.src;
-            vector<int> dim;
-            globalArrTable.get(arrPtr, dim);
-            arrOffset = 4;
-            for (auto it = dim.begin() + 1; it != dim.end();it++) {
-                arrOffset *= *it;
-            }
-            offsetTable.insert(value, offsetData{arrOffset, 1, arrPtr});
-        }
-        else {
-            offsetData data = offsetTable.get(getElemPtr.src);
-            vector<int> dim;
-            if (data.arr->kind.tag == KOOPA_RVT_ALLOC)
-                arrTable.get(data.arr, dim);
-            else if (data.arr->kind.tag == KOOPA_RVT_GLOBAL_ALLOC)
-                globalArrTable.get(data.arr, dim);
-            arrOffset = data.offset / dim[data.index];
-            data.offset = arrOffset;
-            data.index++;
-            offsetTable.insert(value, data);
-        }
 
-        if (getElemPtr.src->kind.tag == KOOPA_RVT_ALLOC) {
-            int loc = stackTable.access(getElemPtr.src);
-            if (loc >= 2048) {
-                *riscv += "li t0, " + to_string(loc) + "\n";
-                *riscv += "add t0, sp, t0\n";
+    // size in bytes of a value of type ty
+    int TypeSize(const koopa_raw_type_t &ty) {
+        if (ty->tag == KOOPA_RTT_ARRAY)
+            return ty->data.array.len * TypeSize(ty->data.array.base);
+        return 4;
+    }
+
+    // t0 = t0 + stride * index
+    void AddOffset(int stride, const koopa_raw_value_t &index) {
+        if (index->kind.tag == KOOPA_RVT_INTEGER) {
+            int offset = stride * index->kind.data.integer.value;
+            if (offset == 0)
+                return;
+            if (offset >= -2048 && offset < 2048) {
+                Emit(MInst::I("addi", "t0", "t0", offset));
             }
             else {
-                *riscv += "addi t0, sp, " + to_string(loc) + "\n";
+                Emit(MInst::Li("t1", offset));
+                Emit(MInst::R("add", "t0", "t0", "t1"));
             }
+            return;
         }
-        else if (getElemPtr.src->kind.tag == KOOPA_RVT_GLOBAL_ALLOC) {
-            string name = getElemPtr.src->name + 1;
-            *riscv += "la t0, " + name + "\n";
+        LoadSlot("t2", stackTable.access(index));
+        if (stride == 4) {
+            Emit(MInst::I("slli", "t1", "t2", 2));
         }
         else {
-            int loc = stackTable.access(getElemPtr.src);
-            if (loc >= 2048) {
-                *riscv += "li t3, " + to_string(loc) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "lw t0, 0(t3)\n";
-            }
-            else {
-                *riscv += "lw t0, " + to_string(loc) + "(sp)\n";
-            }
+            Emit(MInst::Li("t1", stride));
+            Emit(MInst::R("mul", "t1", "t1", "t2"));
         }
+        Emit(MInst::R("add", "t0", "t0", "t1"));
+    }
 
-        *riscv += "li t1, " + to_string(arrOffset) + "\n";
+    // the stride comes from the type of the result, so the source can be any pointer
+    void VisitGetElemPtr(const koopa_raw_value_t &value) {
+        koopa_raw_get_elem_ptr_t getElemPtr = value->kind.data.get_elem_ptr;
+        int arrOffset = TypeSize(value->ty->data.pointer.base);
 
-        if (getElemPtr.index->kind.tag == KOOPA_RVT_INTEGER) {
-            int imm = getElemPtr.index->kind.data.integer.value;
-            *riscv += "li t2, " + to_string(imm) + "\n";
+        int offset;
+        if (InGlobalBlock(getElemPtr.src, offset)) {
+            Emit(MInst::I("addi", "t0", "s1", offset));
         }
-        else {
-            int loc = stackTable.access(getElemPtr.index);
-            if (loc >=2048) {
-                *riscv += "li t3, " + to_string(loc) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "lw t2, 0(t3)\n";
+        else if (getElemPtr.src->kind.tag == KOOPA_RVT_ALLOC) {
+            int loc = stackTable.access(getElemPtr.src);
+            if (loc >= 2048) {
+                Emit(MInst::Li("t0", loc));
+                Emit(MInst::R("add", "t0", "sp", "t0"));
             }
             else {
-                *riscv += "lw t2, " + to_string(loc) + "(sp)\n";
+                Emit(MInst::I("addi", "t0", "sp", loc));
             }
         }
-
-        *riscv += "mul t1, t1, t2\n";
-        *riscv += "add t0, t0, t1\n";
-
-        int loc = stackTable.access(value);
-        if (loc >= 2048) {
-            *riscv += "li t3, " + to_string(loc) + "\n";
-            *riscv += "add t3, sp, t3\n";
-            *riscv += "sw t0, 0(t3)\n\n";
+        else if (getElemPtr.src->kind.tag == KOOPA_RVT_GLOBAL_ALLOC) {
+            Emit(MInst::La("t0", string(getElemPtr.src->name + 1)));
         }
         else {
-            *riscv += "sw t0, " + to_string(loc) + "(sp)\n\n";
+            LoadSlot("t0", stackTable.access(getElemPtr.src));
         }
+
+        AddOffset(arrOffset, getElemPtr.index);
+
+        StoreSlot("t0", stackTable.access(value));
     }
 
     void VisitGetPtr(const koopa_raw_value_t &value) {
         koopa_raw_get_ptr_t getPtr = value->kind.data.get_ptr;
+        int arrOffset = TypeSize(getPtr.src->ty->data.pointer.base);
 
-        int arrOffset;
-        auto arrPtr = getPtr.src->kind.data.load.src;
-        vector<int> dim;
-        arrTable.get(arrPtr, dim);
-        arrOffset = 4;
-        for (auto it = dim.begin() + 1; it != dim.end();it++) {
-            arrOffset *= *it;
-        }
-        offsetTable.insert(value, offsetData{arrOffset, 1, arrPtr});
-
-        int loc = stackTable.access(getPtr.src);
-        if (loc >= 2048) {
-            *riscv += "li t3, " + to_string(loc) + "\n";
-            *riscv += "add t3, sp, t3\n";
-            *riscv += "lw t0, 0(t3)\n";
-        }
-        else {
-            *riscv += "lw t0, " + to_string(loc) + "(sp)\n";
-        }
-
-        *riscv += "li t1, " + to_string(arrOffset) + "\n";
+        LoadSlot("t0", stackTable.access(getPtr.src));
 
-        if (getPtr.index->kind.tag == KOOPA_RVT_INTEGER) {
-            int imm = getPtr.index->kind.data.integer.value;
-            *riscv += "li t2, " + to_string(imm) + "\n";
-        }
-        else {
-            int loc = stackTable.access(getPtr.index);
-            if (loc >=2048) {
-                *riscv += "li t3, " + to_string(loc) + "\n";
-                *riscv += "add t3, sp, t3\n";
-                *riscv += "lw t2, 0(t3)\n";
-            }
-            else {
-                *riscv += "lw t2, " + to_string(loc) + "(sp)\n";
-            }
-        }
+        AddOffset(arrOffset, getPtr.index);
 
-        *riscv += "mul t1, t1, t2\n";
-        *riscv += "add t0, t0, t1\n";
-
-        loc = stackTable.access(value);
-        if (loc >= 2048) {
-            *riscv += "li t3, " + to_string(loc) + "\n";
-            *riscv += "add t3, sp, t3\n";
-            *riscv += "sw t0, 0(t3)\n\n";
-        }
-        else {
-            *riscv += "sw t0, " + to_string(loc) + "(sp)\n\n";
-        }
+        StoreSlot("t0", stackTable.access(value));
     }
 };
 
-void toRISCV(const string str, string *result) {
+// 把 Koopa IR 翻译为机器层的模块
+static void toModule(const string str, MModule *module) {
     // 解析字符串 str, 得到 Koopa IR 程序
     koopa_program_t program;
     koopa_error_code_t ret = koopa_parse_from_string(str.c_str(), &program);
@@ -948,12 +1093,25 @@ void toRISCV(const string str, string *result) {
     // 释放 Koopa IR 程序占用的内存
     koopa_delete_program(program);
 
-    KoopaVisitor visitor(result);
+    KoopaVisitor visitor(module);
     visitor.Visit(raw);
-    //cout << *result;
 
     // 处理完成, 释放 raw program builder 占用的内存
     // 注意, raw program 中所有的指针指向的内存均为 raw program builder 的内存
     // 所以不要在 raw program 处理完毕之前释放 builder
     koopa_delete_raw_program_builder(builder);
-}
\ No newline at end of file
+}
+
+void toRISCV(const string str, string *result) {
+    MModule module;
+    toModule(str, &module);
+    *result = PrintModule(module);
+    //cout << *result;
+}
+
+// 直接输出可重定位的 ELF 目标文件, 不经过汇编器
+void toObject(const string str, string *result) {
+    MModule module;
+    toModule(str, &module);
+    *result = ElfWriter(module).Write();
+}